@@ -0,0 +1,93 @@
+#pragma once
+
+#include <algorithm>
+
+#include "common.h"
+#include "vec3.h"
+
+// Axis-aligned bounding box. A default constructed box is empty and expanding it
+// with any point or box yields that point or box. The bounds are double whatever Real
+// is, so BVH nodes have one layout in both precisions and scene files load in either.
+class Aabb {
+public:
+    using Point = BasicVec3<double>;
+
+    constexpr Aabb()
+        : min_{POSITIVE_INFINITY, POSITIVE_INFINITY, POSITIVE_INFINITY}
+        , max_{-POSITIVE_INFINITY, -POSITIVE_INFINITY, -POSITIVE_INFINITY} {}
+    template <typename T>
+    constexpr Aabb(const BasicVec3<T>& min, const BasicVec3<T>& max) : min_{Point(min)}, max_{Point(max)} {}
+
+    const Point& min() const {
+        return min_;
+    }
+
+    const Point& max() const {
+        return max_;
+    }
+
+    bool is_empty() const {
+        return min_[0] > max_[0] || min_[1] > max_[1] || min_[2] > max_[2];
+    }
+
+    template <typename T>
+    void expand(const BasicVec3<T>& point) {
+        for (int axis = 0; axis < 3; axis++) {
+            min_[axis] = std::min<double>(min_[axis], point[axis]);
+            max_[axis] = std::max<double>(max_[axis], point[axis]);
+        }
+    }
+
+    void expand(const Aabb& box) {
+        for (int axis = 0; axis < 3; axis++) {
+            min_[axis] = std::min(min_[axis], box.min_[axis]);
+            max_[axis] = std::max(max_[axis], box.max_[axis]);
+        }
+    }
+
+    Point centroid() const {
+        return 0.5 * (min_ + max_);
+    }
+
+    Point extent() const {
+        return max_ - min_;
+    }
+
+    double surface_area() const {
+        if (is_empty()) {
+            return 0.0;
+        }
+        Point d = extent();
+        return 2.0 * (d[0] * d[1] + d[1] * d[2] + d[2] * d[0]);
+    }
+
+    int longest_axis() const {
+        Point d = extent();
+        if (d[0] > d[1] && d[0] > d[2]) {
+            return 0;
+        }
+        return d[1] > d[2] ? 1 : 2;
+    }
+
+    // Slab test. Comparisons are written so that NaNs (0 * inf, for rays parallel to
+    // a slab that start on its plane) never shrink the interval.
+    bool hit(const Vec3& origin, const Vec3& inverse_direction, double t_min, double t_max) const {
+        for (int axis = 0; axis < 3; axis++) {
+            double t0 = (min_[axis] - origin[axis]) * inverse_direction[axis];
+            double t1 = (max_[axis] - origin[axis]) * inverse_direction[axis];
+            if (inverse_direction[axis] < 0.0) {
+                std::swap(t0, t1);
+            }
+            t_min = t0 > t_min ? t0 : t_min;
+            t_max = t1 < t_max ? t1 : t_max;
+            if (t_max < t_min) {
+                return false;
+            }
+        }
+        return true;
+    }
+
+private:
+    Point min_;
+    Point max_;
+};
@@ -0,0 +1,63 @@
+#pragma once
+
+#include <cstddef>
+#include <vector>
+
+// Array that either owns its elements or views elements owned elsewhere, such as a
+// memory-mapped scene file. Readers see the same contiguous data either way.
+template <typename T>
+class ArrayStorage {
+public:
+    ArrayStorage() {}
+
+    // The viewed memory has to outlive the storage and every copy of it.
+    static ArrayStorage view(const T* data, std::size_t size) {
+        ArrayStorage storage;
+        storage.view_data_ = data;
+        storage.view_size_ = size;
+        return storage;
+    }
+
+    bool is_view() const {
+        return view_data_ != nullptr;
+    }
+
+    const T* data() const {
+        return view_data_ ? view_data_ : owned_.data();
+    }
+
+    std::size_t size() const {
+        return view_data_ ? view_size_ : owned_.size();
+    }
+
+    bool empty() const {
+        return size() == 0;
+    }
+
+    const T& operator[](std::size_t index) const {
+        return data()[index];
+    }
+
+    const T* begin() const {
+        return data();
+    }
+
+    const T* end() const {
+        return data() + size();
+    }
+
+    // Mutable access, after copying a view into owned storage.
+    std::vector<T>& vector() {
+        if (view_data_) {
+            owned_.assign(view_data_, view_data_ + view_size_);
+            view_data_ = nullptr;
+            view_size_ = 0;
+        }
+        return owned_;
+    }
+
+private:
+    std::vector<T> owned_;
+    const T* view_data_ = nullptr;
+    std::size_t view_size_ = 0;
+};
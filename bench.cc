@@ -0,0 +1,1035 @@
+#include <chrono>
+#include <cmath>
+#include <cstring>
+#include <filesystem>
+#include <fstream>
+#include <iostream>
+#include <limits>
+#include <sstream>
+#include <string>
+#include <thread>
+#include <type_traits>
+#include <vector>
+
+#include "bench.h"
+#include "camera.h"
+#include "common.h"
+#include "denoiser.h"
+#include "distributed_renderer.h"
+#include "engine.h"
+#include "framebuffer.h"
+#include "image_writer.h"
+#include "material.h"
+#include "mesh.h"
+#include "obj_loader.h"
+#include "parallel_renderer.h"
+#include "ppm.h"
+#include "renderer.h"
+#include "scene_file.h"
+#include "scenes.h"
+#include "sphere_soa.h"
+#include "streaming_renderer.h"
+#include "thread_pool.h"
+
+using Clock = std::chrono::steady_clock;
+
+constexpr double aspect_ratio = 16.0 / 9.0;
+constexpr int max_ray_bounce_depth = 50;
+
+struct BenchScene {
+    std::string name;
+    World world;
+    Camera camera;
+};
+
+Camera cover_camera() {
+    return Camera({13, 2, 3}, {0, 0, 0}, {0, 1, 0}, 45.0, aspect_ratio, 0.1, 10.0);
+}
+
+Camera tutorial_camera() {
+    return Camera({0, 0, 0}, {0, 0, -1}, {0, 1, 0}, 90.0, aspect_ratio, 0.0, 1.0);
+}
+
+Camera room_camera() {
+    return Camera({0, 1, 3.3}, {0, 1, 0}, {0, 1, 0}, 50.0, aspect_ratio, 0.0, 1.0);
+}
+
+// The worlds built in main.cc plus a large generated one, all with a BVH.
+std::vector<BenchScene> make_scenes() {
+    std::vector<BenchScene> scenes;
+    scenes.push_back({"three_spheres", three_spheres_world(), tutorial_camera()});
+    scenes.push_back({"two_spheres", two_spheres_world(), tutorial_camera()});
+    Sampler sampler{1};
+    scenes.push_back({"random", random_world(sampler), cover_camera()});
+    Sampler large_sampler{2};
+    scenes.push_back({"large_random", random_world(large_sampler, 150), cover_camera()});
+    scenes.push_back({"lit_room", lit_room_world(), room_camera()});
+    for (auto& scene : scenes) {
+        scene.world.build_bvh();
+    }
+    return scenes;
+}
+
+// Camera rays through random pixels of a 1920x1080 image.
+std::vector<Ray> make_camera_rays(const Camera& camera, int count) {
+    std::vector<Ray> rays;
+    Sampler sampler{7};
+    for (int i = 0; i < count; i++) {
+        rays.push_back(camera.ray_at(random_double(sampler), random_double(sampler), sampler));
+    }
+    return rays;
+}
+
+void bench_micro(BenchmarkSuite& suite, const std::vector<BenchScene>& scenes) {
+    const BenchScene& random_scene = scenes[2];
+    const std::vector<Ray> rays = make_camera_rays(random_scene.camera, 4096);
+    const std::size_t ray_mask = rays.size() - 1;
+
+    Sampler sampler{3};
+    suite.run_microbenchmark("micro/random_double", [&](uint64_t) {
+        do_not_optimize(random_double(sampler));
+    });
+
+    suite.run_microbenchmark("micro/camera_ray_at", [&](uint64_t i) {
+        double s = (i & 1023) / 1023.0;
+        do_not_optimize(random_scene.camera.ray_at(s, 1.0 - s, sampler));
+    });
+
+    const Sphere sphere({0, 1, 0}, 1.0);
+    const MaterialId material_id = 0;
+    suite.run_microbenchmark("micro/hit_sphere", [&](uint64_t i) {
+        do_not_optimize(detail::hit_sphere(rays[i & ray_mask], material_id, sphere));
+    });
+
+    // One call tests 64 spheres of the random scene.
+    const SphereSoA& spheres = random_scene.world.spheres();
+    for (SimdLevel level : {SimdLevel::scalar, SimdLevel::sse2, SimdLevel::avx2}) {
+        if (level > simd_level()) {
+            continue;
+        }
+        suite.run_microbenchmark(std::string("micro/sphere_kernel_64/") + to_debug(level), [&](uint64_t i) {
+            double t_max = POSITIVE_INFINITY;
+            uint32_t hit_index = 0;
+            do_not_optimize(closest_sphere_hit(spheres, 64, 64, rays[i & ray_mask], 0.001, t_max, hit_index, level));
+        });
+    }
+
+    for (const auto& scene : scenes) {
+        Engine engine{};
+        std::vector<Ray> scene_rays = make_camera_rays(scene.camera, 4096);
+        suite.run_microbenchmark("micro/hit_world/" + scene.name, [&](uint64_t i) {
+            do_not_optimize(engine.hit_world(scene.world, scene_rays[i & ray_mask], 0.001, POSITIVE_INFINITY));
+        });
+    }
+    World linear_world = [] {
+        Sampler world_sampler{1};
+        return random_world(world_sampler);
+    }();
+    suite.run_microbenchmark("micro/hit_world/random_linear", [&](uint64_t i) {
+        Engine engine{};
+        do_not_optimize(engine.hit_world(linear_world, rays[i & ray_mask], 0.001, POSITIVE_INFINITY));
+    });
+
+    // Scatter at a fixed hit point, with a spread of incoming directions.
+    const ScatterInfo scatter_info{{0, 1, 0}, {0, 1, 0}, true};
+    const LambertianMaterial lambertian{Vec3{0.4, 0.2, 0.1}};
+    const MetalMaterial metal{{0.7, 0.6, 0.5}, 0.3};
+    const DielectricMaterial dielectric{1.5};
+    suite.run_microbenchmark("micro/scatter/lambertian", [&](uint64_t i) {
+        do_not_optimize(lambertian.scatter(rays[i & ray_mask], scatter_info, sampler));
+    });
+    suite.run_microbenchmark("micro/scatter/metal", [&](uint64_t i) {
+        do_not_optimize(metal.scatter(rays[i & ray_mask], scatter_info, sampler));
+    });
+    suite.run_microbenchmark("micro/scatter/dielectric", [&](uint64_t i) {
+        do_not_optimize(dielectric.scatter(rays[i & ray_mask], scatter_info, sampler));
+    });
+
+    std::ostringstream out;
+    const Vec3 pixel{0.25, 0.5, 0.75};
+    suite.run_microbenchmark("micro/write_pixel", [&](uint64_t i) {
+        if ((i & 65535) == 0) {
+            out.str("");
+        }
+        write_pixel(out, pixel);
+    });
+
+    Framebuffer frame{1920, 1080, Vec3{0.25, 0.5, 0.75}};
+    for (ImageFormat format : {ImageFormat::ppm, ImageFormat::pfm}) {
+        std::string name = format == ImageFormat::ppm ? "micro/write_image_1080p/ppm" : "micro/write_image_1080p/pfm";
+        suite.run_microbenchmark(name, [&](uint64_t) {
+            std::ostringstream image_out;
+            write_image(image_out, frame, format);
+            do_not_optimize(image_out.tellp());
+        });
+    }
+
+    if (suite.should_run("micro/bvh_build/large_random")) {
+        Sampler world_sampler{2};
+        World world = random_world(world_sampler, 150);
+        auto start = Clock::now();
+        world.build_bvh();
+        double seconds = std::chrono::duration<double>(Clock::now() - start).count();
+        suite.add({"micro/bvh_build/large_random", {
+            {"ns_per_op", 1e9 * seconds}, {"primitives", double(world.spheres().size())}}});
+    }
+
+    // Spheres sharing one centre, or lined up along one axis, give the builder nothing to
+    // split by. The hierarchy over them has to find the same hits as the linear scan.
+    if (suite.should_run("micro/bvh_build/degenerate")) {
+        auto degenerate_world = [] {
+            World world;
+            for (int i = 0; i < 64; i++) {
+                world.add(Sphere({0, 0, -3}, 0.5 + 0.01 * i), LambertianMaterial{Vec3{0.5, 0.5, 0.5}});
+            }
+            for (int i = 0; i < 64; i++) {
+                world.add(Sphere({0.1 * i - 3.2, 1, -4}, 0.04), LambertianMaterial{Vec3{0.5, 0.5, 0.5}});
+            }
+            return world;
+        };
+        World linear_world = degenerate_world();
+        World bvh_world = degenerate_world();
+        bvh_world.build_bvh();
+        Engine engine{};
+        int mismatches = 0;
+        for (const Ray& ray : make_camera_rays(tutorial_camera(), 4096)) {
+            std::optional<HitRecord> linear_hit = engine.hit_world(linear_world, ray, 0.001, POSITIVE_INFINITY);
+            std::optional<HitRecord> bvh_hit = engine.hit_world(bvh_world, ray, 0.001, POSITIVE_INFINITY);
+            if (linear_hit.has_value() != bvh_hit.has_value() || (linear_hit && linear_hit->t != bvh_hit->t)) {
+                mismatches++;
+            }
+        }
+        suite.add({"micro/bvh_build/degenerate", {{"rays", 4096}, {"mismatches", double(mismatches)}}});
+    }
+}
+
+// A ParallelRenderer render, timed, with the rays its threads traced.
+struct TimedRender {
+    RenderedImage image;
+    double seconds = 0.0;
+    uint64_t rays = 0;
+    double samples = 0.0;
+
+    double samples_per_s() const {
+        return samples / seconds;
+    }
+
+    double mrays_per_s() const {
+        return rays / seconds / 1e6;
+    }
+};
+
+TimedRender timed_render(const Renderer& renderer, int num_threads) {
+    std::vector<ThreadStats> thread_stats;
+    auto start = Clock::now();
+    RenderedImage image = ParallelRenderer{renderer}.render(num_threads, &thread_stats);
+    TimedRender render{std::move(image), std::chrono::duration<double>(Clock::now() - start).count()};
+    for (const auto& stats : thread_stats) {
+        render.rays += stats.rays_traced;
+    }
+    render.samples = double(renderer.image_width()) * renderer.image_height() * renderer.samples_per_pixel();
+    return render;
+}
+
+// Fixed-seed renders of every scene on all hardware threads.
+void bench_render(BenchmarkSuite& suite, const std::vector<BenchScene>& scenes) {
+    const int image_width = 320;
+    const int image_height = static_cast<int>(image_width / aspect_ratio);
+    const int samples_per_pixel = 16;
+    const int num_threads = std::max(1u, std::thread::hardware_concurrency());
+
+    for (const auto& scene : scenes) {
+        std::string name = "render/" + scene.name;
+        if (!suite.should_run(name)) {
+            continue;
+        }
+        Renderer renderer{scene.world, scene.camera, image_width, image_height, samples_per_pixel, max_ray_bounce_depth, 1};
+        TimedRender render = timed_render(renderer, num_threads);
+
+        // The mean pixel value changes whenever the image does, for any reason.
+        double image_mean = 0.0;
+        for (const auto& pixel : render.image.color.pixels()) {
+            image_mean += (pixel[0] + pixel[1] + pixel[2]) / 3.0;
+        }
+        image_mean /= render.image.color.pixels().size();
+
+        suite.add({name, {
+            {"seconds", render.seconds},
+            {"samples_per_s", render.samples_per_s()},
+            {"mrays_per_s", render.mrays_per_s()},
+            {"image_mean", image_mean},
+        }});
+    }
+}
+
+double rmse(const Framebuffer& image, const Framebuffer& reference) {
+    double sum = 0.0;
+    for (std::size_t i = 0; i < image.pixels().size(); i++) {
+        sum += (image.pixels()[i] - reference.pixels()[i]).length_squared();
+    }
+    return std::sqrt(sum / (3.0 * image.pixels().size()));
+}
+
+Framebuffer render_reference(const Renderer& renderer) {
+    Framebuffer reference{renderer.image_width(), renderer.image_height()};
+    for (int row = 0; row < renderer.image_height(); row++) {
+        for (int col = 0; col < renderer.image_width(); col++) {
+            reference.at(row, col) = renderer.color_at(row, col);
+        }
+    }
+    return reference;
+}
+
+// Adds whole passes of one sample per pixel until the time budget runs out, so the
+// engines are compared at equal wall time rather than at equal sample counts.
+BenchmarkResult run_path_tracing(
+        const std::string& name,
+        const Renderer& renderer,
+        const EngineOptions& engine_options,
+        double time_budget_seconds,
+        const Framebuffer& reference) {
+    Engine engine{engine_options};
+    Framebuffer accumulated{renderer.image_width(), renderer.image_height()};
+    int passes = 0;
+    auto start = Clock::now();
+    double seconds = 0.0;
+    while (seconds < time_budget_seconds) {
+        for (int row = 0; row < renderer.image_height(); row++) {
+            for (int col = 0; col < renderer.image_width(); col++) {
+                accumulated.at(row, col) += renderer.sample(engine, row, col, passes);
+            }
+        }
+        passes++;
+        seconds = std::chrono::duration<double>(Clock::now() - start).count();
+    }
+
+    Framebuffer image{renderer.image_width(), renderer.image_height()};
+    for (int row = 0; row < renderer.image_height(); row++) {
+        for (int col = 0; col < renderer.image_width(); col++) {
+            image.at(row, col) = accumulated.at(row, col) / passes;
+        }
+    }
+    double samples = double(passes) * renderer.image_width() * renderer.image_height();
+    return {name, {
+        {"spp", double(passes)},
+        {"samples_per_s", samples / seconds},
+        {"mrays_per_s", engine.rays_traced() / seconds / 1e6},
+        {"rays_per_sample", engine.rays_traced() / samples},
+        {"rmse", rmse(image, reference)},
+    }};
+}
+
+void bench_path_tracing(BenchmarkSuite& suite, const std::vector<BenchScene>& scenes) {
+    if (!suite.should_run("path_tracing/")) {
+        return;
+    }
+    const BenchScene& scene = scenes[2];
+    const int image_width = 96;
+    const int image_height = static_cast<int>(image_width / aspect_ratio);
+    const double time_budget_seconds = 8 * suite.options().min_seconds;
+
+    // The reference uses the exhaustive recursive tracer and a different seed than the
+    // runs it is compared against.
+    EngineOptions reference_options{.path_tracing = PathTracing::recursive};
+    Renderer reference_renderer{
+        scene.world, scene.camera, image_width, image_height, 256, max_ray_bounce_depth, 1000, reference_options};
+    Framebuffer reference = render_reference(reference_renderer);
+
+    Renderer renderer{scene.world, scene.camera, image_width, image_height, 1, max_ray_bounce_depth, 1};
+    suite.add(run_path_tracing(
+        "path_tracing/recursive", renderer, {.path_tracing = PathTracing::recursive}, time_budget_seconds, reference));
+    suite.add(run_path_tracing(
+        "path_tracing/iterative", renderer, {.path_tracing = PathTracing::iterative}, time_budget_seconds, reference));
+}
+
+// Light sampling against lights found by scattered rays alone, in the lit room with equal
+// time, and the cost of a shadow ray (any hit) against a closest-hit ray.
+void bench_light_sampling(BenchmarkSuite& suite, const std::vector<BenchScene>& scenes) {
+    if (suite.should_run("lights/")) {
+        const BenchScene& scene = scenes[4];
+        const int image_width = 96;
+        const int image_height = static_cast<int>(image_width / aspect_ratio);
+        const double time_budget_seconds = 8 * suite.options().min_seconds;
+
+        // The reference samples the lights too, but with many more samples and another seed.
+        Renderer reference_renderer{scene.world, scene.camera, image_width, image_height, 1024, max_ray_bounce_depth, 1000};
+        Framebuffer reference = render_reference(reference_renderer);
+
+        Renderer renderer{scene.world, scene.camera, image_width, image_height, 1, max_ray_bounce_depth, 1};
+        suite.add(run_path_tracing("lights/sampled", renderer, {.sample_lights = true}, time_budget_seconds, reference));
+        suite.add(run_path_tracing("lights/unsampled", renderer, {.sample_lights = false}, time_budget_seconds, reference));
+    }
+
+    const std::size_t ray_mask = 4095;
+    for (std::size_t scene_index : {2, 3}) {
+        const BenchScene& scene = scenes[scene_index];
+        Engine engine{};
+        std::vector<Ray> rays = make_camera_rays(scene.camera, ray_mask + 1);
+        suite.run_microbenchmark("lights/closest_hit/" + scene.name, [&](uint64_t i) {
+            do_not_optimize(engine.hit_world(scene.world, rays[i & ray_mask], 0.001, POSITIVE_INFINITY));
+        });
+        suite.run_microbenchmark("lights/shadow_ray/" + scene.name, [&](uint64_t i) {
+            do_not_optimize(engine.occluded(scene.world, rays[i & ray_mask], 0.001, POSITIVE_INFINITY));
+        });
+    }
+}
+
+// The same renders with the iterative and the wavefront engine. The images have to match.
+void bench_wavefront(BenchmarkSuite& suite, const std::vector<BenchScene>& scenes) {
+    const int image_width = 320;
+    const int image_height = static_cast<int>(image_width / aspect_ratio);
+    const int samples_per_pixel = 16;
+    const int num_threads = std::max(1u, std::thread::hardware_concurrency());
+
+    // The random and the large random scene, and the lit room for light sampling.
+    for (std::size_t scene_index : {2, 3, 4}) {
+        const BenchScene& scene = scenes[scene_index];
+        std::optional<RenderedImage> iterative_image;
+        for (PathTracing path_tracing : {PathTracing::iterative, PathTracing::wavefront}) {
+            std::string name = std::string("wavefront/")
+                + (path_tracing == PathTracing::wavefront ? "wavefront/" : "iterative/") + scene.name;
+            if (!suite.should_run(name)) {
+                continue;
+            }
+            Renderer renderer{
+                scene.world, scene.camera, image_width, image_height, samples_per_pixel, max_ray_bounce_depth, 1,
+                {.path_tracing = path_tracing}};
+            TimedRender render = timed_render(renderer, num_threads);
+            BenchmarkResult result{name, {
+                {"seconds", render.seconds},
+                {"samples_per_s", render.samples_per_s()},
+                {"mrays_per_s", render.mrays_per_s()},
+            }};
+            if (iterative_image) {
+                result.metrics.push_back({"rmse_vs_iterative", rmse(render.image.color, iterative_image->color)});
+            } else {
+                iterative_image = std::move(render.image);
+            }
+            suite.add(result);
+        }
+    }
+}
+
+// Nearest sphere hit in [0.001, infinity) over all spheres, in the precision of `T`.
+template <typename T>
+T closest_sphere_t(const BasicRay<T>& ray, const std::vector<BasicVec3<T>>& centers, const std::vector<T>& radii) {
+    T closest = std::numeric_limits<T>::infinity();
+    T a = ray.direction().length_squared();
+    for (std::size_t i = 0; i < centers.size(); i++) {
+        BasicVec3<T> oc = ray.origin() - centers[i];
+        T half_b = dot(oc, ray.direction());
+        T c = oc.length_squared() - radii[i] * radii[i];
+        T discriminant = half_b * half_b - a * c;
+        if (discriminant > 0) {
+            T t = (-half_b - std::sqrt(discriminant)) / a;
+            if (T(0.001) <= t && t < closest) {
+                closest = t;
+            }
+        }
+    }
+    return closest;
+}
+
+// The same sphere tests in float and in double, whatever precision the build uses: the
+// cost of each and how far the float hits are from the double ones. Whole images of the
+// two precisions are compared across builds, by the image_mean of the render/ results
+// and the "precision" context of the JSON output.
+void bench_precision(BenchmarkSuite& suite, const std::vector<BenchScene>& scenes) {
+    const BenchScene& scene = scenes[2];
+    const std::vector<Ray> rays = make_camera_rays(scene.camera, 4096);
+    const std::size_t ray_mask = rays.size() - 1;
+    const SphereSoA& spheres = scene.world.spheres();
+
+    std::vector<Vec3f> centers_f;
+    std::vector<float> radii_f;
+    std::vector<Vec3d> centers_d;
+    std::vector<double> radii_d;
+    for (uint32_t i = 0; i < spheres.size(); i++) {
+        centers_f.emplace_back(spheres.xs()[i], spheres.ys()[i], spheres.zs()[i]);
+        radii_f.push_back(spheres.radii()[i]);
+        centers_d.emplace_back(spheres.xs()[i], spheres.ys()[i], spheres.zs()[i]);
+        radii_d.push_back(spheres.radii()[i]);
+    }
+    std::vector<BasicRay<float>> rays_f;
+    std::vector<BasicRay<double>> rays_d;
+    for (const Ray& ray : rays) {
+        rays_f.emplace_back(Vec3f(ray.origin()), Vec3f(ray.direction()));
+        rays_d.emplace_back(Vec3d(ray.origin()), Vec3d(ray.direction()));
+    }
+
+    suite.run_microbenchmark("precision/closest_sphere/float", [&](uint64_t i) {
+        do_not_optimize(closest_sphere_t(rays_f[i & ray_mask], centers_f, radii_f));
+    });
+    suite.run_microbenchmark("precision/closest_sphere/double", [&](uint64_t i) {
+        do_not_optimize(closest_sphere_t(rays_d[i & ray_mask], centers_d, radii_d));
+    });
+
+    if (!suite.should_run("precision/float_error")) {
+        return;
+    }
+    // Rays that hit in one precision only, and the relative distance error of the others.
+    uint64_t mismatches = 0;
+    double max_relative_error = 0.0;
+    double sum_relative_error = 0.0;
+    uint64_t hits = 0;
+    for (std::size_t i = 0; i < rays.size(); i++) {
+        double t_f = closest_sphere_t(rays_f[i], centers_f, radii_f);
+        double t_d = closest_sphere_t(rays_d[i], centers_d, radii_d);
+        if (std::isinf(t_f) != std::isinf(t_d)) {
+            mismatches++;
+        } else if (!std::isinf(t_d)) {
+            double error = std::fabs(t_f - t_d) / t_d;
+            max_relative_error = std::max(max_relative_error, error);
+            sum_relative_error += error;
+            hits++;
+        }
+    }
+    suite.add({"precision/float_error", {
+        {"hit_mismatches", double(mismatches)},
+        {"max_relative_t_error", max_relative_error},
+        {"mean_relative_t_error", hits ? sum_relative_error / hits : 0.0},
+    }});
+}
+
+// Wavefront renders with camera and first-bounce rays traced in packets of each size,
+// against single rays (packet size 1). The images have to be the same.
+void bench_packets(BenchmarkSuite& suite, const std::vector<BenchScene>& scenes) {
+    const int image_width = 320;
+    const int image_height = static_cast<int>(image_width / aspect_ratio);
+    const int samples_per_pixel = 16;
+    const int num_threads = std::max(1u, std::thread::hardware_concurrency());
+
+    for (std::size_t scene_index : {2, 3}) {
+        const BenchScene& scene = scenes[scene_index];
+        std::optional<RenderedImage> single_ray_image;
+        for (int packet_size : {1, 4, 8, 16}) {
+            std::string name = "packets/" + std::to_string(packet_size) + "/" + scene.name;
+            if (!suite.should_run(name)) {
+                continue;
+            }
+            Renderer renderer{
+                scene.world, scene.camera, image_width, image_height, samples_per_pixel, max_ray_bounce_depth, 1,
+                {.path_tracing = PathTracing::wavefront, .packet_size = packet_size}};
+            TimedRender render = timed_render(renderer, num_threads);
+            BenchmarkResult result{name, {
+                {"seconds", render.seconds},
+                {"mrays_per_s", render.mrays_per_s()},
+            }};
+            if (single_ray_image) {
+                result.metrics.push_back({"rmse_vs_single", rmse(render.image.color, single_ray_image->color)});
+            } else {
+                single_ray_image = std::move(render.image);
+            }
+            suite.add(result);
+        }
+    }
+}
+
+// RMSE against a high sample count reference, for every sample sequence at growing sample
+// counts. The reference uses a different seed than the runs it is compared against.
+void bench_convergence(BenchmarkSuite& suite, const std::vector<BenchScene>& scenes) {
+    if (!suite.should_run("convergence/")) {
+        return;
+    }
+    const BenchScene& scene = scenes[2];
+    const int image_width = 96;
+    const int image_height = static_cast<int>(image_width / aspect_ratio);
+    const int num_threads = std::max(1u, std::thread::hardware_concurrency());
+
+    Renderer reference_renderer{
+        scene.world, scene.camera, image_width, image_height, 1024, max_ray_bounce_depth, 1000, {}, {},
+        SampleSequence::sobol};
+    Framebuffer reference = ParallelRenderer{reference_renderer}.render(num_threads).color;
+
+    for (SampleSequence sequence : {SampleSequence::independent, SampleSequence::sobol, SampleSequence::blue_noise}) {
+        for (int samples_per_pixel : {4, 16, 64}) {
+            std::string name = std::string("convergence/") + to_debug(sequence) + "/" + std::to_string(samples_per_pixel);
+            if (!suite.should_run(name)) {
+                continue;
+            }
+            Renderer renderer{
+                scene.world, scene.camera, image_width, image_height, samples_per_pixel, max_ray_bounce_depth, 1, {}, {},
+                sequence};
+            auto start = Clock::now();
+            Framebuffer image = ParallelRenderer{renderer}.render(num_threads).color;
+            double seconds = std::chrono::duration<double>(Clock::now() - start).count();
+            suite.add({name, {
+                {"spp", double(samples_per_pixel)},
+                {"seconds", seconds},
+                {"rmse", rmse(image, reference)},
+            }});
+        }
+    }
+}
+
+// Denoised and noisy RMSE against a high sample count reference at growing sample counts,
+// and the denoiser's own runtime on a 1080p image.
+void bench_denoise(BenchmarkSuite& suite, const std::vector<BenchScene>& scenes) {
+    const int num_threads = std::max(1u, std::thread::hardware_concurrency());
+    const DenoiserOptions options;
+
+    if (suite.should_run("denoise/1080p")) {
+        RenderedImage image{1920, 1080, true};
+        Sampler sampler{5};
+        for (int row = 0; row < 1080; row++) {
+            for (int col = 0; col < 1920; col++) {
+                image.color.at(row, col) = random_vector(sampler, 0, 1);
+                image.albedo.at(row, col) = Vec3{0.5, 0.5, 0.5};
+                image.normal.at(row, col) = Vec3{0, 1, 0};
+                image.depth.at(row, col) = 10.0;
+            }
+        }
+        auto start = Clock::now();
+        Framebuffer denoised = denoise(image, options, num_threads);
+        double seconds = std::chrono::duration<double>(Clock::now() - start).count();
+        do_not_optimize(denoised.pixels().data());
+        suite.add({"denoise/1080p", {{"seconds", seconds}, {"mpixels_per_s", 1920 * 1080 / seconds / 1e6}}});
+    }
+
+    // Large smooth surfaces, where the noise is in the lighting and not in tiny geometry.
+    if (!suite.should_run("denoise/three_spheres/")) {
+        return;
+    }
+    const BenchScene& scene = scenes[0];
+    const int image_width = 320;
+    const int image_height = static_cast<int>(image_width / aspect_ratio);
+    Renderer reference_renderer{
+        scene.world, scene.camera, image_width, image_height, 512, max_ray_bounce_depth, 1000, {}, {},
+        SampleSequence::sobol};
+    Framebuffer reference = ParallelRenderer{reference_renderer}.render(num_threads).color;
+
+    for (int samples_per_pixel : {4, 16, 64}) {
+        std::string name = "denoise/three_spheres/" + std::to_string(samples_per_pixel);
+        if (!suite.should_run(name)) {
+            continue;
+        }
+        Renderer renderer{
+            scene.world, scene.camera, image_width, image_height, samples_per_pixel, max_ray_bounce_depth, 1, {}, {},
+            SampleSequence::sobol};
+        RenderedImage image = ParallelRenderer{renderer, {}, true}.render(num_threads);
+        auto start = Clock::now();
+        Framebuffer denoised = denoise(image, options, num_threads);
+        double seconds = std::chrono::duration<double>(Clock::now() - start).count();
+        suite.add({name, {
+            {"spp", double(samples_per_pixel)},
+            {"denoise_seconds", seconds},
+            {"rmse_noisy", rmse(image.color, reference)},
+            {"rmse_denoised", rmse(denoised, reference)},
+        }});
+    }
+}
+
+// OBJ text of a torus around (0, 0, -1.2), tilted towards the tutorial camera, made of
+// rings * segments quads. Faces are written as quads so that loading also triangulates.
+std::string torus_obj(int rings, int segments) {
+    std::ostringstream out;
+    out.precision(9);
+    const double tilt = PI / 3.0;
+    for (int ring = 0; ring < rings; ring++) {
+        double phi = 2.0 * PI * ring / rings;
+        for (int segment = 0; segment < segments; segment++) {
+            double theta = 2.0 * PI * segment / segments;
+            double r = 0.45 + 0.15 * std::cos(theta);
+            double x = r * std::cos(phi);
+            double y = 0.15 * std::sin(theta);
+            double z = r * std::sin(phi);
+            out << "v " << x << ' ' << y * std::cos(tilt) - z * std::sin(tilt) << ' '
+                << y * std::sin(tilt) + z * std::cos(tilt) - 1.2 << '\n';
+        }
+    }
+    auto index = [&](int ring, int segment) {
+        return (ring % rings) * segments + (segment % segments) + 1;
+    };
+    for (int ring = 0; ring < rings; ring++) {
+        for (int segment = 0; segment < segments; segment++) {
+            out << "f " << index(ring, segment) << ' ' << index(ring, segment + 1) << ' '
+                << index(ring + 1, segment + 1) << ' ' << index(ring + 1, segment) << '\n';
+        }
+    }
+    return out.str();
+}
+
+// Loading, intersecting and rendering a 1M-triangle mesh.
+void bench_mesh(BenchmarkSuite& suite) {
+    bool any = false;
+    for (const char* name : {"mesh/obj_load_1m", "mesh/hit_world/torus_1m", "mesh/render/torus_1m",
+                             "micro/triangle_kernel_64/scalar", "micro/triangle_kernel_64/avx2"}) {
+        any = any || suite.should_run(name);
+    }
+    if (!any) {
+        return;
+    }
+    const std::string obj = torus_obj(1000, 500);
+    std::istringstream in(obj);
+    auto start = Clock::now();
+    std::optional<TriangleMesh> mesh = load_obj(in);
+    double seconds = std::chrono::duration<double>(Clock::now() - start).count();
+    if (!mesh) {
+        return;
+    }
+    if (suite.should_run("mesh/obj_load_1m")) {
+        suite.add({"mesh/obj_load_1m", {
+            {"seconds", seconds},
+            {"triangles", double(mesh->triangle_count())},
+            {"mb_per_s", obj.size() / seconds / 1e6},
+        }});
+    }
+
+    // Rays from the camera towards the middle of the torus, one call tests 64 triangles.
+    const Camera camera = tutorial_camera();
+    std::vector<Ray> rays;
+    Sampler sampler{7};
+    for (int i = 0; i < 4096; i++) {
+        rays.push_back(camera.ray_at(0.35 + 0.3 * random_double(sampler), 0.3 + 0.4 * random_double(sampler), sampler));
+    }
+    const std::size_t ray_mask = rays.size() - 1;
+    TriangleSoA triangles;
+    triangles.resize(64);
+    for (uint32_t i = 0; i < 64; i++) {
+        triangles.set(i, mesh->vertex(i * 997, 0), mesh->vertex(i * 997, 1), mesh->vertex(i * 997, 2));
+    }
+    for (SimdLevel level : {SimdLevel::scalar, SimdLevel::avx2}) {
+        if (level > simd_level()) {
+            continue;
+        }
+        suite.run_microbenchmark(std::string("micro/triangle_kernel_64/") + to_debug(level), [&](uint64_t i) {
+            double t_max = POSITIVE_INFINITY;
+            uint32_t hit_index = 0;
+            do_not_optimize(closest_triangle_hit(triangles, 0, 64, rays[i & ray_mask], 0.001, t_max, hit_index, level));
+        });
+    }
+
+    World world;
+    world.add(Sphere({0, -100.5, -1}, 100), LambertianMaterial{ground_color});
+    world.add(std::move(*mesh), MetalMaterial{{0.8, 0.6, 0.2}, 0.3});
+    world.build_bvh();
+    suite.run_microbenchmark("mesh/hit_world/torus_1m", [&](uint64_t i) {
+        Engine engine{};
+        do_not_optimize(engine.hit_world(world, rays[i & ray_mask], 0.001, POSITIVE_INFINITY));
+    });
+
+    if (suite.should_run("mesh/render/torus_1m")) {
+        const int image_width = 320;
+        const int image_height = static_cast<int>(image_width / aspect_ratio);
+        const int samples_per_pixel = 16;
+        const int num_threads = std::max(1u, std::thread::hardware_concurrency());
+        Renderer renderer{world, camera, image_width, image_height, samples_per_pixel, max_ray_bounce_depth, 1};
+        TimedRender render = timed_render(renderer, num_threads);
+        suite.add({"mesh/render/torus_1m", {
+            {"seconds", render.seconds},
+            {"samples_per_s", render.samples_per_s()},
+            {"mrays_per_s", render.mrays_per_s()},
+        }});
+    }
+}
+
+// A million instances of one 16-sphere tile: building, memory, intersecting and rendering.
+void bench_instancing(BenchmarkSuite& suite) {
+    bool any = false;
+    for (const char* name : {"instancing/build_1m", "instancing/hit_world_1m", "instancing/render_1m"}) {
+        any = any || suite.should_run(name);
+    }
+    if (!any) {
+        return;
+    }
+    Sampler world_sampler{3};
+    auto start = Clock::now();
+    World world = instanced_world(world_sampler, 2000);
+    double scene_seconds = std::chrono::duration<double>(Clock::now() - start).count();
+    start = Clock::now();
+    world.build_bvh();
+    double bvh_seconds = std::chrono::duration<double>(Clock::now() - start).count();
+
+    if (suite.should_run("instancing/build_1m")) {
+        // The tile itself is shared, only the instances and the top level grow.
+        double instances = world.instances().size();
+        double bytes = instances * (sizeof(Instance) + sizeof(MaterialId))
+            + world.instance_bvh()->nodes().size() * sizeof(BvhNode);
+        suite.add({"instancing/build_1m", {
+            {"scene_seconds", scene_seconds},
+            {"bvh_seconds", bvh_seconds},
+            {"instances", instances},
+            {"bytes_per_instance", bytes / instances},
+        }});
+    }
+
+    const Camera camera = cover_camera();
+    const std::vector<Ray> rays = make_camera_rays(camera, 4096);
+    const std::size_t ray_mask = rays.size() - 1;
+    suite.run_microbenchmark("instancing/hit_world_1m", [&](uint64_t i) {
+        Engine engine{};
+        do_not_optimize(engine.hit_world(world, rays[i & ray_mask], 0.001, POSITIVE_INFINITY));
+    });
+
+    if (suite.should_run("instancing/render_1m")) {
+        const int image_width = 320;
+        const int image_height = static_cast<int>(image_width / aspect_ratio);
+        const int samples_per_pixel = 16;
+        const int num_threads = std::max(1u, std::thread::hardware_concurrency());
+        Renderer renderer{world, camera, image_width, image_height, samples_per_pixel, max_ray_bounce_depth, 1};
+        TimedRender render = timed_render(renderer, num_threads);
+        suite.add({"instancing/render_1m", {
+            {"seconds", render.seconds},
+            {"samples_per_s", render.samples_per_s()},
+            {"mrays_per_s", render.mrays_per_s()},
+        }});
+    }
+}
+
+// Loading a 1M-sphere scene file against generating the scene and building its BVH.
+void bench_scene_file(BenchmarkSuite& suite) {
+    if (!suite.should_run("scene_file/load_1m")) {
+        return;
+    }
+    Sampler world_sampler{4};
+    World world = random_world(world_sampler, 500);
+    auto start = Clock::now();
+    world.build_bvh();
+    double build_seconds = std::chrono::duration<double>(Clock::now() - start).count();
+
+    const std::string path = (std::filesystem::temp_directory_path() / "bench_1m.scene").string();
+    if (!write_scene_file(path, world, {})) {
+        return;
+    }
+    start = Clock::now();
+    std::optional<Scene> scene = load_scene_file(path);
+    double load_seconds = std::chrono::duration<double>(Clock::now() - start).count();
+    if (!scene) {
+        return;
+    }
+    // The first rays touch the pages they need, as rendering would.
+    const std::vector<Ray> rays = make_camera_rays(cover_camera(), 4096);
+    Engine engine{};
+    start = Clock::now();
+    for (const Ray& ray : rays) {
+        do_not_optimize(engine.hit_world(scene->world, ray, 0.001, POSITIVE_INFINITY));
+    }
+    double first_rays_seconds = std::chrono::duration<double>(Clock::now() - start).count();
+    suite.add({"scene_file/load_1m", {
+        {"spheres", double(scene->world.spheres().size())},
+        {"file_mb", scene->file.size() / 1e6},
+        {"load_ms", load_seconds * 1e3},
+        {"first_4096_rays_ms", first_rays_seconds * 1e3},
+        {"bvh_build_ms", build_seconds * 1e3},
+    }});
+    scene.reset();
+    std::filesystem::remove(path);
+}
+
+// Tiles rendered by workers over localhost, each a thread of this process with its own
+// connection, against a local render of the same image. In failover/ one more worker
+// takes tiles and drops its connection without rendering them.
+void bench_distributed(BenchmarkSuite& suite, const std::vector<BenchScene>& scenes) {
+    if (!suite.should_run("distributed/")) {
+        return;
+    }
+    const BenchScene& scene = scenes[2];
+    const int image_width = 320;
+    const int image_height = static_cast<int>(image_width / aspect_ratio);
+    const int num_threads = std::max(1u, std::thread::hardware_concurrency());
+    Renderer renderer{scene.world, scene.camera, image_width, image_height, 16, max_ray_bounce_depth, 1};
+    RenderedImage local_image = ParallelRenderer{renderer}.render(num_threads);
+
+    for (std::string name : {"distributed/1_worker", "distributed/4_workers", "distributed/failover"}) {
+        if (!suite.should_run(name)) {
+            continue;
+        }
+        std::optional<RenderCoordinator> coordinator = RenderCoordinator::listen(0);
+        if (!coordinator) {
+            continue;
+        }
+        const uint16_t port = coordinator->port();
+        const int connections = name == "distributed/1_worker" ? 1 : 4;
+        std::vector<std::thread> workers;
+        workers.emplace_back([&] { run_render_worker(renderer, "localhost", port, connections); });
+        if (name == "distributed/failover") {
+            workers.emplace_back([&] {
+                std::optional<detail::Socket> socket = detail::connect_to("localhost", port);
+                detail::RenderMessage type;
+                std::vector<char> payload;
+                const std::size_t max_size = sizeof(detail::RenderSettings);
+                if (socket && socket->receive(type, payload, max_size) && socket->send(detail::RenderMessage::ready)) {
+                    socket->receive(type, payload, max_size);
+                }
+            });
+        }
+        std::vector<WorkerStats> worker_stats;
+        auto start = Clock::now();
+        RenderedImage image = coordinator->render(renderer, {}, false, &worker_stats);
+        double seconds = std::chrono::duration<double>(Clock::now() - start).count();
+        for (auto& worker : workers) {
+            worker.join();
+        }
+        int tiles_lost = 0;
+        for (const WorkerStats& stats : worker_stats) {
+            tiles_lost += stats.tiles_lost;
+        }
+        suite.add({name, {
+            {"seconds", seconds},
+            {"tiles_reassigned", double(tiles_lost)},
+            {"rmse_vs_local", rmse(image.color, local_image.color)},
+        }});
+    }
+}
+
+// Many small renders, each starting its own threads against all of them sharing one
+// persistent pool. The difference is the cost of thread creation per render.
+void bench_thread_pool(BenchmarkSuite& suite, const std::vector<BenchScene>& scenes) {
+    if (!suite.should_run("thread_pool/")) {
+        return;
+    }
+    const BenchScene& scene = scenes[0];
+    const int image_width = 64;
+    const int image_height = static_cast<int>(image_width / aspect_ratio);
+    const int renders = 200;
+    const int num_threads = std::max(1u, std::thread::hardware_concurrency());
+    Renderer renderer{scene.world, scene.camera, image_width, image_height, 1, max_ray_bounce_depth, 1};
+    RenderedImage reference = ParallelRenderer{renderer}.render(num_threads);
+
+    for (std::string name : {"thread_pool/per_render", "thread_pool/persistent"}) {
+        if (!suite.should_run(name)) {
+            continue;
+        }
+        ThreadPool pool{num_threads};
+        double error = 0.0;
+        auto start = Clock::now();
+        for (int i = 0; i < renders; i++) {
+            RenderedImage image = name == "thread_pool/persistent"
+                ? ParallelRenderer{renderer}.render(pool)
+                : ParallelRenderer{renderer}.render(num_threads);
+            error = std::max(error, rmse(image.color, reference.color));
+        }
+        double seconds = std::chrono::duration<double>(Clock::now() - start).count();
+        suite.add({name, {
+            {"ms_per_render", seconds * 1000.0 / renders},
+            {"rmse_vs_reference", error},
+        }});
+    }
+}
+
+// The same render with and without per-pixel costs, for the overhead of recording them.
+void bench_cost_maps(BenchmarkSuite& suite, const std::vector<BenchScene>& scenes) {
+    if (!suite.should_run("cost_maps/")) {
+        return;
+    }
+    const BenchScene& scene = scenes[2];
+    const int image_width = 320;
+    const int image_height = static_cast<int>(image_width / aspect_ratio);
+    const int num_threads = std::max(1u, std::thread::hardware_concurrency());
+    Renderer renderer{scene.world, scene.camera, image_width, image_height, 16, max_ray_bounce_depth, 1};
+    ThreadPool pool{num_threads};
+    RenderedImage reference = ParallelRenderer{renderer}.render(pool);
+
+    for (std::string name : {"cost_maps/off", "cost_maps/on"}) {
+        if (!suite.should_run(name)) {
+            continue;
+        }
+        bool output_costs = name == "cost_maps/on";
+        auto start = Clock::now();
+        RenderedImage image = ParallelRenderer{renderer, {}, false, output_costs}.render(pool);
+        double seconds = std::chrono::duration<double>(Clock::now() - start).count();
+        double pixel_seconds = 0.0;
+        for (const PixelCost& cost : image.costs.pixels()) {
+            pixel_seconds += cost.seconds;
+        }
+        suite.add({name, {
+            {"seconds", seconds},
+            {"tiles", double(image.tile_costs.size())},
+            {"pixel_seconds", pixel_seconds},
+            {"rmse_vs_reference", rmse(image.color, reference.color)},
+        }});
+    }
+}
+
+// A tall image rendered whole and then written, against written band by band as it
+// renders. The files have to match; the pixels held are what each keeps in memory.
+void bench_streaming(BenchmarkSuite& suite, const std::vector<BenchScene>& scenes) {
+    if (!suite.should_run("streaming/whole") && !suite.should_run("streaming/bands")) {
+        return;
+    }
+    const BenchScene& scene = scenes[2];
+    const int image_width = 320;
+    const int image_height = 8 * image_width;
+    const int num_threads = std::max(1u, std::thread::hardware_concurrency());
+    Renderer renderer{scene.world, scene.camera, image_width, image_height, 1, max_ray_bounce_depth, 1};
+    ThreadPool pool{num_threads};
+    const StreamingOptions streaming_options{};
+
+    auto render_whole = [&] {
+        std::ostringstream out;
+        write_image(out, ParallelRenderer{renderer}.render(pool).color, ImageFormat::ppm);
+        return out.str();
+    };
+
+    // The streamed file is compared with this, rendered here if the whole variant did not run.
+    std::string whole_file;
+    if (suite.should_run("streaming/whole")) {
+        auto start = Clock::now();
+        whole_file = render_whole();
+        suite.add({"streaming/whole", {
+            {"seconds", std::chrono::duration<double>(Clock::now() - start).count()},
+            {"pixels_held", double(image_width) * image_height},
+        }});
+    }
+    if (suite.should_run("streaming/bands")) {
+        std::ostringstream out;
+        auto start = Clock::now();
+        ImageStream stream{out, image_width, image_height, ImageFormat::ppm};
+        StreamingRenderer{renderer, streaming_options}.render(pool, stream);
+        double seconds = std::chrono::duration<double>(Clock::now() - start).count();
+        if (whole_file.empty()) {
+            whole_file = render_whole();
+        }
+        suite.add({"streaming/bands", {
+            {"seconds", seconds},
+            {"pixels_held", double(streaming_options.max_bands) * streaming_options.tile_size * image_width},
+            {"matches_whole", double(out.str() == whole_file)},
+        }});
+    }
+}
+
+int main(int argc, char** argv) {
+    BenchmarkOptions options;
+    std::string json_path;
+    for (int i = 1; i < argc; i++) {
+        if (std::strcmp(argv[i], "--json") == 0 && i + 1 < argc) {
+            json_path = argv[++i];
+        } else if (std::strcmp(argv[i], "--filter") == 0 && i + 1 < argc) {
+            options.filter = argv[++i];
+        } else if (std::strcmp(argv[i], "--min-time") == 0 && i + 1 < argc) {
+            options.min_seconds = std::stod(argv[++i]);
+        } else {
+            std::cerr << "Usage: " << argv[0] << " [--json FILE] [--filter SUBSTRING] [--min-time SECONDS]" << std::endl;
+            return 1;
+        }
+    }
+
+    BenchmarkSuite suite{options};
+    std::vector<BenchScene> scenes = make_scenes();
+    bench_micro(suite, scenes);
+    bench_render(suite, scenes);
+    bench_path_tracing(suite, scenes);
+    bench_light_sampling(suite, scenes);
+    bench_wavefront(suite, scenes);
+    bench_packets(suite, scenes);
+    bench_precision(suite, scenes);
+    bench_convergence(suite, scenes);
+    bench_denoise(suite, scenes);
+    bench_mesh(suite);
+    bench_instancing(suite);
+    bench_scene_file(suite);
+    bench_distributed(suite, scenes);
+    bench_thread_pool(suite, scenes);
+    bench_cost_maps(suite, scenes);
+    bench_streaming(suite, scenes);
+
+    if (!json_path.empty()) {
+        std::ofstream out(json_path);
+        suite.write_json(out, {
+            {"simd", to_debug(simd_level())},
+            {"precision", std::is_same_v<Real, float> ? "float" : "double"},
+            {"threads", std::to_string(std::thread::hardware_concurrency())},
+        });
+    }
+    return 0;
+}
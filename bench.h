@@ -0,0 +1,93 @@
+#pragma once
+
+#include <chrono>
+#include <cstdint>
+#include <iomanip>
+#include <iostream>
+#include <string>
+#include <utility>
+#include <vector>
+
+// Keeps the compiler from optimizing away a value computed by a benchmark.
+template <typename T>
+void do_not_optimize(const T& value) {
+    asm volatile("" : : "r,m"(value) : "memory");
+}
+
+struct BenchmarkResult {
+    std::string name;
+    // Named measurements, e.g. ns_per_op, mrays_per_s, samples_per_s or rmse.
+    std::vector<std::pair<std::string, double>> metrics;
+};
+
+struct BenchmarkOptions {
+    // Microbenchmarks repeat their operation until at least this much time has passed.
+    double min_seconds = 0.25;
+    // Only benchmarks whose name contains this string run.
+    std::string filter;
+};
+
+class BenchmarkSuite {
+public:
+    explicit BenchmarkSuite(const BenchmarkOptions& options) : options_{options} {}
+
+    const BenchmarkOptions& options() const {
+        return options_;
+    }
+
+    bool should_run(const std::string& name) const {
+        return name.find(options_.filter) != std::string::npos;
+    }
+
+    void add(BenchmarkResult result) {
+        std::cout << std::left << std::setw(40) << result.name;
+        for (const auto& [key, value] : result.metrics) {
+            std::cout << ' ' << key << '=' << value;
+        }
+        std::cout << std::endl;
+        results_.push_back(std::move(result));
+    }
+
+    // Times `op(i)` for i = 0, 1, ... in doubling batches until min_seconds have passed.
+    template <typename Op>
+    void run_microbenchmark(const std::string& name, Op&& op) {
+        if (!should_run(name)) {
+            return;
+        }
+        using Clock = std::chrono::steady_clock;
+        uint64_t iterations = 0;
+        uint64_t batch = 1;
+        double seconds = 0.0;
+        auto start = Clock::now();
+        while (seconds < options_.min_seconds) {
+            for (uint64_t i = 0; i < batch; i++) {
+                op(iterations + i);
+            }
+            iterations += batch;
+            batch *= 2;
+            seconds = std::chrono::duration<double>(Clock::now() - start).count();
+        }
+        add({name, {{"ns_per_op", 1e9 * seconds / iterations}, {"iterations", double(iterations)}}});
+    }
+
+    void write_json(std::ostream& out, const std::vector<std::pair<std::string, std::string>>& context) const {
+        out << "{\n  \"context\": {";
+        for (std::size_t i = 0; i < context.size(); i++) {
+            out << (i ? ", " : "") << '"' << context[i].first << "\": \"" << context[i].second << '"';
+        }
+        out << "},\n  \"benchmarks\": [\n";
+        for (std::size_t i = 0; i < results_.size(); i++) {
+            const BenchmarkResult& result = results_[i];
+            out << "    {\"name\": \"" << result.name << '"';
+            for (const auto& [key, value] : result.metrics) {
+                out << ", \"" << key << "\": " << std::setprecision(9) << value;
+            }
+            out << '}' << (i + 1 < results_.size() ? "," : "") << '\n';
+        }
+        out << "  ]\n}\n";
+    }
+
+private:
+    BenchmarkOptions options_;
+    std::vector<BenchmarkResult> results_;
+};
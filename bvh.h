@@ -0,0 +1,446 @@
+#pragma once
+
+#include <algorithm>
+#include <array>
+#include <cassert>
+#include <cmath>
+#include <cstdint>
+#include <limits>
+#include <tuple>
+#include <vector>
+
+#include "aabb.h"
+#include "array_storage.h"
+#include "ray.h"
+#include "stats.h"
+#include "vec3.h"
+
+struct BvhPrimitive {
+    Aabb bounds;
+    Aabb::Point centroid;
+};
+
+// Flattened node, one per cache line. Nodes are laid out depth-first: the first child
+// of an interior node directly follows it and `offset` points at the second child.
+// For leaves `offset` is the first entry in `Bvh::primitive_indices()`, or directly the
+// first primitive if the owner has stored its primitives in leaf order.
+struct alignas(64) BvhNode {
+    Aabb bounds;
+    uint32_t offset;
+    uint16_t count;
+    uint8_t axis;
+
+    bool is_leaf() const {
+        return count > 0;
+    }
+};
+
+// Deepest level of a leaf, the root being level 0. Traversal keeps at most one node per
+// level on its stack, so this bounds the stacks in `Bvh::traverse` and the packet kernels.
+constexpr int max_bvh_depth = 64;
+
+struct BvhBuildOptions {
+    int num_bins = 16;
+    int max_leaf_size = 4;
+    // Relative cost of visiting an interior node vs. intersecting one primitive.
+    double traversal_cost = 1.0;
+};
+
+// Bounding volume hierarchy built with binned SAH. It only knows about primitive
+// bounds, so the same structure serves the world and anything else with many parts.
+class Bvh {
+public:
+    Bvh() {}
+
+    // A hierarchy built earlier, e.g. stored in a mapped scene file, whose primitives are
+    // already in leaf order. The nodes have to outlive it.
+    static Bvh view(const BvhNode* nodes, std::size_t count) {
+        Bvh bvh;
+        bvh.nodes_ = ArrayStorage<BvhNode>::view(nodes, count);
+        return bvh;
+    }
+
+    Bvh(const std::vector<BvhPrimitive>& primitives, const BvhBuildOptions& options = {}) : options_{options} {
+        if (primitives.empty()) {
+            return;
+        }
+        // The builder partitions compact copies of the primitives rather than indices into
+        // them, so that every pass over a node reads contiguous memory, and half as much.
+        std::vector<BuildPrimitive> build_primitives(primitives.size());
+        for (uint32_t i = 0; i < primitives.size(); i++) {
+            build_primitives[i] = {FloatBox{primitives[i].bounds}, FloatBox::to_float(primitives[i].centroid), i};
+        }
+        nodes_.vector().reserve(2 * primitives.size());
+        SplitBounds root_bounds;
+        for (const BuildPrimitive& primitive : build_primitives) {
+            root_bounds.add(primitive);
+        }
+        build_recursive(build_primitives, 0, primitives.size(), root_bounds, 0);
+        primitive_indices_.resize(primitives.size());
+        for (uint32_t i = 0; i < primitives.size(); i++) {
+            primitive_indices_[i] = build_primitives[i].index;
+        }
+    }
+
+    const ArrayStorage<BvhNode>& nodes() const {
+        return nodes_;
+    }
+
+    const std::vector<uint32_t>& primitive_indices() const {
+        return primitive_indices_;
+    }
+
+    bool empty() const {
+        return nodes_.empty();
+    }
+
+    // Hands the leaf order over to an owner that reorders its primitives to match it,
+    // after which leaves refer to primitives directly.
+    std::vector<uint32_t> release_primitive_indices() {
+        return std::move(primitive_indices_);
+    }
+
+    // Visits leaves front-to-back. `hit_leaf(first, count, t_max)` intersects the leaf's
+    // primitives (see `BvhNode`) and returns true if it found
+    // a hit, in which case it must have lowered `t_max` to that hit.
+    template <typename HitLeafFn>
+    bool traverse(const Ray& ray, double t_min, double& t_max, HitLeafFn&& hit_leaf) const {
+        return traverse_from(0, ray, t_min, t_max, hit_leaf);
+    }
+
+    // The same for the subtree under the node with index `root`.
+    template <typename HitLeafFn>
+    bool traverse_from(uint32_t root, const Ray& ray, double t_min, double& t_max, HitLeafFn&& hit_leaf) const {
+        return traverse_nodes<false>(root, ray, t_min, t_max, hit_leaf);
+    }
+
+    // Whether any leaf reports a hit within [t_min, t_max], for shadow rays: traversal
+    // stops at the first leaf whose `hit_leaf` returns true.
+    template <typename HitLeafFn>
+    bool any_hit(const Ray& ray, double t_min, double t_max, HitLeafFn&& hit_leaf) const {
+        return traverse_nodes<true>(0, ray, t_min, t_max, hit_leaf);
+    }
+
+private:
+    template <bool StopAtFirstHit, typename HitLeafFn>
+    bool traverse_nodes(uint32_t root, const Ray& ray, double t_min, double& t_max, HitLeafFn&& hit_leaf) const {
+        if (nodes_.empty()) {
+            return false;
+        }
+        const BvhNode* nodes = nodes_.data();
+        const Vec3& origin = ray.origin();
+        const Vec3& direction = ray.direction();
+        Vec3 inverse_direction{1.0 / direction[0], 1.0 / direction[1], 1.0 / direction[2]};
+        std::array<bool, 3> is_direction_negative = {
+            inverse_direction[0] < 0.0, inverse_direction[1] < 0.0, inverse_direction[2] < 0.0};
+
+        bool hit_anything = false;
+        std::array<uint32_t, max_bvh_depth> stack;
+        int stack_size = 0;
+        uint32_t current = root;
+        while (true) {
+            const BvhNode& node = nodes[current];
+            RT_STATS(counters.bvh_node_tests++);
+            if (node.bounds.hit(origin, inverse_direction, t_min, t_max)) {
+                if (node.is_leaf()) {
+                    if (hit_leaf(node.offset, node.count, t_max)) {
+                        hit_anything = true;
+                        if constexpr (StopAtFirstHit) {
+                            return true;
+                        }
+                    }
+                } else {
+                    // Descend into the near child first and come back for the far one.
+                    assert(stack_size < max_bvh_depth);
+                    if (is_direction_negative[node.axis]) {
+                        stack[stack_size++] = current + 1;
+                        current = node.offset;
+                    } else {
+                        stack[stack_size++] = node.offset;
+                        current = current + 1;
+                    }
+                    continue;
+                }
+            }
+            if (stack_size == 0) {
+                break;
+            }
+            current = stack[--stack_size];
+        }
+        return hit_anything;
+    }
+
+    // Single precision box for the builder. Converted boxes are rounded outwards, so the
+    // node bounds made from them still contain their primitives, only a little looser.
+    struct FloatBox {
+        using Point = std::array<float, 3>;
+        static constexpr float infinity = std::numeric_limits<float>::infinity();
+
+        Point min = {infinity, infinity, infinity};
+        Point max = {-infinity, -infinity, -infinity};
+
+        FloatBox() {}
+
+        explicit FloatBox(const Aabb& box) {
+            for (int axis = 0; axis < 3; axis++) {
+                min[axis] = round_down(box.min()[axis]);
+                max[axis] = round_up(box.max()[axis]);
+            }
+        }
+
+        static float round_down(double value) {
+            float rounded = static_cast<float>(value);
+            return rounded > value ? std::nextafter(rounded, -infinity) : rounded;
+        }
+
+        static float round_up(double value) {
+            float rounded = static_cast<float>(value);
+            return rounded < value ? std::nextafter(rounded, infinity) : rounded;
+        }
+
+        static Point to_float(const Aabb::Point& point) {
+            return {static_cast<float>(point[0]), static_cast<float>(point[1]), static_cast<float>(point[2])};
+        }
+
+        void expand(const Point& point) {
+            for (int axis = 0; axis < 3; axis++) {
+                min[axis] = std::min(min[axis], point[axis]);
+                max[axis] = std::max(max[axis], point[axis]);
+            }
+        }
+
+        void expand(const FloatBox& box) {
+            for (int axis = 0; axis < 3; axis++) {
+                min[axis] = std::min(min[axis], box.min[axis]);
+                max[axis] = std::max(max[axis], box.max[axis]);
+            }
+        }
+
+        double surface_area() const {
+            double dx = double(max[0]) - min[0];
+            double dy = double(max[1]) - min[1];
+            double dz = double(max[2]) - min[2];
+            return dx < 0.0 ? 0.0 : 2.0 * (dx * dy + dy * dz + dz * dx);
+        }
+
+        Aabb to_aabb() const {
+            return {Aabb::Point{min[0], min[1], min[2]}, Aabb::Point{max[0], max[1], max[2]}};
+        }
+    };
+
+    struct BuildPrimitive {
+        FloatBox bounds;
+        FloatBox::Point centroid;
+        uint32_t index;
+    };
+
+    // Bounds of a range of primitives and of their centroids.
+    struct SplitBounds {
+        FloatBox bounds;
+        FloatBox centroid_bounds;
+
+        void add(const BuildPrimitive& primitive) {
+            bounds.expand(primitive.bounds);
+            centroid_bounds.expand(primitive.centroid);
+        }
+    };
+
+    struct Bin {
+        FloatBox bounds;
+        int count = 0;
+    };
+
+    // Levels a median split of `count` primitives takes to reach single primitives.
+    static int median_split_levels(std::size_t count) {
+        int levels = 0;
+        while ((std::size_t(1) << levels) < count) {
+            levels++;
+        }
+        return levels;
+    }
+
+    // Nodes at `depth` always have room for median splits below them, so no leaf ends up
+    // deeper than max_bvh_depth. SAH splits are only taken while that still holds for the
+    // larger side, which degenerate inputs can leave with all but one primitive.
+    uint32_t build_recursive(
+            std::vector<BuildPrimitive>& primitives, std::size_t begin, std::size_t end, const SplitBounds& split_bounds,
+            int depth) {
+        std::vector<BvhNode>& nodes = nodes_.vector();
+        uint32_t node_index = nodes.size();
+        nodes.emplace_back();
+
+        const Aabb bounds = split_bounds.bounds.to_aabb();
+        const Aabb centroid_bounds = split_bounds.centroid_bounds.to_aabb();
+        std::size_t count = end - begin;
+        auto make_leaf = [&]() {
+            BvhNode& node = nodes[node_index];
+            node.bounds = bounds;
+            node.offset = begin;
+            node.count = count;
+            node.axis = 0;
+            return node_index;
+        };
+
+        if (count <= 1) {
+            return make_leaf();
+        }
+
+        int axis = centroid_bounds.longest_axis();
+        // Stays at begin unless a SAH split partitions the primitives.
+        std::size_t mid = begin;
+        SplitBounds left_bounds;
+        SplitBounds right_bounds;
+        const bool sah_allowed = depth + 1 + median_split_levels(count) <= max_bvh_depth;
+        if (centroid_bounds.extent()[axis] <= 0.0 || !sah_allowed) {
+            // All centroids coincide, so no split can separate them, or the tree is too
+            // deep for anything but a median split. Either way mid stays at begin and the
+            // nth_element fallback below splits at the median.
+            if (count <= static_cast<std::size_t>(options_.max_leaf_size)) {
+                return make_leaf();
+            }
+        } else {
+            // Small nodes get fewer bins, sweeping many empty ones would cost more than the
+            // binning itself.
+            int num_bins = static_cast<int>(std::min<std::size_t>(options_.num_bins, count));
+            auto [split_axis, split_bin, split_cost] = find_sah_split(
+                primitives, begin, end, bounds, centroid_bounds, num_bins);
+            double leaf_cost = count;
+            if (count <= static_cast<std::size_t>(options_.max_leaf_size) && !(split_cost < leaf_cost)) {
+                return make_leaf();
+            }
+            if (split_cost < POSITIVE_INFINITY) {
+                axis = split_axis;
+                double axis_min = centroid_bounds.min()[axis];
+                double scale = num_bins / centroid_bounds.extent()[axis];
+                mid = partition(primitives, begin, end, left_bounds, right_bounds, [&](const BuildPrimitive& primitive) {
+                    return bin_of(primitive.centroid[axis], axis_min, scale, num_bins) <= split_bin;
+                });
+            }
+        }
+
+        if (mid == begin || mid == end) {
+            // No SAH partition, or one that left a side empty: split at the median and
+            // gather the bounds of both halves.
+            mid = begin + count / 2;
+            std::nth_element(
+                primitives.begin() + begin,
+                primitives.begin() + mid,
+                primitives.begin() + end,
+                [&](const BuildPrimitive& lhs, const BuildPrimitive& rhs) {
+                    return lhs.centroid[axis] < rhs.centroid[axis];
+                });
+            left_bounds = {};
+            right_bounds = {};
+            for (std::size_t i = begin; i < end; i++) {
+                (i < mid ? left_bounds : right_bounds).add(primitives[i]);
+            }
+        }
+
+        build_recursive(primitives, begin, mid, left_bounds, depth + 1);
+        uint32_t second_child = build_recursive(primitives, mid, end, right_bounds, depth + 1);
+
+        BvhNode& node = nodes[node_index];
+        node.bounds = bounds;
+        node.offset = second_child;
+        node.count = 0;
+        node.axis = axis;
+        return node_index;
+    }
+
+    // Moves the primitives for which `is_left` holds to the front of [begin, end) and
+    // returns where the others start. The bounds of both sides are gathered on the way,
+    // which saves the children a pass over their primitives.
+    template <typename IsLeftFn>
+    static std::size_t partition(
+            std::vector<BuildPrimitive>& primitives, std::size_t begin, std::size_t end,
+            SplitBounds& left_bounds, SplitBounds& right_bounds, IsLeftFn&& is_left) {
+        while (true) {
+            while (begin < end && is_left(primitives[begin])) {
+                left_bounds.add(primitives[begin++]);
+            }
+            while (begin < end && !is_left(primitives[end - 1])) {
+                right_bounds.add(primitives[--end]);
+            }
+            if (begin == end) {
+                return begin;
+            }
+            std::swap(primitives[begin], primitives[end - 1]);
+        }
+    }
+
+    static int bin_of(double centroid, double axis_min, double scale, int num_bins) {
+        int bin = static_cast<int>((centroid - axis_min) * scale);
+        return std::clamp(bin, 0, num_bins - 1);
+    }
+
+    // Returns the axis, the last bin of the left side and the SAH cost of the best split,
+    // normalized so that it is directly comparable with the cost of a leaf.
+    std::tuple<int, int, double> find_sah_split(
+            const std::vector<BuildPrimitive>& primitives,
+            std::size_t begin,
+            std::size_t end,
+            const Aabb& bounds,
+            const Aabb& centroid_bounds,
+            int num_bins) {
+        int best_axis = 0;
+        int best_bin = 0;
+        double best_cost = POSITIVE_INFINITY;
+        double inverse_area = 1.0 / bounds.surface_area();
+
+        // All three axes are binned in the same pass over the primitives.
+        std::array<std::vector<Bin>, 3>& bins = bins_;
+        std::array<double, 3> scales = {};
+        for (int axis = 0; axis < 3; axis++) {
+            bins[axis].assign(num_bins, Bin{});
+            double extent = centroid_bounds.extent()[axis];
+            scales[axis] = extent > 0.0 ? num_bins / extent : 0.0;
+        }
+        const Aabb::Point& axis_min = centroid_bounds.min();
+        for (std::size_t i = begin; i < end; i++) {
+            const BuildPrimitive& primitive = primitives[i];
+            for (int axis = 0; axis < 3; axis++) {
+                Bin& bin = bins[axis][bin_of(primitive.centroid[axis], axis_min[axis], scales[axis], num_bins)];
+                bin.bounds.expand(primitive.bounds);
+                bin.count++;
+            }
+        }
+
+        std::vector<double>& left_costs = left_costs_;
+        left_costs.resize(num_bins);
+        for (int axis = 0; axis < 3; axis++) {
+            if (centroid_bounds.extent()[axis] <= 0.0) {
+                continue;
+            }
+            // Sweep from the left, then from the right, to evaluate every bin boundary.
+            const std::vector<Bin>& axis_bins = bins[axis];
+            FloatBox left_bounds;
+            int left_count = 0;
+            for (int i = 0; i < num_bins - 1; i++) {
+                left_bounds.expand(axis_bins[i].bounds);
+                left_count += axis_bins[i].count;
+                left_costs[i] = left_count * left_bounds.surface_area();
+            }
+            FloatBox right_bounds;
+            int right_count = 0;
+            for (int i = num_bins - 1; i > 0; i--) {
+                right_bounds.expand(axis_bins[i].bounds);
+                right_count += axis_bins[i].count;
+                double cost = options_.traversal_cost
+                    + (left_costs[i - 1] + right_count * right_bounds.surface_area()) * inverse_area;
+                if (cost < best_cost) {
+                    best_cost = cost;
+                    best_axis = axis;
+                    best_bin = i - 1;
+                }
+            }
+        }
+        return {best_axis, best_bin, best_cost};
+    }
+
+    BvhBuildOptions options_;
+    ArrayStorage<BvhNode> nodes_;
+    std::vector<uint32_t> primitive_indices_;
+    // Scratch space of find_sah_split().
+    std::array<std::vector<Bin>, 3> bins_;
+    std::vector<double> left_costs_;
+};
@@ -38,8 +38,8 @@ public:
         lens_radius_ = aperture / 2;
     }
 
-    Ray ray_at(double s, double t) const {
-        Vec3 random = lens_radius_ * random_in_unit_disk();
+    Ray ray_at(double s, double t, Sampler& sampler) const {
+        Vec3 random = lens_radius_ * sample_in_unit_disk(sampler);
         Vec3 offset = u_ * random.x() + v_ * random.y();
         Vec3 ray_origin = origin_ + offset;
         Vec3 direction = lower_left_corner_ + s * horizontal_ + t * vertical_ - ray_origin;
@@ -62,6 +62,10 @@ public:
         return vertical_;
     }
 
+    double lens_radius() const {
+        return lens_radius_;
+    }
+
 private:
     Vec3 origin_;
     Vec3 lower_left_corner_;
@@ -1,5 +1,6 @@
 #pragma once
 
+#include "sampler.h"
 #include "vec3.h"
 
 constexpr double POSITIVE_INFINITY = std::numeric_limits<double>::infinity();
@@ -16,14 +17,14 @@ inline double degrees_to_radians(double degrees) {
   return degrees * PI / 180.0;
 }
 
-inline double random_double() {
+inline double random_double(Sampler& sampler) {
   // Returns a random real in [0, 1).
-  return rand() / (RAND_MAX + 1.0);
+  return sampler.next_double();
 }
 
-inline double random_double(double min, double max) {
+inline double random_double(Sampler& sampler, double min, double max) {
   // Returns a random real in [min, max).
-  return min + (max - min) * random_double();
+  return min + (max - min) * random_double(sampler);
 }
 
 inline double clamp(double x, double min, double max) {
@@ -32,25 +33,25 @@ inline double clamp(double x, double min, double max) {
     return x;
 }
 
-inline Vec3 random_in_unit_sphere() {
+inline Vec3 random_vector(Sampler& sampler, double min, double max) {
+    return {random_double(sampler, min, max), random_double(sampler, min, max), random_double(sampler, min, max)};
+}
+
+inline Vec3 random_in_unit_sphere(Sampler& sampler) {
     while (true) {
-        Vec3 u{random_double(), random_double(), random_double()};
+        Vec3 u = random_vector(sampler, -1, 1);
         if (u.length_squared() <= 1.0) {
             return u;
         }
     }
 }
 
-inline Vec3 random_vector(double min, double max) {
-    return {random_double(min, max), random_double(min, max), random_double(min, max)};
-}
-
-inline Vec3 random_unit_vector() {
-    return unit_vector(random_in_unit_sphere());
+inline Vec3 random_unit_vector(Sampler& sampler) {
+    return unit_vector(random_in_unit_sphere(sampler));
 }
 
-inline Vec3 random_in_hemisphere(const Vec3& normal) {
-    Vec3 in_unit_sphere = random_in_unit_sphere();
+inline Vec3 random_in_hemisphere(Sampler& sampler, const Vec3& normal) {
+    Vec3 in_unit_sphere = random_in_unit_sphere(sampler);
     if (dot(in_unit_sphere, normal) > 0.0)  {
         // In the same hemisphere as the normal.
         return in_unit_sphere;
@@ -59,11 +60,46 @@ inline Vec3 random_in_hemisphere(const Vec3& normal) {
     }
 }
 
-inline Vec3 random_in_unit_disk() {
+inline Vec3 random_in_unit_disk(Sampler& sampler) {
     while (true) {
-        Vec3 p{random_double(-1, 1), random_double(-1, 1), 0};
+        Vec3 p{random_double(sampler, -1, 1), random_double(sampler, -1, 1), 0};
         if (p.length_squared() < 1.0) {
             return p;
         }
     }
-}
\ No newline at end of file
+}
+// The warps below turn a fixed number of uniform numbers into a point, so every draw uses
+// the same sample dimensions, which the low-discrepancy samplers depend on. The rejection
+// loops above draw a varying count. Each warp has the same distribution as its loop.
+
+// Uniform in the unit disk, with the concentric mapping of Shirley and Chiu.
+inline Vec3 sample_in_unit_disk(Sampler& sampler) {
+    double a = random_double(sampler, -1, 1);
+    double b = random_double(sampler, -1, 1);
+    if (a == 0.0 && b == 0.0) {
+        return {0, 0, 0};
+    }
+    double r, phi;
+    if (fabs(a) > fabs(b)) {
+        r = a;
+        phi = (PI / 4.0) * (b / a);
+    } else {
+        r = b;
+        phi = PI / 2.0 - (PI / 4.0) * (a / b);
+    }
+    return {r * cos(phi), r * sin(phi), 0};
+}
+
+// Uniform on the unit sphere, like random_unit_vector.
+inline Vec3 sample_unit_vector(Sampler& sampler) {
+    double z = random_double(sampler, -1, 1);
+    double phi = 2.0 * PI * random_double(sampler);
+    double r = sqrt(fmax(0.0, 1.0 - z * z));
+    return {r * cos(phi), r * sin(phi), z};
+}
+
+// Uniform in the unit ball, like random_in_unit_sphere.
+inline Vec3 sample_in_unit_sphere(Sampler& sampler) {
+    Vec3 direction = sample_unit_vector(sampler);
+    return cbrt(random_double(sampler)) * direction;
+}
@@ -0,0 +1,54 @@
+#pragma once
+
+#include <cstdint>
+#include <cstring>
+#include <type_traits>
+
+// 64-bit FNV-1a over 8-byte words, to tell whether two processes or runs hold the same
+// scene and settings. Not meant to resist deliberate collisions. Values are added field
+// by field rather than as whole structs, so padding bytes never reach the hash.
+class ContentHash {
+public:
+    void add(const void* data, std::size_t size) {
+        const char* bytes = static_cast<const char*>(data);
+        for (; size >= sizeof(uint64_t); bytes += sizeof(uint64_t), size -= sizeof(uint64_t)) {
+            uint64_t word;
+            std::memcpy(&word, bytes, sizeof(word));
+            mix(word);
+        }
+        uint64_t tail = 0;
+        std::memcpy(&tail, bytes, size);
+        mix(tail ^ (uint64_t{size} << 56));
+    }
+
+    // Arithmetic and enum values, each widened to one word.
+    template <typename T>
+    void add_value(T value) {
+        static_assert(std::is_arithmetic_v<T> || std::is_enum_v<T>);
+        if constexpr (std::is_floating_point_v<T>) {
+            double widened = value;
+            uint64_t word;
+            std::memcpy(&word, &widened, sizeof(word));
+            mix(word);
+        } else {
+            mix(static_cast<uint64_t>(value));
+        }
+    }
+
+    template <typename T>
+    void add_array(const T* values, std::size_t count) {
+        add_value(count);
+        add(values, count * sizeof(T));
+    }
+
+    uint64_t value() const {
+        return hash_;
+    }
+
+private:
+    void mix(uint64_t word) {
+        hash_ = (hash_ ^ word) * 0x100000001b3ull;
+    }
+
+    uint64_t hash_ = 0xcbf29ce484222325ull;
+};
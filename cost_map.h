@@ -0,0 +1,145 @@
+#pragma once
+
+#include <algorithm>
+#include <array>
+#include <cstdint>
+#include <fstream>
+#include <iostream>
+#include <string>
+#include <tuple>
+#include <vector>
+
+#include "framebuffer.h"
+#include "image_writer.h"
+#include "task_splitter.h"
+#include "vec3.h"
+
+// What one pixel took to render. Intersection tests (BVH nodes, spheres and triangles)
+// are only counted in stats builds and are zero otherwise.
+struct PixelCost {
+    float seconds = 0.0f;
+    uint32_t rays = 0;
+    uint32_t intersection_tests = 0;
+};
+
+// Totals of one rendered tile, and the thread that rendered it.
+struct TileCost {
+    RenderTask task;
+    CoreId thread;
+    double seconds;
+    uint64_t rays;
+    uint64_t intersection_tests;
+};
+
+namespace detail {
+    // Control points of a black-purple-orange-yellow ramp, as display values.
+    constexpr std::array<std::array<double, 3>, 5> heatmap_ramp = {{
+        {0.00, 0.00, 0.02},
+        {0.34, 0.06, 0.43},
+        {0.73, 0.21, 0.33},
+        {0.98, 0.55, 0.04},
+        {0.99, 1.00, 0.64},
+    }};
+
+    // Colour of `t` in [0, 1], in linear values, since the image writers apply gamma 2.
+    Vec3 heatmap_color(double t) {
+        double position = std::clamp(t, 0.0, 1.0) * (heatmap_ramp.size() - 1);
+        std::size_t i = std::min<std::size_t>(position, heatmap_ramp.size() - 2);
+        double f = position - i;
+        Vec3 color;
+        for (int channel = 0; channel < 3; channel++) {
+            double value = (1.0 - f) * heatmap_ramp[i][channel] + f * heatmap_ramp[i + 1][channel];
+            color[channel] = value * value;
+        }
+        return color;
+    }
+
+    // Greyscale PFM ("Pf"): one 32-bit float per pixel, bottom row first.
+    void write_float_map(std::ostream& out, const ImageBuffer<float>& values) {
+        out << "Pf\n" << values.width() << ' ' << values.height() << '\n' << (is_little_endian() ? "-1.0\n" : "1.0\n");
+        out.write(reinterpret_cast<const char*>(values.pixels().data()), values.pixels().size() * sizeof(float));
+    }
+}
+
+// The value at `percentile` of the nonzero entries, which heatmaps saturate at so that a
+// handful of outliers does not leave the rest of the map black.
+float cost_scale(const ImageBuffer<float>& values, double percentile = 0.99) {
+    std::vector<float> nonzero;
+    for (float value : values.pixels()) {
+        if (value > 0.0f) {
+            nonzero.push_back(value);
+        }
+    }
+    if (nonzero.empty()) {
+        return 0.0f;
+    }
+    auto nth = nonzero.begin() + static_cast<std::size_t>(percentile * (nonzero.size() - 1));
+    std::nth_element(nonzero.begin(), nth, nonzero.end());
+    return *nth;
+}
+
+// False-colour image of the values, black at zero and light yellow at `scale` and above.
+Framebuffer heatmap(const ImageBuffer<float>& values, float scale) {
+    Framebuffer image{values.width(), values.height()};
+    for (int row = 0; row < values.height(); row++) {
+        const float* value = values.scanline(row);
+        Vec3* pixel = image.scanline(row);
+        for (int col = 0; col < values.width(); col++) {
+            pixel[col] = detail::heatmap_color(scale > 0.0f ? value[col] / scale : 0.0);
+        }
+    }
+    return image;
+}
+
+// Writes, for wall time, rays and (in stats builds) intersection tests per pixel, a
+// heatmap `<prefix>_<metric>.ppm` and the raw values as `<prefix>_<metric>.pfm`, and the
+// tile totals as `<prefix>_tiles.csv`. Returns whether every file was written.
+bool write_cost_maps(const std::string& prefix, const ImageBuffer<PixelCost>& costs, std::vector<TileCost> tiles) {
+    ImageBuffer<float> seconds{costs.width(), costs.height()};
+    ImageBuffer<float> rays{costs.width(), costs.height()};
+    ImageBuffer<float> tests{costs.width(), costs.height()};
+    for (int row = 0; row < costs.height(); row++) {
+        for (int col = 0; col < costs.width(); col++) {
+            const PixelCost& cost = costs.at(row, col);
+            seconds.at(row, col) = cost.seconds;
+            rays.at(row, col) = cost.rays;
+            tests.at(row, col) = cost.intersection_tests;
+        }
+    }
+    struct Metric {
+        const char* name;
+        const char* unit;
+        const ImageBuffer<float>& values;
+    };
+    bool written = true;
+    for (const Metric& metric : {Metric{"time", "s", seconds}, Metric{"rays", "rays", rays}, Metric{"tests", "tests", tests}}) {
+        const ImageBuffer<float>& values = metric.values;
+        if (std::none_of(values.pixels().begin(), values.pixels().end(), [](float value) { return value > 0.0f; })) {
+            continue;
+        }
+        float scale = cost_scale(values);
+        std::cerr << "Cost map " << metric.name << ": 0 to " << scale << ' ' << metric.unit << " per pixel" << std::endl;
+        std::string path = prefix + "_" + metric.name;
+        std::ofstream heatmap_file(path + ".ppm", std::ios::binary);
+        write_image(heatmap_file, heatmap(values, scale), ImageFormat::ppm);
+        std::ofstream values_file(path + ".pfm", std::ios::binary);
+        detail::write_float_map(values_file, values);
+        written = written && heatmap_file && values_file;
+    }
+
+    // Tiles in image order, for diffing between runs.
+    std::sort(tiles.begin(), tiles.end(), [](const TileCost& a, const TileCost& b) {
+        return std::tie(a.task.start_y, a.task.start_x) < std::tie(b.task.start_y, b.task.start_x);
+    });
+    std::ofstream tiles_file(prefix + "_tiles.csv");
+    tiles_file << "start_x,end_x,start_y,end_y,thread,seconds,rays,intersection_tests\n";
+    for (const TileCost& tile : tiles) {
+        tiles_file << tile.task.start_x << ',' << tile.task.end_x << ',' << tile.task.start_y << ',' << tile.task.end_y
+                   << ',' << tile.thread << ',' << tile.seconds << ',' << tile.rays << ',' << tile.intersection_tests << '\n';
+    }
+    written = written && tiles_file;
+    if (!written) {
+        std::cerr << "Could not write the cost maps " << prefix << "_*" << std::endl;
+    }
+    return written;
+}
@@ -0,0 +1,329 @@
+#pragma once
+
+#include <algorithm>
+#include <cassert>
+#include <cmath>
+#include <cstdint>
+#include <cstring>
+#include <vector>
+
+#include "framebuffer.h"
+#include "sphere_soa.h"
+#include "task_renderer.h"
+#include "thread_pool.h"
+
+// Edge-avoiding à-trous wavelet filter (Dammertz et al. 2010), with the variance guided
+// color weight of SVGF (Schied et al. 2017). Every pass blurs with a 5x5 B3-spline kernel
+// whose taps are 2^pass pixels apart. A tap loses weight the more its normal, depth or
+// albedo differ from the center pixel, and the more its luminance differs measured in
+// standard deviations of the center pixel's noise. The noise estimate is filtered along,
+// so later passes only smooth what earlier ones left. Four passes span 61 pixels.
+struct DenoiserOptions {
+    int passes = 4;
+    // Luminance differences of about this many standard deviations still get blurred.
+    double color_sigma = 4.0;
+    // Scale of the normal differences, the normals being unit vectors.
+    double normal_sigma = 0.1;
+    // Depth change per pixel of distance, relative to the depth of the center pixel.
+    double depth_sigma = 0.02;
+    double albedo_sigma = 0.1;
+};
+
+namespace detail {
+    // e^x for x <= 0 to about 1e-4 relative error: 2^(x log2 e) split into an exponent and
+    // a polynomial, cheap enough to evaluate 100 times per pixel and pass. Below e^-20 it
+    // returns 0: such weights do not matter, and their products would go denormal, which
+    // is very slow.
+    constexpr float fast_exp_cutoff = -20.0f;
+
+    inline float fast_exp(float x) {
+        float y = std::max(x, fast_exp_cutoff) * 1.44269504f;
+        float floor_y = std::floor(y);
+        float f = y - floor_y;
+        float p = 1.0f + f * (0.69314718f + f * (0.24022650f + f * (0.05550411f + f * (0.00961813f + f * 0.00133336f))));
+        int32_t bits;
+        std::memcpy(&bits, &p, sizeof(bits));
+        bits += static_cast<int32_t>(floor_y) * (1 << 23);
+        std::memcpy(&p, &bits, sizeof(p));
+        return x < fast_exp_cutoff ? 0.0f : p;
+    }
+
+#if RT_SIMD_X86
+    __attribute__((target("avx2")))
+    inline __m256 fast_exp_avx2(__m256 x) {
+        const __m256 cutoff = _mm256_set1_ps(fast_exp_cutoff);
+        __m256 y = _mm256_mul_ps(_mm256_max_ps(x, cutoff), _mm256_set1_ps(1.44269504f));
+        __m256 floor_y = _mm256_floor_ps(y);
+        __m256 f = _mm256_sub_ps(y, floor_y);
+        __m256 p = _mm256_set1_ps(0.00133336f);
+        for (float coefficient : {0.00961813f, 0.05550411f, 0.24022650f, 0.69314718f, 1.0f}) {
+            p = _mm256_add_ps(_mm256_set1_ps(coefficient), _mm256_mul_ps(f, p));
+        }
+        __m256i exponent = _mm256_slli_epi32(_mm256_cvtps_epi32(floor_y), 23);
+        __m256 result = _mm256_castsi256_ps(_mm256_add_epi32(_mm256_castps_si256(p), exponent));
+        return _mm256_andnot_ps(_mm256_cmp_ps(x, cutoff, _CMP_LT_OQ), result);
+    }
+#endif
+
+    // The images as separate float planes, so the filter loops load consecutive pixels.
+    struct DenoiserPlanes {
+        int width;
+        int height;
+        std::vector<float> albedo[3];
+        std::vector<float> normal[3];
+        std::vector<float> depth;
+        // 1 / (depth_sigma * depth), precomputed per pixel.
+        std::vector<float> inverse_depth_scale;
+
+        DenoiserPlanes(int width, int height)
+            : width{width}, height{height}, depth(std::size_t(width) * height),
+              inverse_depth_scale(std::size_t(width) * height) {
+            for (int channel = 0; channel < 3; channel++) {
+                albedo[channel].resize(depth.size());
+                normal[channel].resize(depth.size());
+            }
+        }
+    };
+
+    // The planes a pass reads and writes: color and the variance of its luminance.
+    struct DenoiserImage {
+        std::vector<float> color[3];
+        std::vector<float> variance;
+
+        explicit DenoiserImage(std::size_t size) : variance(size) {
+            for (auto& channel : color) {
+                channel.resize(size);
+            }
+        }
+    };
+
+    // One pass of the filter, run on a range of rows by each thread.
+    class AtrousPass {
+    public:
+        AtrousPass(
+                const DenoiserPlanes& planes, const DenoiserImage& input, DenoiserImage& output, int step,
+                const DenoiserOptions& options)
+            : planes_{planes}
+            , input_{input}
+            , output_{output}
+            , step_{step}
+            , inverse_color_sigma_squared_{static_cast<float>(1.0 / (options.color_sigma * options.color_sigma))}
+            , inverse_normal_variance_{static_cast<float>(1.0 / (options.normal_sigma * options.normal_sigma))}
+            , inverse_albedo_variance_{static_cast<float>(1.0 / (options.albedo_sigma * options.albedo_sigma))} {
+            static constexpr float kernel[5] = {1.0f / 16, 1.0f / 4, 3.0f / 8, 1.0f / 4, 1.0f / 16};
+            for (int ky = 0; ky < 5; ky++) {
+                for (int kx = 0; kx < 5; kx++) {
+                    int dx = kx - 2;
+                    int dy = ky - 2;
+                    tap_weights_[ky * 5 + kx] = kernel[ky] * kernel[kx];
+                    inverse_distances_[ky * 5 + kx] = 1.0f / std::max(1.0f, step * std::sqrt(float(dx * dx + dy * dy)));
+                }
+            }
+        }
+
+        void operator () (int first_row, int end_row) const {
+            const int width = planes_.width;
+            // Pixels whose taps all lie within the row can go eight at a time.
+            const int first_inner_x = 2 * step_;
+            const int end_inner_x = width - 2 * step_;
+            for (int y = first_row; y < end_row; y++) {
+                int x = 0;
+                while (x < width) {
+#if RT_SIMD_X86
+                    if (simd_level() == SimdLevel::avx2 && x >= first_inner_x && x + 8 <= end_inner_x) {
+                        filter_avx2(y, x);
+                        x += 8;
+                        continue;
+                    }
+#endif
+                    filter(y, x);
+                    x++;
+                }
+            }
+        }
+
+    private:
+        float inverse_color_scale(int p) const {
+            return inverse_color_sigma_squared_ / (input_.variance[p] + 1e-6f);
+        }
+
+        // The weight of pixel q for center pixel p, without the kernel weight.
+        float edge_stopping_weight(int p, int q, float inverse_color_scale, float inverse_distance) const {
+            float luminance_distance = sqr(
+                0.2126f * (input_.color[0][q] - input_.color[0][p])
+                + 0.7152f * (input_.color[1][q] - input_.color[1][p])
+                + 0.0722f * (input_.color[2][q] - input_.color[2][p]));
+            float normal_distance = 0.0f;
+            float albedo_distance = 0.0f;
+            for (int channel = 0; channel < 3; channel++) {
+                normal_distance += sqr(planes_.normal[channel][q] - planes_.normal[channel][p]);
+                albedo_distance += sqr(planes_.albedo[channel][q] - planes_.albedo[channel][p]);
+            }
+            float depth_distance = sqr((planes_.depth[q] - planes_.depth[p]) * planes_.inverse_depth_scale[p] * inverse_distance);
+            return fast_exp(
+                -luminance_distance * inverse_color_scale
+                - normal_distance * inverse_normal_variance_
+                - albedo_distance * inverse_albedo_variance_
+                - depth_distance);
+        }
+
+        // Taps outside the image are left out, the weights are renormalized.
+        void filter(int y, int x) const {
+            const int width = planes_.width;
+            const int p = y * width + x;
+            const float color_scale = inverse_color_scale(p);
+            float sums[3] = {0.0f, 0.0f, 0.0f};
+            float variance_sum = 0.0f;
+            float weight_sum = 0.0f;
+            for (int tap = 0; tap < 25; tap++) {
+                int qy = y + (tap / 5 - 2) * step_;
+                int qx = x + (tap % 5 - 2) * step_;
+                if (qy < 0 || qy >= planes_.height || qx < 0 || qx >= width) {
+                    continue;
+                }
+                int q = qy * width + qx;
+                float weight = tap_weights_[tap] * edge_stopping_weight(p, q, color_scale, inverse_distances_[tap]);
+                for (int channel = 0; channel < 3; channel++) {
+                    sums[channel] += weight * input_.color[channel][q];
+                }
+                variance_sum += weight * weight * input_.variance[q];
+                weight_sum += weight;
+            }
+            for (int channel = 0; channel < 3; channel++) {
+                output_.color[channel][p] = sums[channel] / weight_sum;
+            }
+            output_.variance[p] = variance_sum / (weight_sum * weight_sum);
+        }
+
+#if RT_SIMD_X86
+        // `filter` for the eight pixels from x on, with the same operations in the same order.
+        // The sums stay in registers across the 25 taps.
+        __attribute__((target("avx2")))
+        void filter_avx2(int y, int x) const {
+            const int width = planes_.width;
+            const int p = y * width + x;
+            __m256 center_color[3], center_normal[3], center_albedo[3];
+            for (int channel = 0; channel < 3; channel++) {
+                center_color[channel] = _mm256_loadu_ps(input_.color[channel].data() + p);
+                center_normal[channel] = _mm256_loadu_ps(planes_.normal[channel].data() + p);
+                center_albedo[channel] = _mm256_loadu_ps(planes_.albedo[channel].data() + p);
+            }
+            const __m256 center_depth = _mm256_loadu_ps(planes_.depth.data() + p);
+            const __m256 inverse_depth_scale = _mm256_loadu_ps(planes_.inverse_depth_scale.data() + p);
+            const __m256 color_scale = _mm256_div_ps(_mm256_set1_ps(inverse_color_sigma_squared_),
+                _mm256_add_ps(_mm256_loadu_ps(input_.variance.data() + p), _mm256_set1_ps(1e-6f)));
+            const __m256 normal_scale = _mm256_set1_ps(inverse_normal_variance_);
+            const __m256 albedo_scale = _mm256_set1_ps(inverse_albedo_variance_);
+            const float luminance_weights[3] = {0.2126f, 0.7152f, 0.0722f};
+
+            __m256 sums[3] = {_mm256_setzero_ps(), _mm256_setzero_ps(), _mm256_setzero_ps()};
+            __m256 variance_sum = _mm256_setzero_ps();
+            __m256 weight_sum = _mm256_setzero_ps();
+            for (int tap = 0; tap < 25; tap++) {
+                int qy = y + (tap / 5 - 2) * step_;
+                if (qy < 0 || qy >= planes_.height) {
+                    continue;
+                }
+                int q = qy * width + x + (tap % 5 - 2) * step_;
+                __m256 colors[3];
+                __m256 luminance_difference = _mm256_setzero_ps();
+                __m256 normal_distance = _mm256_setzero_ps();
+                __m256 albedo_distance = _mm256_setzero_ps();
+                for (int channel = 0; channel < 3; channel++) {
+                    colors[channel] = _mm256_loadu_ps(input_.color[channel].data() + q);
+                    __m256 term = _mm256_mul_ps(_mm256_set1_ps(luminance_weights[channel]),
+                        _mm256_sub_ps(colors[channel], center_color[channel]));
+                    luminance_difference = channel == 0 ? term : _mm256_add_ps(luminance_difference, term);
+                    __m256 normal_difference = _mm256_sub_ps(
+                        _mm256_loadu_ps(planes_.normal[channel].data() + q), center_normal[channel]);
+                    normal_distance = _mm256_add_ps(normal_distance, _mm256_mul_ps(normal_difference, normal_difference));
+                    __m256 albedo_difference = _mm256_sub_ps(
+                        _mm256_loadu_ps(planes_.albedo[channel].data() + q), center_albedo[channel]);
+                    albedo_distance = _mm256_add_ps(albedo_distance, _mm256_mul_ps(albedo_difference, albedo_difference));
+                }
+                __m256 depth_difference = _mm256_mul_ps(_mm256_mul_ps(
+                    _mm256_sub_ps(_mm256_loadu_ps(planes_.depth.data() + q), center_depth), inverse_depth_scale),
+                    _mm256_set1_ps(inverse_distances_[tap]));
+                __m256 exponent = _mm256_sub_ps(_mm256_sub_ps(_mm256_sub_ps(
+                    _mm256_sub_ps(_mm256_setzero_ps(),
+                        _mm256_mul_ps(_mm256_mul_ps(luminance_difference, luminance_difference), color_scale)),
+                    _mm256_mul_ps(normal_distance, normal_scale)),
+                    _mm256_mul_ps(albedo_distance, albedo_scale)),
+                    _mm256_mul_ps(depth_difference, depth_difference));
+                __m256 weight = _mm256_mul_ps(_mm256_set1_ps(tap_weights_[tap]), fast_exp_avx2(exponent));
+                for (int channel = 0; channel < 3; channel++) {
+                    sums[channel] = _mm256_add_ps(sums[channel], _mm256_mul_ps(weight, colors[channel]));
+                }
+                variance_sum = _mm256_add_ps(variance_sum,
+                    _mm256_mul_ps(_mm256_mul_ps(weight, weight), _mm256_loadu_ps(input_.variance.data() + q)));
+                weight_sum = _mm256_add_ps(weight_sum, weight);
+            }
+            for (int channel = 0; channel < 3; channel++) {
+                _mm256_storeu_ps(output_.color[channel].data() + p, _mm256_div_ps(sums[channel], weight_sum));
+            }
+            _mm256_storeu_ps(output_.variance.data() + p,
+                _mm256_div_ps(variance_sum, _mm256_mul_ps(weight_sum, weight_sum)));
+        }
+#endif
+
+        static float sqr(float x) {
+            return x * x;
+        }
+
+        const DenoiserPlanes& planes_;
+        const DenoiserImage& input_;
+        DenoiserImage& output_;
+        int step_;
+        float inverse_color_sigma_squared_;
+        float inverse_normal_variance_;
+        float inverse_albedo_variance_;
+        float tap_weights_[25];
+        float inverse_distances_[25];
+    };
+}
+
+// Denoises the color of an image rendered with AOVs, splitting the rows between the
+// threads of `pool`.
+Framebuffer denoise(const RenderedImage& image, const DenoiserOptions& options, ThreadPool& pool) {
+    assert(image.has_aovs());
+    const int width = image.color.width();
+    const int height = image.color.height();
+    const std::size_t size = image.color.pixels().size();
+
+    detail::DenoiserPlanes planes{width, height};
+    detail::DenoiserImage buffers[2] = {detail::DenoiserImage{size}, detail::DenoiserImage{size}};
+    for (std::size_t i = 0; i < size; i++) {
+        for (int channel = 0; channel < 3; channel++) {
+            buffers[0].color[channel][i] = static_cast<float>(image.color.pixels()[i][channel]);
+            planes.albedo[channel][i] = static_cast<float>(image.albedo.pixels()[i][channel]);
+            planes.normal[channel][i] = static_cast<float>(image.normal.pixels()[i][channel]);
+        }
+        buffers[0].variance[i] = static_cast<float>(image.variance.pixels()[i]);
+        planes.depth[i] = static_cast<float>(image.depth.pixels()[i]);
+        // Escaped rays have depth 0, which makes them an edge to every surface.
+        planes.inverse_depth_scale[i] = static_cast<float>(1.0 / (options.depth_sigma * std::max(image.depth.pixels()[i], 1e-3)));
+    }
+
+    const int num_threads = pool.size();
+    for (int pass = 0; pass < options.passes; pass++) {
+        detail::AtrousPass atrous_pass{planes, buffers[pass % 2], buffers[(pass + 1) % 2], 1 << pass, options};
+        pool.run([&](int thread) {
+            atrous_pass(height * thread / num_threads, height * (thread + 1) / num_threads);
+        });
+    }
+
+    const detail::DenoiserImage& result = buffers[options.passes % 2];
+    Framebuffer denoised{width, height};
+    for (int row = 0; row < height; row++) {
+        for (int col = 0; col < width; col++) {
+            std::size_t i = static_cast<std::size_t>(row) * width + col;
+            denoised.at(row, col) = Vec3{result.color[0][i], result.color[1][i], result.color[2][i]};
+        }
+    }
+    return denoised;
+}
+
+Framebuffer denoise(const RenderedImage& image, const DenoiserOptions& options = {}, int num_threads = 1) {
+    ThreadPool pool{std::max(1, std::min(num_threads, image.color.height()))};
+    return denoise(image, options, pool);
+}
@@ -0,0 +1,703 @@
+#pragma once
+
+#include <arpa/inet.h>
+#include <netdb.h>
+#include <netinet/in.h>
+#include <netinet/tcp.h>
+#include <poll.h>
+#include <sys/socket.h>
+#include <unistd.h>
+
+#include <algorithm>
+#include <chrono>
+#include <cerrno>
+#include <cstdint>
+#include <cstring>
+#include <deque>
+#include <iostream>
+#include <optional>
+#include <string>
+#include <thread>
+#include <utility>
+#include <vector>
+
+#include "framebuffer.h"
+#include "renderer.h"
+#include "task_renderer.h"
+#include "task_splitter.h"
+#include "tile_scheduler.h"
+
+// Rendering spread over worker processes, on this machine or others, that each hold the
+// scene already and render tiles for a coordinator over TCP. Every worker connection is
+// sent the render settings first and has to answer that it renders the same image; then
+// it is kept busy with a few tiles at a time, and sends back each tile's pixels. Tiles of
+// a connection that fails are handed to the others. Messages are a type and size header
+// with a payload in native byte order, so coordinator and workers need the same build.
+namespace detail {
+    enum class RenderMessage : uint32_t {
+        settings,
+        ready,
+        tile,
+        tile_result,
+        done,
+    };
+
+    struct RenderMessageHeader {
+        uint32_t type;
+        uint32_t size;
+    };
+
+    // Everything that decides the pixels, as far as the coordinator can tell: the image,
+    // the sampling, and the shape of the world.
+    struct RenderSettings {
+        int32_t image_width;
+        int32_t image_height;
+        int32_t samples_per_pixel;
+        int32_t max_ray_bounce_depth;
+        uint64_t seed;
+        int32_t sample_sequence;
+        int32_t adaptive_sampling;
+        int32_t adaptive_min_samples;
+        int32_t adaptive_max_samples;
+        double noise_threshold;
+        uint64_t sphere_count;
+        uint64_t instance_count;
+        uint64_t material_count;
+        double camera_origin[3];
+        double camera_lower_left_corner[3];
+        double camera_horizontal[3];
+        double camera_vertical[3];
+        double camera_lens_radius;
+        int32_t path_tracing;
+        int32_t russian_roulette_min_depth;
+        double russian_roulette_max_survival;
+        int32_t wavefront_batch_size;
+        int32_t packet_size;
+        int32_t sample_lights;
+        // Whether tile results carry the AOVs.
+        uint32_t with_aovs;
+        // World::content_hash of the scene.
+        uint64_t scene_hash;
+    };
+    // Settings compare as bytes, so they must not contain padding.
+    static_assert(sizeof(RenderSettings) == 216);
+
+    void copy_vec3(double* out, const Vec3& v) {
+        out[0] = v[0];
+        out[1] = v[1];
+        out[2] = v[2];
+    }
+
+    RenderSettings make_render_settings(const Renderer& renderer, bool with_aovs) {
+        RenderSettings settings = {};
+        settings.image_width = renderer.image_width();
+        settings.image_height = renderer.image_height();
+        settings.samples_per_pixel = renderer.samples_per_pixel();
+        settings.max_ray_bounce_depth = renderer.max_ray_bounce_depth();
+        settings.seed = renderer.seed();
+        settings.sample_sequence = static_cast<int32_t>(renderer.sample_sequence());
+        settings.adaptive_sampling = renderer.adaptive_sampling().enabled;
+        settings.adaptive_min_samples = renderer.adaptive_sampling().min_samples;
+        settings.adaptive_max_samples = renderer.adaptive_sampling().max_samples;
+        settings.noise_threshold = renderer.adaptive_sampling().noise_threshold;
+        settings.sphere_count = renderer.world().spheres().size();
+        settings.instance_count = renderer.world().instances().size();
+        settings.material_count = renderer.world().materials().size();
+        const Camera& camera = renderer.camera();
+        copy_vec3(settings.camera_origin, camera.origin());
+        copy_vec3(settings.camera_lower_left_corner, camera.lower_left_corner());
+        copy_vec3(settings.camera_horizontal, camera.horizontal());
+        copy_vec3(settings.camera_vertical, camera.vertical());
+        settings.camera_lens_radius = camera.lens_radius();
+        const EngineOptions& engine_options = renderer.engine_options();
+        settings.path_tracing = static_cast<int32_t>(engine_options.path_tracing);
+        settings.russian_roulette_min_depth = engine_options.russian_roulette_min_depth;
+        settings.russian_roulette_max_survival = engine_options.russian_roulette_max_survival;
+        settings.wavefront_batch_size = engine_options.wavefront_batch_size;
+        settings.packet_size = engine_options.packet_size;
+        settings.sample_lights = engine_options.sample_lights;
+        settings.with_aovs = with_aovs;
+        settings.scene_hash = renderer.world().content_hash();
+        return settings;
+    }
+
+    bool renders_same_image(const RenderSettings& lhs, const RenderSettings& rhs) {
+        RenderSettings a = lhs;
+        RenderSettings b = rhs;
+        a.with_aovs = b.with_aovs = 0;
+        return std::memcmp(&a, &b, sizeof(RenderSettings)) == 0;
+    }
+
+    // A tile result is this header, then a WirePixel for every pixel of the tile row by
+    // row, then as many WireAovs if the settings ask for them.
+    struct TileResultHeader {
+        RenderTask task;
+        uint64_t rays_traced;
+    };
+
+    struct WirePixel {
+        double color[3];
+        int64_t sample_count;
+    };
+
+    struct WireAovs {
+        double albedo[3];
+        double normal[3];
+        double depth;
+        double variance;
+    };
+
+    std::size_t tile_pixel_count(const RenderTask& task) {
+        return std::size_t(task.end_x - task.start_x + 1) * (task.end_y - task.start_y + 1);
+    }
+
+    std::size_t tile_result_size(const RenderTask& task, bool with_aovs) {
+        return sizeof(TileResultHeader)
+            + tile_pixel_count(task) * (sizeof(WirePixel) + (with_aovs ? sizeof(WireAovs) : 0));
+    }
+
+    // Connected TCP socket, closed on destruction. Sends and receives whole messages.
+    class Socket {
+    public:
+        Socket() {}
+        explicit Socket(int fd) : fd_{fd} {}
+
+        Socket(Socket&& other) noexcept : fd_{std::exchange(other.fd_, -1)} {}
+
+        Socket& operator=(Socket&& other) noexcept {
+            std::swap(fd_, other.fd_);
+            return *this;
+        }
+
+        ~Socket() {
+            if (fd_ >= 0) {
+                close(fd_);
+            }
+        }
+
+        int fd() const {
+            return fd_;
+        }
+
+        bool is_open() const {
+            return fd_ >= 0;
+        }
+
+        bool send(RenderMessage type, const void* payload = nullptr, std::size_t size = 0) {
+            RenderMessageHeader header{static_cast<uint32_t>(type), static_cast<uint32_t>(size)};
+            return send_all(&header, sizeof(header)) && send_all(payload, size);
+        }
+
+        // Blocks until a whole message is in. Returns false if the peer closed the
+        // connection, or announced a payload larger than `max_size`.
+        bool receive(RenderMessage& type, std::vector<char>& payload, std::size_t max_size) {
+            RenderMessageHeader header;
+            if (!receive_all(&header, sizeof(header)) || header.size > max_size) {
+                return false;
+            }
+            type = static_cast<RenderMessage>(header.type);
+            payload.resize(header.size);
+            return receive_all(payload.data(), header.size);
+        }
+
+        // Appends whatever has arrived to `buffer` without waiting for more. Returns false
+        // if the peer closed the connection.
+        bool receive_available(std::vector<char>& buffer) {
+            char chunk[1 << 16];
+            while (true) {
+                ssize_t received = recv(fd_, chunk, sizeof(chunk), MSG_DONTWAIT);
+                if (received > 0) {
+                    buffer.insert(buffer.end(), chunk, chunk + received);
+                } else if (received < 0 && errno == EINTR) {
+                    continue;
+                } else {
+                    return received < 0 && (errno == EAGAIN || errno == EWOULDBLOCK);
+                }
+            }
+        }
+
+        // Tiles are small messages that should go out at once.
+        void set_no_delay() {
+            int enable = 1;
+            setsockopt(fd_, IPPROTO_TCP, TCP_NODELAY, &enable, sizeof(enable));
+        }
+
+    private:
+        bool send_all(const void* data, std::size_t size) {
+            const char* bytes = static_cast<const char*>(data);
+            while (size > 0) {
+                // No SIGPIPE if the peer is gone, the error is handled like any other.
+                ssize_t sent = ::send(fd_, bytes, size, MSG_NOSIGNAL);
+                if (sent <= 0) {
+                    return false;
+                }
+                bytes += sent;
+                size -= sent;
+            }
+            return true;
+        }
+
+        bool receive_all(void* data, std::size_t size) {
+            char* bytes = static_cast<char*>(data);
+            while (size > 0) {
+                ssize_t received = recv(fd_, bytes, size, 0);
+                if (received <= 0) {
+                    return false;
+                }
+                bytes += received;
+                size -= received;
+            }
+            return true;
+        }
+
+        int fd_ = -1;
+    };
+
+    // Cuts the bytes a non-blocking connection received into whole messages.
+    class MessageReader {
+    public:
+        explicit MessageReader(std::size_t max_size) : max_size_{max_size} {}
+
+        // Returns false if the peer closed the connection.
+        bool receive(Socket& socket) {
+            buffer_.erase(buffer_.begin(), buffer_.begin() + start_);
+            start_ = 0;
+            return socket.receive_available(buffer_);
+        }
+
+        // Takes the next whole message, if one is in.
+        bool next(RenderMessage& type, std::vector<char>& payload) {
+            RenderMessageHeader header;
+            if (buffer_.size() - start_ < sizeof(header)) {
+                return false;
+            }
+            std::memcpy(&header, buffer_.data() + start_, sizeof(header));
+            if (header.size > max_size_) {
+                oversized_ = true;
+                return false;
+            }
+            if (buffer_.size() - start_ - sizeof(header) < header.size) {
+                return false;
+            }
+            const char* data = buffer_.data() + start_ + sizeof(header);
+            type = static_cast<RenderMessage>(header.type);
+            payload.assign(data, data + header.size);
+            start_ += sizeof(header) + header.size;
+            return true;
+        }
+
+        // Whether the peer announced a payload larger than the limit.
+        bool is_oversized() const {
+            return oversized_;
+        }
+
+    private:
+        std::size_t max_size_;
+        std::vector<char> buffer_;
+        std::size_t start_ = 0;
+        bool oversized_ = false;
+    };
+
+    // Retrying to connect to a local port that nobody listens on yet can end up with a
+    // socket connected to itself, if the kernel picks that same port for its end.
+    bool is_connected_to_itself(const Socket& socket) {
+        sockaddr_storage local;
+        sockaddr_storage peer;
+        socklen_t local_size = sizeof(local);
+        socklen_t peer_size = sizeof(peer);
+        return getsockname(socket.fd(), reinterpret_cast<sockaddr*>(&local), &local_size) == 0
+            && getpeername(socket.fd(), reinterpret_cast<sockaddr*>(&peer), &peer_size) == 0
+            && local_size == peer_size && std::memcmp(&local, &peer, local_size) == 0;
+    }
+
+    std::optional<Socket> connect_to(const std::string& host, uint16_t port) {
+        addrinfo hints = {};
+        hints.ai_family = AF_UNSPEC;
+        hints.ai_socktype = SOCK_STREAM;
+        addrinfo* addresses = nullptr;
+        if (getaddrinfo(host.c_str(), std::to_string(port).c_str(), &hints, &addresses) != 0) {
+            return {};
+        }
+        std::optional<Socket> connected;
+        for (addrinfo* address = addresses; address && !connected; address = address->ai_next) {
+            Socket socket{::socket(address->ai_family, address->ai_socktype, address->ai_protocol)};
+            if (socket.is_open() && connect(socket.fd(), address->ai_addr, address->ai_addrlen) == 0
+                    && !is_connected_to_itself(socket)) {
+                connected = std::move(socket);
+            }
+        }
+        freeaddrinfo(addresses);
+        return connected;
+    }
+}
+
+// What one worker connection did for the coordinator.
+struct WorkerStats {
+    std::string address;
+    int tiles_rendered = 0;
+    uint64_t rays_traced = 0;
+    // Tiles it had been sent when it failed, which went to other workers.
+    int tiles_lost = 0;
+    bool failed = false;
+};
+
+std::ostream& operator << (std::ostream& out, const WorkerStats& stats) {
+    return out << "  Worker " << stats.address << ": " << stats.tiles_rendered << " tiles, "
+        << stats.rays_traced << " rays" << (stats.failed ? ", failed with " : "")
+        << (stats.failed ? std::to_string(stats.tiles_lost) + " tiles reassigned" : "");
+}
+
+// Hands out the tiles of a render to worker connections (see run_render_worker) and
+// collects their pixels into the image.
+class RenderCoordinator {
+public:
+    // Tiles each worker has in hand, so it starts the next while the result of the last
+    // is on its way.
+    int tiles_per_worker = 2;
+    // A worker that holds tiles and sends nothing for this long is taken as failed.
+    double worker_timeout_seconds = 300.0;
+    // Report the tile count, the port, progress and per-worker stats on stderr. Failing
+    // workers are reported either way.
+    bool verbose = false;
+
+    // Listens on the port of all interfaces, or on a free port if 0 (see port()).
+    static std::optional<RenderCoordinator> listen(uint16_t port) {
+        detail::Socket listener{socket(AF_INET6, SOCK_STREAM, 0)};
+        if (!listener.is_open()) {
+            std::cerr << "Could not create a socket" << std::endl;
+            return {};
+        }
+        int enable = 1;
+        int v6_only = 0;
+        setsockopt(listener.fd(), SOL_SOCKET, SO_REUSEADDR, &enable, sizeof(enable));
+        setsockopt(listener.fd(), IPPROTO_IPV6, IPV6_V6ONLY, &v6_only, sizeof(v6_only));
+        sockaddr_in6 address = {};
+        address.sin6_family = AF_INET6;
+        address.sin6_addr = in6addr_any;
+        address.sin6_port = htons(port);
+        socklen_t address_size = sizeof(address);
+        if (bind(listener.fd(), reinterpret_cast<sockaddr*>(&address), sizeof(address)) != 0
+                || ::listen(listener.fd(), SOMAXCONN) != 0
+                || getsockname(listener.fd(), reinterpret_cast<sockaddr*>(&address), &address_size) != 0) {
+            std::cerr << "Could not listen on port " << port << std::endl;
+            return {};
+        }
+        RenderCoordinator coordinator;
+        coordinator.listener_ = std::move(listener);
+        coordinator.port_ = ntohs(address.sin6_port);
+        return coordinator;
+    }
+
+    uint16_t port() const {
+        return port_;
+    }
+
+    // Renders the image with whatever workers connect, before or during the render, and
+    // returns once every tile is in. The workers have to render the same image as
+    // `renderer`, which the coordinator itself only uses for its settings.
+    RenderedImage render(
+            const Renderer& renderer, const SchedulerOptions& scheduler_options = {}, bool output_aovs = false,
+            std::vector<WorkerStats>* worker_stats = nullptr) {
+        using Clock = std::chrono::steady_clock;
+        auto tasks = split_tiles(renderer.image_height(), renderer.image_width(), scheduler_options.tile_size, scheduler_options.order);
+        if (verbose) {
+            std::cerr << "Number of tiles: " << tasks.size() << std::endl << std::flush;
+            std::cerr << "Waiting for workers on port " << port_ << std::endl;
+        }
+
+        const detail::RenderSettings settings = detail::make_render_settings(renderer, output_aovs);
+        // Nothing a worker sends is larger than the result of a whole tile.
+        const int tile_size = scheduler_options.tile_size;
+        const std::size_t max_message_size = detail::tile_result_size({0, tile_size - 1, 0, tile_size - 1}, output_aovs);
+        RenderedImage image{renderer.image_width(), renderer.image_height(), output_aovs};
+        std::deque<RenderTask> pending(tasks.begin(), tasks.end());
+        std::size_t remaining_tiles = tasks.size();
+        std::vector<Worker> workers;
+        std::vector<WorkerStats> stats;
+
+        auto fail = [&](Worker& worker, const char* reason) {
+            WorkerStats& worker_stats = stats[worker.stats_index];
+            std::cerr << "\nWorker " << worker_stats.address << " " << reason << ", reassigning "
+                << worker.in_flight.size() << " tiles" << std::endl;
+            worker_stats.failed = true;
+            worker_stats.tiles_lost += worker.in_flight.size();
+            pending.insert(pending.begin(), worker.in_flight.begin(), worker.in_flight.end());
+            worker.in_flight.clear();
+            worker.socket = {};
+        };
+        auto hand_out_tiles = [&](Worker& worker) {
+            while (worker.socket.is_open() && worker.is_ready
+                    && worker.in_flight.size() < std::size_t(tiles_per_worker) && !pending.empty()) {
+                RenderTask task = pending.front();
+                pending.pop_front();
+                worker.in_flight.push_back(task);
+                if (!worker.socket.send(detail::RenderMessage::tile, &task, sizeof(task))) {
+                    fail(worker, "disconnected");
+                }
+            }
+        };
+
+        std::vector<pollfd> poll_fds;
+        std::vector<char> payload;
+        while (remaining_tiles > 0) {
+            poll_fds.clear();
+            poll_fds.push_back({listener_.fd(), POLLIN, 0});
+            for (const Worker& worker : workers) {
+                poll_fds.push_back({worker.socket.fd(), POLLIN, 0});
+            }
+            // Wakes up every second to check for workers that went quiet.
+            if (poll(poll_fds.data(), poll_fds.size(), 1000) < 0) {
+                continue;
+            }
+
+            if (poll_fds[0].revents & POLLIN) {
+                sockaddr_storage address;
+                socklen_t address_size = sizeof(address);
+                detail::Socket socket{accept(listener_.fd(), reinterpret_cast<sockaddr*>(&address), &address_size)};
+                if (socket.is_open()) {
+                    socket.set_no_delay();
+                    stats.push_back({describe(address)});
+                    if (socket.send(detail::RenderMessage::settings, &settings, sizeof(settings))) {
+                        workers.emplace_back(std::move(socket), max_message_size, stats.size() - 1);
+                    }
+                }
+            }
+
+            for (std::size_t w = 0; w < workers.size(); w++) {
+                Worker& worker = workers[w];
+                if (!(poll_fds[w + 1].revents & (POLLIN | POLLHUP | POLLERR))) {
+                    continue;
+                }
+                worker.last_heard = Clock::now();
+                if (!worker.reader.receive(worker.socket)) {
+                    fail(worker, "disconnected");
+                    continue;
+                }
+                // Only whole messages are handled; the rest waits for more to arrive.
+                detail::RenderMessage type;
+                while (worker.socket.is_open() && worker.reader.next(type, payload)) {
+                    if (type == detail::RenderMessage::ready && !worker.is_ready) {
+                        worker.is_ready = true;
+                    } else if (type == detail::RenderMessage::tile_result && worker.is_ready) {
+                        if (!add_tile_result(payload, output_aovs, worker, stats[worker.stats_index], image)) {
+                            fail(worker, "sent a malformed tile");
+                            break;
+                        }
+                        remaining_tiles--;
+                        if (verbose) {
+                            std::cerr << "\rRemaining tiles: " << remaining_tiles << ' ' << std::flush;
+                        }
+                    } else {
+                        fail(worker, "broke the protocol");
+                    }
+                }
+                if (worker.socket.is_open() && worker.reader.is_oversized()) {
+                    fail(worker, "sent an oversized message");
+                }
+            }
+
+            for (Worker& worker : workers) {
+                double quiet_seconds = std::chrono::duration<double>(Clock::now() - worker.last_heard).count();
+                if (worker.socket.is_open() && !worker.in_flight.empty() && quiet_seconds > worker_timeout_seconds) {
+                    fail(worker, "timed out");
+                }
+            }
+            workers.erase(std::remove_if(workers.begin(), workers.end(), [](const Worker& worker) {
+                return !worker.socket.is_open();
+            }), workers.end());
+            // Tiles lost by a failed worker go to whoever has room.
+            for (Worker& worker : workers) {
+                hand_out_tiles(worker);
+            }
+        }
+        if (verbose) {
+            std::cerr << std::endl;
+        }
+
+        for (Worker& worker : workers) {
+            worker.socket.send(detail::RenderMessage::done);
+        }
+        // Workers still waiting to be accepted are told there is nothing left to do.
+        pollfd listener_fd{listener_.fd(), POLLIN, 0};
+        while (poll(&listener_fd, 1, 0) > 0 && (listener_fd.revents & POLLIN)) {
+            detail::Socket socket{accept(listener_.fd(), nullptr, nullptr)};
+            socket.send(detail::RenderMessage::done);
+        }
+        if (verbose) {
+            for (const WorkerStats& worker : stats) {
+                std::cerr << worker << std::endl;
+            }
+        }
+        if (worker_stats) {
+            *worker_stats = std::move(stats);
+        }
+        return image;
+    }
+
+private:
+    struct Worker {
+        detail::Socket socket;
+        detail::MessageReader reader;
+        std::size_t stats_index;
+        std::chrono::steady_clock::time_point last_heard;
+        bool is_ready = false;
+        std::deque<RenderTask> in_flight;
+
+        Worker(detail::Socket socket, std::size_t max_message_size, std::size_t stats_index)
+            : socket{std::move(socket)}, reader{max_message_size}, stats_index{stats_index},
+              last_heard{std::chrono::steady_clock::now()} {}
+    };
+
+    RenderCoordinator() {}
+
+    static std::string describe(const sockaddr_storage& address) {
+        char host[NI_MAXHOST];
+        char port[NI_MAXSERV];
+        if (getnameinfo(reinterpret_cast<const sockaddr*>(&address), sizeof(address), host, sizeof(host),
+                port, sizeof(port), NI_NUMERICHOST | NI_NUMERICSERV) != 0) {
+            return "unknown";
+        }
+        return std::string(host) + ":" + port;
+    }
+
+    // Copies a tile result into the image. It has to be for a tile the worker was given.
+    static bool add_tile_result(
+            const std::vector<char>& payload, bool with_aovs, Worker& worker, WorkerStats& stats,
+            RenderedImage& image) {
+        if (payload.size() < sizeof(detail::TileResultHeader)) {
+            return false;
+        }
+        detail::TileResultHeader header;
+        std::memcpy(&header, payload.data(), sizeof(header));
+        auto in_flight = std::find_if(worker.in_flight.begin(), worker.in_flight.end(), [&](const RenderTask& task) {
+            return std::memcmp(&task, &header.task, sizeof(RenderTask)) == 0;
+        });
+        if (in_flight == worker.in_flight.end() || payload.size() != detail::tile_result_size(header.task, with_aovs)) {
+            return false;
+        }
+        worker.in_flight.erase(in_flight);
+
+        const RenderTask& task = header.task;
+        const char* pixel_data = payload.data() + sizeof(header);
+        const char* aov_data = pixel_data + detail::tile_pixel_count(task) * sizeof(detail::WirePixel);
+        std::size_t p = 0;
+        for (int row = task.start_y; row <= task.end_y; row++) {
+            for (int col = task.start_x; col <= task.end_x; col++, p++) {
+                detail::WirePixel pixel;
+                std::memcpy(&pixel, pixel_data + p * sizeof(pixel), sizeof(pixel));
+                image.color.at(row, col) = Vec3{pixel.color[0], pixel.color[1], pixel.color[2]};
+                image.sample_counts.at(row, col) = pixel.sample_count;
+                if (with_aovs) {
+                    detail::WireAovs aovs;
+                    std::memcpy(&aovs, aov_data + p * sizeof(aovs), sizeof(aovs));
+                    image.albedo.at(row, col) = Vec3{aovs.albedo[0], aovs.albedo[1], aovs.albedo[2]};
+                    image.normal.at(row, col) = Vec3{aovs.normal[0], aovs.normal[1], aovs.normal[2]};
+                    image.depth.at(row, col) = aovs.depth;
+                    image.variance.at(row, col) = aovs.variance;
+                }
+            }
+        }
+        stats.tiles_rendered++;
+        stats.rays_traced += header.rays_traced;
+        return true;
+    }
+
+    detail::Socket listener_;
+    uint16_t port_ = 0;
+};
+
+namespace detail {
+    // Renders tiles over one connection until the coordinator is done. Returns false if
+    // the render did not finish.
+    bool serve_tiles(const Renderer& renderer, Socket& socket) {
+        RenderMessage type;
+        std::vector<char> payload;
+        // The coordinator sends nothing larger than the settings.
+        const std::size_t max_message_size = std::max(sizeof(RenderSettings), sizeof(RenderTask));
+        bool received = socket.receive(type, payload, max_message_size);
+        if (received && type == RenderMessage::done) {
+            // Joined after the last tile went out.
+            return true;
+        }
+        if (!received || type != RenderMessage::settings || payload.size() != sizeof(RenderSettings)) {
+            std::cerr << "No render settings from the coordinator" << std::endl;
+            return false;
+        }
+        RenderSettings settings;
+        std::memcpy(&settings, payload.data(), sizeof(settings));
+        if (!renders_same_image(settings, make_render_settings(renderer, settings.with_aovs))) {
+            std::cerr << "The coordinator renders a different image or scene" << std::endl;
+            return false;
+        }
+        if (!socket.send(RenderMessage::ready)) {
+            return false;
+        }
+
+        std::vector<PixelSample> pixels;
+        std::vector<PixelAovs> aovs;
+        std::vector<char> result;
+        while (socket.receive(type, payload, max_message_size)) {
+            if (type == RenderMessage::done) {
+                return true;
+            }
+            if (type != RenderMessage::tile || payload.size() != sizeof(RenderTask)) {
+                break;
+            }
+            TileResultHeader header;
+            std::memcpy(&header.task, payload.data(), sizeof(RenderTask));
+            header.rays_traced = render_task_pixels(header.task, renderer, pixels, settings.with_aovs ? &aovs : nullptr);
+
+            result.resize(tile_result_size(header.task, settings.with_aovs));
+            std::memcpy(result.data(), &header, sizeof(header));
+            char* pixel_data = result.data() + sizeof(header);
+            char* aov_data = pixel_data + pixels.size() * sizeof(WirePixel);
+            for (std::size_t p = 0; p < pixels.size(); p++) {
+                const Vec3& color = pixels[p].color;
+                WirePixel pixel{{color[0], color[1], color[2]}, pixels[p].sample_count};
+                std::memcpy(pixel_data + p * sizeof(pixel), &pixel, sizeof(pixel));
+                if (settings.with_aovs) {
+                    const PixelAovs& a = aovs[p];
+                    WireAovs wire_aovs{
+                        {a.albedo[0], a.albedo[1], a.albedo[2]}, {a.normal[0], a.normal[1], a.normal[2]}, a.depth, a.variance};
+                    std::memcpy(aov_data + p * sizeof(wire_aovs), &wire_aovs, sizeof(wire_aovs));
+                }
+            }
+            if (!socket.send(RenderMessage::tile_result, result.data(), result.size())) {
+                break;
+            }
+        }
+        std::cerr << "Lost the connection to the coordinator" << std::endl;
+        return false;
+    }
+}
+
+// Renders tiles for the coordinator at host:port over `connections` connections, one
+// thread each, until it has all the tiles. The renderer has to be set up the same as
+// the coordinator's. A worker started before the coordinator keeps trying to connect for
+// `connect_timeout_seconds`. Returns false if any connection failed.
+bool run_render_worker(
+        const Renderer& renderer, const std::string& host, uint16_t port, int connections = 1,
+        double connect_timeout_seconds = 30.0) {
+    using Clock = std::chrono::steady_clock;
+    std::vector<std::thread> threads;
+    std::vector<char> succeeded(connections, false);
+    for (int c = 0; c < connections; c++) {
+        threads.emplace_back([&, c]() {
+            auto deadline = Clock::now() + std::chrono::duration<double>(connect_timeout_seconds);
+            std::optional<detail::Socket> socket;
+            while (!(socket = detail::connect_to(host, port)) && Clock::now() < deadline) {
+                std::this_thread::sleep_for(std::chrono::milliseconds(200));
+            }
+            if (!socket) {
+                std::cerr << "Could not connect to " << host << ":" << port << std::endl;
+                return;
+            }
+            socket->set_no_delay();
+            succeeded[c] = detail::serve_tiles(renderer, *socket);
+        });
+    }
+    for (auto& thread : threads) {
+        thread.join();
+    }
+    return std::all_of(succeeded.begin(), succeeded.end(), [](char ok) { return ok; });
+}
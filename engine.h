@@ -1,16 +1,32 @@
 #pragma once
 
+#include <algorithm>
+#include <array>
+#include <cassert>
+#include <cstdint>
 #include <variant>
 #include <optional>
 #include <tuple>
+#include <vector>
 
 #include "ray.h"
 #include "vec3.h"
 #include "sphere.h"
+#include "mesh.h"
+#include "instance.h"
+#include "ray_packet.h"
+#include "sphere_set.h"
+#include "stats.h"
 #include "hit_record.h"
 #include "world.h"
 
 namespace detail {
+  // 1 - cos(theta_max) of the cone a sphere subtends, from sin^2(theta_max) = r^2 / d^2,
+  // without the cancellation of 1 - sqrt(1 - x) for small or distant spheres.
+  double one_minus_cos_theta_max(double sin_squared_theta_max) {
+    return sin_squared_theta_max / (1.0 + sqrt(1.0 - sin_squared_theta_max));
+  }
+
   bool is_within_bounds(double x, double min, double max) {
     return min <= x && x <= max;
   }
@@ -23,7 +39,7 @@ namespace detail {
     }
   }
 
-  std::optional<HitRecord> hit_sphere(const Ray& ray, const Material& material, const Sphere& sphere) {
+  std::optional<HitRecord> hit_sphere(const Ray& ray, MaterialId material_id, const Sphere& sphere) {
       Vec3 d_center = ray.origin() - sphere.center();
       double a = ray.direction().length_squared();
       double half_b = dot(d_center, ray.direction());
@@ -34,61 +50,458 @@ namespace detail {
       } else {
         double t = (-half_b - sqrt(discriminant)) / a;
         Vec3 point = ray.at(t);
-        Vec3 outward_normal = unit_vector(point - sphere.center());
+        // Dividing by the signed radius turns the normals of hollow (negative radius) spheres inwards.
+        Vec3 outward_normal = (point - sphere.center()) / sphere.radius();
         auto [normal, front_face] = calculate_normal_and_front_face(ray, outward_normal);      
-        return {{point, normal, t, front_face, material}};
+        return {{point, normal, t, front_face, material_id}};
       }
   }
 
+  // Closest hit on one object with t in [t_min, t_max].
   struct HitVisitorFn {
     const Ray& ray;
-    const Material& material;
+    MaterialId material_id;
+    double t_min;
+    double t_max;
 
     std::optional<HitRecord> operator() (const Sphere& sphere) {
-      return hit_sphere(ray, material, sphere);
+      std::optional<HitRecord> hit_record = hit_sphere(ray, material_id, sphere);
+      if (hit_record && !is_within_bounds(hit_record->t, t_min, t_max)) {
+        return {};
+      }
+      return hit_record;
+    }
+
+    // The mesh is searched through its own hierarchy.
+    std::optional<HitRecord> operator() (const TriangleMesh& mesh) {
+      double t = t_max;
+      uint32_t triangle = 0;
+      if (!mesh.closest_hit(ray, t_min, t, triangle)) {
+        return {};
+      }
+      auto [normal, front_face] = calculate_normal_and_front_face(ray, mesh.normal(triangle));
+      return {{ray.at(t), normal, t, front_face, material_id}};
+    }
+
+    // Each sphere of the set has its own material.
+    std::optional<HitRecord> operator() (const SphereSet& set) {
+      double t = t_max;
+      uint32_t index = 0;
+      if (!set.closest_hit(ray, t_min, t, index)) {
+        return {};
+      }
+      Vec3 point = ray.at(t);
+      const Sphere sphere = set.spheres().sphere(index);
+      Vec3 outward_normal = (point - sphere.center()) / sphere.radius();
+      auto [normal, front_face] = calculate_normal_and_front_face(ray, outward_normal);
+      return {{point, normal, t, front_face, set.spheres().material_id(index)}};
+    }
+
+    // The geometry is hit in its own space. The transformed ray is not normalized, so t
+    // carries over unchanged and only the hit point and normal go back to world space.
+    std::optional<HitRecord> operator() (const Instance& instance) {
+      const Transform& world_to_object = instance.world_to_object();
+      Ray local_ray = world_to_object.apply(ray);
+      std::optional<HitRecord> hit_record = std::visit(
+          HitVisitorFn{local_ray, material_id, t_min, t_max}, instance.geometry());
+      if (!hit_record) {
+        return {};
+      }
+      hit_record->point = ray.at(hit_record->t);
+      hit_record->normal = unit_vector(world_to_object.apply_transposed(hit_record->normal));
+      if (instance.material()) {
+        hit_record->material_id = *instance.material();
+      }
+      return hit_record;
     }
   };
 
-  std::optional<HitRecord> hit_object(const Ray& ray, const Object& object, const Material& material) {
-    return std::visit(HitVisitorFn{ray, material}, object);
+  std::optional<HitRecord> hit_instance(
+      const Ray& ray, const Instance& instance, MaterialId material_id, double t_min, double t_max) {
+    return HitVisitorFn{ray, material_id, t_min, t_max}(instance);
   }
 }
 
+enum class PathTracing {
+  // One call per bounce, always down to the depth limit. Kept as a reference.
+  recursive,
+  // A loop carrying the path throughput, terminated early by Russian roulette.
+  iterative,
+  // Batches of paths advanced one bounce at a time, with the hits of every bounce
+  // shaded grouped by material type (see WavefrontEngine). It applies to whole tiles;
+  // a single ray traced through ray_color() takes the iterative loop, with the same result.
+  wavefront,
+};
+
+// Distributed workers (detail::RenderSettings) and resumed checkpoints
+// (ProgressiveRenderer::settings_hash) must agree on every field, so a new option has to
+// be added to both.
+struct EngineOptions {
+  PathTracing path_tracing = PathTracing::iterative;
+  // Paths that survived this many bounces are terminated with probability
+  // 1 - max(throughput), and survivors are reweighted to keep the estimate unbiased.
+  // A negative value disables Russian roulette.
+  int russian_roulette_min_depth = 3;
+  double russian_roulette_max_survival = 0.95;
+  // Paths the wavefront engine keeps in flight at once.
+  int wavefront_batch_size = 1024;
+  // Camera and first-bounce rays the wavefront engine traces through the sphere BVH
+  // together (see Engine::hit_world_packet), at most RayPacket::max_size. Below 2 every
+  // ray is traced alone.
+  int packet_size = 8;
+  // Next-event estimation: every diffuse hit also samples a point on one of the world's
+  // lights (spheres with an EmissiveMaterial) and connects to it with a shadow ray. Light
+  // reached that way and light that scattered rays run into are combined by multiple
+  // importance sampling, so small lights stop being found by chance alone. Off, or in
+  // the recursive reference, lights only shine through scattered rays.
+  bool sample_lights = true;
+};
+
+// Where the last scattered ray of a path left from, and the density of its direction
+// under the scattering that chose it. Emission it runs into is weighted against light
+// sampling at that point. A zero density stands for camera rays and scattering that
+// light sampling does not apply to, whose emission counts in full.
+struct ScatterVertex {
+  Vec3 point;
+  double pdf = 0.0;
+};
+
+// Values at the first hit of a camera path, written to the auxiliary buffers (AOVs) that
+// guide the denoiser.
+struct FirstHit {
+  Vec3 albedo;
+  Vec3 normal;
+  // Distance along the camera ray, 0 where the ray escapes to the sky.
+  double distance = 0.0;
+};
+
 class Engine {
 public:
-  Vec3 ray_color(const Ray& ray, const World& world, int depth) {
+  Engine() {}
+  explicit Engine(const EngineOptions& options) : options_{options} {}
+
+  // Fills `first_hit`, if given, from the first intersection of the ray.
+  Vec3 ray_color(const Ray& ray, const World& world, int depth, Sampler& sampler, FirstHit* first_hit = nullptr) {
+    switch (options_.path_tracing) {
+      case PathTracing::recursive:
+        return ray_color_recursive(ray, world, depth, sampler, 0, first_hit);
+      case PathTracing::iterative:
+      case PathTracing::wavefront:
+        return ray_color_iterative(ray, world, depth, sampler, first_hit);
+    }
+    return black_color;
+  }
+
+  // Closest hit along the ray with t in [t_min, t_max].
+  std::optional<HitRecord> hit_world(const World& world, const Ray& ray, double t_min, double t_max) {
+    rays_traced_++;
+    RT_STATS(counters.rays_cast++);
+    const SphereSoA& spheres = world.spheres();
+    double closest_t = t_max;
+    uint32_t hit_index = 0;
+    bool hit_anything = false;
+    if (world.bvh()) {
+      hit_anything = world.bvh()->traverse(ray, t_min, closest_t, [&](uint32_t first, uint32_t count, double& leaf_t_max) {
+        RT_STATS(counters.sphere_tests += count);
+        return closest_sphere_hit(spheres, first, count, ray, t_min, leaf_t_max, hit_index);
+      });
+    } else {
+      RT_STATS(counters.sphere_tests += spheres.size());
+      hit_anything = closest_sphere_hit(spheres, 0, spheres.size(), ray, t_min, closest_t, hit_index);
+    }
+    return finish_hit(world, ray, t_min, t_max, hit_anything, closest_t, hit_index);
+  }
+
+  // Closest hits of `count` rays, each with t in [t_min, t_max], written to `hits`. A
+  // coherent packet (all directions in one octant) descends the sphere BVH as a whole,
+  // which pays off for rays from neighbouring pixels; other rays are traced one by one,
+  // as are all rays without AVX2, where the packet kernels would test one ray at a time.
+  // The hits are the same as from hit_world().
+  void hit_world_packet(
+      const World& world, const Ray* rays, int count, double t_min, double t_max, std::optional<HitRecord>* hits) {
+    assert(count <= RayPacket::max_size);
+    RayPacket packet(rays, count);
+    if (count < 2 || !world.bvh() || !packet.is_coherent || simd_level() < SimdLevel::avx2) {
+      for (int i = 0; i < count; i++) {
+        hits[i] = hit_world(world, rays[i], t_min, t_max);
+      }
+      return;
+    }
+    rays_traced_ += count;
+    RT_STATS(counters.rays_cast += count);
+    alignas(32) std::array<double, RayPacket::max_size> closest_t;
+    std::array<uint32_t, RayPacket::max_size> hit_index = {};
+    closest_t.fill(t_max);
+    uint32_t hit_rays = closest_sphere_hits(
+        *world.bvh(), world.spheres(), packet, t_min, closest_t.data(), hit_index.data());
+    for (int i = 0; i < count; i++) {
+      hits[i] = finish_hit(world, rays[i], t_min, t_max, (hit_rays >> i) & 1, closest_t[i], hit_index[i]);
+    }
+  }
+
+  // Whether anything lies along the ray with t in [t_min, t_max]. Traversal stops at the
+  // first leaf with a hit and no hit record is made, which is all a shadow ray needs.
+  bool occluded(const World& world, const Ray& ray, double t_min, double t_max) {
+    rays_traced_++;
+    RT_STATS(counters.shadow_rays_cast++);
+    const SphereSoA& spheres = world.spheres();
+    auto hit_spheres = [&](uint32_t first, uint32_t count, double& leaf_t_max) {
+      RT_STATS(counters.sphere_tests += count);
+      uint32_t hit_index = 0;
+      return closest_sphere_hit(spheres, first, count, ray, t_min, leaf_t_max, hit_index);
+    };
+    if (world.bvh() ? world.bvh()->any_hit(ray, t_min, t_max, hit_spheres) : hit_spheres(0, spheres.size(), t_max)) {
+      return true;
+    }
+    const std::vector<Instance>& instances = world.instances();
+    auto hit_instances = [&](uint32_t first, uint32_t count, double& range_t_max) {
+      for (uint32_t i = first; i < first + count; i++) {
+        if (detail::hit_instance(ray, instances[i], world.instance_material_id(i), t_min, range_t_max)) {
+          return true;
+        }
+      }
+      return false;
+    };
+    return world.instance_bvh()
+        ? world.instance_bvh()->any_hit(ray, t_min, t_max, hit_instances)
+        : hit_instances(0, instances.size(), t_max);
+  }
+
+  // Number of rays cast, closest-hit and shadow rays, since this engine was created.
+  uint64_t rays_traced() const {
+    return rays_traced_;
+  }
+
+  bool samples_lights(const World& world) const {
+    return options_.sample_lights && !world.lights().empty();
+  }
+
+  // Radiance the hit surface sends back along the ray that found it from `from`.
+  Vec3 emitted(const World& world, const HitRecord& hit, const EmissiveMaterial& material, const ScatterVertex& from) const {
+    if (!hit.front_face) {
+      return black_color;
+    }
+    if (from.pdf <= 0.0 || hit.light == no_light || !samples_lights(world)) {
+      return material.emitted;
+    }
+    return power_heuristic(from.pdf, light_pdf(world, hit.light, from.point)) * material.emitted;
+  }
+
+  // Next-event estimation at a diffuse hit of the path at `depth`: light from a point
+  // sampled on one of the world's lights, picked uniformly, and reflected back along the
+  // path, weighted against finding the same light by scattering.
+  Vec3 sample_direct_light(
+      const World& world, const HitRecord& hit, const LambertianMaterial& material, int depth, Sampler& sampler) {
+    const std::vector<uint32_t>& lights = world.lights();
+    sampler.start_dimension(Sampler::light_dimension(depth));
+    uint32_t light = std::min<uint32_t>(random_double(sampler) * lights.size(), lights.size() - 1);
+    const SphereSoA& spheres = world.spheres();
+    const Sphere sphere = spheres.sphere(lights[light]);
+    Vec3 to_center = sphere.center() - hit.point;
+    double distance_squared = to_center.length_squared();
+    double sin_squared_theta_max = sqr(sphere.radius()) / distance_squared;
+    if (sin_squared_theta_max >= 1.0) {
+      return black_color;
+    }
+
+    // A direction uniformly within the cone the sphere subtends.
+    sampler.start_dimension(Sampler::light_dimension(depth) + 2);
+    double one_minus_cos_theta = random_double(sampler) * detail::one_minus_cos_theta_max(sin_squared_theta_max);
+    double phi = 2.0 * PI * random_double(sampler);
+    double cos_theta = 1.0 - one_minus_cos_theta;
+    double sin_theta = sqrt(fmax(0.0, one_minus_cos_theta * (2.0 - one_minus_cos_theta)));
+    Vec3 w = to_center / sqrt(distance_squared);
+    Vec3 u = unit_vector(cross(fabs(w.x()) > 0.9 ? Vec3{0, 1, 0} : Vec3{1, 0, 0}, w));
+    Vec3 v = cross(w, u);
+    Vec3 direction = (sin_theta * cos(phi)) * u + (sin_theta * sin(phi)) * v + cos_theta * w;
+
+    double scatter_pdf = material.scatter_pdf(hit.normal, direction);
+    if (scatter_pdf <= 0.0) {
+      // Light from here is never reflected along the path, there is nothing to trace.
+      return black_color;
+    }
+    // Near intersection with the light, the shadow ray stops just short of it.
+    double half_b = dot(-to_center, direction);
+    double c = distance_squared - sqr(sphere.radius());
+    double t_light = -half_b - sqrt(fmax(0.0, half_b * half_b - c));
+    if (occluded(world, Ray{hit.point, direction}, 0.001, t_light * (1.0 - 1e-4))) {
+      return black_color;
+    }
+    const auto& emissive = std::get<EmissiveMaterial>(world.material(spheres.material_id(lights[light])));
+    double pdf = light_pdf(world, light, hit.point);
+    return (power_heuristic(pdf, scatter_pdf) * scatter_pdf / pdf) * (material.albedo * emissive.emitted);
+  }
+
+  // Russian roulette after the scattering at `depth`: returns false if the path ends,
+  // otherwise reweights the throughput of the survivor.
+  bool survives_russian_roulette(int depth, Vec3& throughput, Sampler& sampler) const {
+    if (options_.russian_roulette_min_depth < 0 || depth + 1 < options_.russian_roulette_min_depth) {
+      return true;
+    }
+    double max_throughput = std::max(throughput[0], std::max(throughput[1], throughput[2]));
+    double survival = std::min(max_throughput, options_.russian_roulette_max_survival);
+    sampler.start_dimension(Sampler::bounce_dimension(depth) + Sampler::russian_roulette_dimension);
+    if (random_double(sampler) >= survival) {
+      return false;
+    }
+    throughput /= survival;
+    return true;
+  }
+
+  FirstHit make_first_hit(const Ray& ray, const std::optional<HitRecord>& hit_record, const World& world) const {
+    if (!hit_record) {
+      return {sky_color(ray), {0, 0, 0}, 0.0};
+    }
+    Vec3 albedo = std::visit(AlbedoMaterialFn{}, world.material(hit_record->material_id));
+    return {albedo, hit_record->normal, hit_record->t * ray.direction().length()};
+  }
+
+  Vec3 sky_color(const Ray& ray) const {
+    Vec3 unit_direction = unit_vector(ray.direction());
+    double t = 0.5 * (unit_direction.y() + 1.0);
+    return lerp_vector(t, white_color, blue_color);
+  }
+
+private:
+  // Weight of a sample by `pdf` against one by `other_pdf` of the same light path
+  // (Veach's power heuristic, exponent 2).
+  static double power_heuristic(double pdf, double other_pdf) {
+    return sqr(pdf) / (sqr(pdf) + sqr(other_pdf));
+  }
+
+  // Density, per unit solid angle at `point`, of sample_direct_light() choosing a
+  // direction towards the light with the given index.
+  static double light_pdf(const World& world, uint32_t light, const Vec3& point) {
+    const Sphere sphere = world.spheres().sphere(world.lights()[light]);
+    double sin_squared_theta_max = sqr(sphere.radius()) / (sphere.center() - point).length_squared();
+    if (sin_squared_theta_max >= 1.0) {
+      return 0.0;
+    }
+    double solid_angle = 2.0 * PI * detail::one_minus_cos_theta_max(sin_squared_theta_max);
+    return 1.0 / (world.lights().size() * solid_angle);
+  }
+
+  // Hit record for the closest sphere hit, if any, unless an instance is closer still.
+  std::optional<HitRecord> finish_hit(
+      const World& world, const Ray& ray, double t_min, double t_max,
+      bool hit_sphere, double closest_t, uint32_t hit_index) {
+    // Instances only need to beat the closest sphere.
+    std::optional<HitRecord> instance_hit = hit_instances(world, ray, t_min, closest_t);
+    if (instance_hit) {
+      return instance_hit;
+    }
+    if (!hit_sphere) {
+      return {};
+    }
+    // Only the closest sphere gets a full hit record.
+    const SphereSoA& spheres = world.spheres();
+    std::optional<HitRecord> closest_hit = detail::hit_sphere(
+        ray, spheres.material_id(hit_index), spheres.sphere(hit_index));
+    assert(!closest_hit || detail::is_within_bounds(closest_hit->t, t_min, t_max));
+    if (closest_hit && !world.lights().empty()) {
+      closest_hit->light = world.light_of_sphere(hit_index);
+    }
+    return closest_hit;
+  }
+
+  std::optional<HitRecord> hit_instances(const World& world, const Ray& ray, double t_min, double t_max) {
+    const std::vector<Instance>& instances = world.instances();
+    std::optional<HitRecord> closest_hit;
+    auto hit_range = [&](uint32_t first, uint32_t count, double& range_t_max) {
+      bool hit_anything = false;
+      for (uint32_t i = first; i < first + count; i++) {
+        std::optional<HitRecord> hit_record = detail::hit_instance(
+            ray, instances[i], world.instance_material_id(i), t_min, range_t_max);
+        if (hit_record) {
+          range_t_max = hit_record->t;
+          closest_hit = hit_record;
+          hit_anything = true;
+        }
+      }
+      return hit_anything;
+    };
+    if (world.instance_bvh()) {
+      world.instance_bvh()->traverse(ray, t_min, t_max, hit_range);
+    } else {
+      hit_range(0, instances.size(), t_max);
+    }
+    return closest_hit;
+  }
+
+  Vec3 ray_color_recursive(
+      const Ray& ray, const World& world, int depth, Sampler& sampler, int bounce, FirstHit* first_hit) {
     if (depth <= 0) {
       // No more light is gathered if the ray bounce limit is exceeded.
       return black_color;
     }
 
-    Engine engine{};
-    std::optional<HitRecord> hit_record = engine.hit_world(world, ray, 0.001, INFINITY);
+    std::optional<HitRecord> hit_record = hit_world(world, ray, 0.001, POSITIVE_INFINITY);
+    if (first_hit) {
+      *first_hit = make_first_hit(ray, hit_record, world);
+    }
 
     if (hit_record) {
-      auto scattered_ray = std::visit(ScatterMaterialFn{ray, as_scatter_info(*hit_record)}, hit_record->material);
+      const Material& material = world.material(hit_record->material_id);
+      RT_STATS(counters.material_hits[material.index()]++);
+      sampler.start_dimension(Sampler::bounce_dimension(bounce));
+      auto scattered_ray = std::visit(ScatterMaterialFn{ray, as_scatter_info(*hit_record), sampler}, material);
       if (!scattered_ray) {
-        return black_color;
+        // Lights reflect nothing, they only emit.
+        const auto* emissive = std::get_if<EmissiveMaterial>(&material);
+        return emissive ? emitted(world, *hit_record, *emissive, {}) : black_color;
       }
-      return scattered_ray->attenuation_color * ray_color(scattered_ray->ray, world, depth - 1);
+      return scattered_ray->attenuation_color
+          * ray_color_recursive(scattered_ray->ray, world, depth - 1, sampler, bounce + 1, nullptr);
     } else {
-      Vec3 unit_direction = unit_vector(ray.direction());
-      double t = 0.5 * (unit_direction.y() + 1.0);
-      return lerp_vector(t, white_color, blue_color);
+      return sky_color(ray);
     }
   }
 
-private:
-  std::optional<HitRecord> hit_world(const World& world, const Ray& ray, double t_min, double t_max) {
-    std::optional<HitRecord> closest_hit;
-    for (const auto& [object, material] : world.objects()) {
-      std::optional<HitRecord> hit_record = detail::hit_object(ray, object, material);
-      double upper_bound = closest_hit ? closest_hit->t : t_max;
-      if (hit_record && detail::is_within_bounds(hit_record->t, t_min, upper_bound)) {
-        closest_hit = hit_record;
+  Vec3 ray_color_iterative(
+      const Ray& camera_ray, const World& world, int max_depth, Sampler& sampler, FirstHit* first_hit) {
+    Ray ray = camera_ray;
+    Vec3 throughput = white_color;
+    Vec3 radiance = black_color;
+    ScatterVertex from;
+    const bool sample_lights = samples_lights(world);
+    for (int depth = 0; depth < max_depth; depth++) {
+      std::optional<HitRecord> hit_record = hit_world(world, ray, 0.001, POSITIVE_INFINITY);
+      if (depth == 0 && first_hit) {
+        *first_hit = make_first_hit(ray, hit_record, world);
+      }
+      if (!hit_record) {
+        RT_STATS(counters.end_path(depth, PathTermination::escaped));
+        return radiance + throughput * sky_color(ray);
+      }
+      const Material& material = world.material(hit_record->material_id);
+      RT_STATS(counters.material_hits[material.index()]++);
+      if (const auto* emissive = std::get_if<EmissiveMaterial>(&material)) {
+        radiance += throughput * emitted(world, *hit_record, *emissive, from);
+      }
+      const auto* lambertian = sample_lights ? std::get_if<LambertianMaterial>(&material) : nullptr;
+      if (lambertian) {
+        radiance += throughput * sample_direct_light(world, *hit_record, *lambertian, depth, sampler);
+      }
+
+      sampler.start_dimension(Sampler::bounce_dimension(depth));
+      auto scattered_ray = std::visit(ScatterMaterialFn{ray, as_scatter_info(*hit_record), sampler}, material);
+      if (!scattered_ray) {
+        RT_STATS(counters.end_path(depth, PathTermination::absorbed));
+        return radiance;
+      }
+      from = {hit_record->point, lambertian ? lambertian->scatter_pdf(hit_record->normal, scattered_ray->ray.direction()) : 0.0};
+      throughput = throughput * scattered_ray->attenuation_color;
+      if (!survives_russian_roulette(depth, throughput, sampler)) {
+        RT_STATS(counters.end_path(depth + 1, PathTermination::russian_roulette));
+        return radiance;
       }
+      ray = scattered_ray->ray;
     }
-    assert(!closest_hit || detail::is_within_bounds(closest_hit->t, t_min, t_max));
-    return closest_hit;
+    // No more light is gathered if the ray bounce limit is exceeded.
+    RT_STATS(counters.end_path(max_depth, PathTermination::depth_limit));
+    return radiance;
   }
-};
\ No newline at end of file
+
+  EngineOptions options_;
+  uint64_t rays_traced_ = 0;
+};
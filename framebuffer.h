@@ -0,0 +1,60 @@
+#pragma once
+
+#include <cassert>
+#include <vector>
+
+#include "vec3.h"
+
+// Contiguous, row-major image storage. Rows are numbered the way `Renderer` numbers them,
+// so row 0 is the bottom scanline of the picture. Render tasks own disjoint tiles and
+// write straight into them, there is no per-thread copy to merge afterwards.
+template <typename T>
+class ImageBuffer {
+public:
+    ImageBuffer() {}
+    ImageBuffer(int width, int height, const T& value = T{})
+        : width_{width}
+        , height_{height}
+        , pixels_(static_cast<std::size_t>(width) * height, value) {}
+
+    int width() const {
+        return width_;
+    }
+
+    int height() const {
+        return height_;
+    }
+
+    T& at(int row, int col) {
+        return pixels_[index_of(row, col)];
+    }
+
+    const T& at(int row, int col) const {
+        return pixels_[index_of(row, col)];
+    }
+
+    // Pointer to the `width()` pixels of the given row.
+    T* scanline(int row) {
+        return pixels_.data() + index_of(row, 0);
+    }
+
+    const T* scanline(int row) const {
+        return pixels_.data() + index_of(row, 0);
+    }
+
+    const std::vector<T>& pixels() const {
+        return pixels_;
+    }
+
+private:
+    std::size_t index_of(int row, int col) const {
+        assert(0 <= row && row < height_ && 0 <= col && col < width_);
+        return static_cast<std::size_t>(row) * width_ + col;
+    }
+
+    int width_ = 0;
+    int height_ = 0;
+    std::vector<T> pixels_;
+};
+
+using Framebuffer = ImageBuffer<Vec3>;
@@ -1,14 +1,22 @@
 #pragma once
 
+#include <cstdint>
+
 #include "vec3.h"
 #include "material.h"
 
+// Light index of geometry that is not one of the lights of a World.
+constexpr uint32_t no_light = UINT32_MAX;
+
+// Kept small: the material is only looked up, by id, for the closest hit.
 struct HitRecord {
   Vec3 point;
   Vec3 normal;
   double t;
   bool front_face;
-  Material material;
+  MaterialId material_id;
+  // Which of the world's lights was hit, for weighting its emission against light sampling.
+  uint32_t light = no_light;
 };
 
 ScatterInfo as_scatter_info(const HitRecord& hit_record) {
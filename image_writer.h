@@ -0,0 +1,264 @@
+#pragma once
+
+#include <cassert>
+#include <cmath>
+#include <cstdint>
+#include <cstring>
+#include <ostream>
+#include <string>
+#include <variant>
+#include <vector>
+
+#include "common.h"
+#include "framebuffer.h"
+
+// Quantizes linear values to gamma encoded integers in [0, 2^bits). Instead of calling
+// pow() per channel it precomputes, for every output level, the smallest linear value
+// that maps to it, and encodes with a branchless binary search over those thresholds.
+// With 8 bits the result matches `write_pixel` in ppm.h.
+class GammaEncoder {
+public:
+    GammaEncoder(int bits, double gamma = 2.0) : bits_{bits}, thresholds_(1 << bits) {
+        int levels = 1 << bits;
+        thresholds_[0] = -POSITIVE_INFINITY;
+        for (int level = 1; level < levels; level++) {
+            thresholds_[level] = std::pow(double(level) / levels, gamma);
+        }
+    }
+
+    uint32_t encode(double value) const {
+        uint32_t level = 0;
+        for (uint32_t step = 1u << (bits_ - 1); step > 0; step >>= 1) {
+            level += value >= thresholds_[level + step] ? step : 0;
+        }
+        return level;
+    }
+
+private:
+    int bits_;
+    std::vector<double> thresholds_;
+};
+
+namespace detail {
+    bool is_little_endian() {
+        uint16_t value = 1;
+        char first_byte;
+        std::memcpy(&first_byte, &value, 1);
+        return first_byte == 1;
+    }
+
+    // Appends the pixels as three 32-bit floats each, in native byte order.
+    void append_float_scanline(std::vector<char>& bytes, const Vec3* scanline, int width) {
+        std::size_t offset = bytes.size();
+        bytes.resize(offset + 3 * sizeof(float) * width);
+        for (int col = 0; col < width; col++) {
+            float values[3] = {
+                static_cast<float>(scanline[col][0]), static_cast<float>(scanline[col][1]),
+                static_cast<float>(scanline[col][2])};
+            std::memcpy(bytes.data() + offset, values, sizeof(values));
+            offset += sizeof(values);
+        }
+    }
+
+    // The header, then the scanlines in the order the format stores them.
+    template <typename Writer>
+    std::vector<char> encode_image(const Writer& writer, const Framebuffer& image) {
+        std::string header = writer.header(image.width(), image.height());
+        std::vector<char> bytes(header.begin(), header.end());
+        bytes.reserve(bytes.size() + Writer::bytes_per_pixel * image.pixels().size());
+        for (int i = 0; i < image.height(); i++) {
+            int row = Writer::bottom_up ? i : image.height() - 1 - i;
+            writer.append_scanline(bytes, image.scanline(row), image.width());
+        }
+        return bytes;
+    }
+}
+
+// Every writer has a header, a fixed size per pixel and a scanline order, so an image can
+// also be written a band of scanlines at a time (see ImageStream) instead of all at once.
+
+// Binary PPM (P6), 8 bits per channel, gamma encoded. The top scanline comes first.
+struct PpmWriter {
+    static constexpr bool bottom_up = false;
+    static constexpr std::size_t bytes_per_pixel = 3;
+
+    std::string header(int width, int height) const {
+        return "P6\n" + std::to_string(width) + ' ' + std::to_string(height) + "\n255\n";
+    }
+
+    void append_scanline(std::vector<char>& bytes, const Vec3* scanline, int width) const {
+        static const GammaEncoder encoder{8};
+        std::size_t offset = bytes.size();
+        bytes.resize(offset + bytes_per_pixel * width);
+        for (int col = 0; col < width; col++) {
+            for (int channel = 0; channel < 3; channel++) {
+                bytes[offset++] = static_cast<char>(encoder.encode(scanline[col][channel]));
+            }
+        }
+    }
+
+    std::vector<char> encode(const Framebuffer& image) const {
+        return detail::encode_image(*this, image);
+    }
+};
+
+// Binary PPM (P6) with 16 bits per channel, big-endian as the format requires.
+struct Ppm16Writer {
+    static constexpr bool bottom_up = false;
+    static constexpr std::size_t bytes_per_pixel = 6;
+
+    std::string header(int width, int height) const {
+        return "P6\n" + std::to_string(width) + ' ' + std::to_string(height) + "\n65535\n";
+    }
+
+    void append_scanline(std::vector<char>& bytes, const Vec3* scanline, int width) const {
+        static const GammaEncoder encoder{16};
+        std::size_t offset = bytes.size();
+        bytes.resize(offset + bytes_per_pixel * width);
+        for (int col = 0; col < width; col++) {
+            for (int channel = 0; channel < 3; channel++) {
+                uint32_t level = encoder.encode(scanline[col][channel]);
+                bytes[offset++] = static_cast<char>(level >> 8);
+                bytes[offset++] = static_cast<char>(level & 0xff);
+            }
+        }
+    }
+
+    std::vector<char> encode(const Framebuffer& image) const {
+        return detail::encode_image(*this, image);
+    }
+};
+
+// Portable float map: linear, unclamped RGB so HDR values survive. Scanlines go from the
+// bottom of the picture up, and a negative scale marks little-endian data.
+struct PfmWriter {
+    static constexpr bool bottom_up = true;
+    static constexpr std::size_t bytes_per_pixel = 3 * sizeof(float);
+
+    std::string header(int width, int height) const {
+        return "PF\n" + std::to_string(width) + ' ' + std::to_string(height) + '\n'
+            + (detail::is_little_endian() ? "-1.0\n" : "1.0\n");
+    }
+
+    void append_scanline(std::vector<char>& bytes, const Vec3* scanline, int width) const {
+        detail::append_float_scanline(bytes, scanline, width);
+    }
+
+    std::vector<char> encode(const Framebuffer& image) const {
+        return detail::encode_image(*this, image);
+    }
+};
+
+// Headerless dump of linear RGB as native 32-bit floats, top scanline first.
+struct RawFloatWriter {
+    static constexpr bool bottom_up = false;
+    static constexpr std::size_t bytes_per_pixel = 3 * sizeof(float);
+
+    std::string header(int, int) const {
+        return "";
+    }
+
+    void append_scanline(std::vector<char>& bytes, const Vec3* scanline, int width) const {
+        detail::append_float_scanline(bytes, scanline, width);
+    }
+
+    std::vector<char> encode(const Framebuffer& image) const {
+        return detail::encode_image(*this, image);
+    }
+};
+
+using ImageWriter = std::variant<PpmWriter, Ppm16Writer, PfmWriter, RawFloatWriter>;
+
+enum class ImageFormat {
+    ppm,
+    ppm16,
+    pfm,
+    raw,
+};
+
+ImageWriter image_writer_for(ImageFormat format) {
+    switch (format) {
+        case ImageFormat::ppm:
+            return PpmWriter{};
+        case ImageFormat::ppm16:
+            return Ppm16Writer{};
+        case ImageFormat::pfm:
+            return PfmWriter{};
+        case ImageFormat::raw:
+            return RawFloatWriter{};
+    }
+    return PpmWriter{};
+}
+
+// Encodes the whole image in memory and hands it to the stream in a single write.
+void write_image(std::ostream& out, const Framebuffer& image, const ImageWriter& writer) {
+    std::vector<char> bytes = std::visit([&](const auto& w) { return w.encode(image); }, writer);
+    out.write(bytes.data(), bytes.size());
+    out.flush();
+}
+
+void write_image(std::ostream& out, const Framebuffer& image, ImageFormat format) {
+    write_image(out, image, image_writer_for(format));
+}
+
+// Writes an image of a known size a band of scanlines at a time, so it never has to be
+// held in memory whole. The header goes out on construction; the bands have to be given
+// in the order the format stores them, from the top of the picture down unless
+// bottom_up(), and together cover the image once.
+class ImageStream {
+public:
+    ImageStream(std::ostream& out, int width, int height, const ImageWriter& writer)
+        : out_{out}, width_{width}, height_{height}, writer_{writer} {
+        std::string header = std::visit([&](const auto& w) { return w.header(width, height); }, writer_);
+        out_.write(header.data(), header.size());
+    }
+
+    ImageStream(std::ostream& out, int width, int height, ImageFormat format)
+        : ImageStream(out, width, height, image_writer_for(format)) {}
+
+    int width() const {
+        return width_;
+    }
+
+    int height() const {
+        return height_;
+    }
+
+    bool bottom_up() const {
+        return std::visit([](const auto& w) { return w.bottom_up; }, writer_);
+    }
+
+    // Writes all rows of `band`, which are rows [first_row, first_row + band.height()) of
+    // the image, numbered from the bottom like Framebuffer rows.
+    void write_band(const Framebuffer& band, int first_row) {
+        assert(band.width() == width_);
+        assert(first_row == (bottom_up() ? rows_written_ : height_ - rows_written_ - band.height()));
+        bytes_.clear();
+        std::visit([&](const auto& w) {
+            for (int i = 0; i < band.height(); i++) {
+                int row = w.bottom_up ? i : band.height() - 1 - i;
+                w.append_scanline(bytes_, band.scanline(row), band.width());
+            }
+        }, writer_);
+        out_.write(bytes_.data(), bytes_.size());
+        rows_written_ += band.height();
+    }
+
+    int rows_written() const {
+        return rows_written_;
+    }
+
+    // Whether every row was written and the stream took all of it.
+    bool finish() {
+        out_.flush();
+        return rows_written_ == height_ && out_.good();
+    }
+
+private:
+    std::ostream& out_;
+    int width_;
+    int height_;
+    ImageWriter writer_;
+    std::vector<char> bytes_;
+    int rows_written_ = 0;
+};
@@ -0,0 +1,62 @@
+#pragma once
+
+#include <memory>
+#include <optional>
+#include <utility>
+#include <variant>
+
+#include "aabb.h"
+#include "material.h"
+#include "mesh.h"
+#include "ray.h"
+#include "sphere_set.h"
+#include "transform.h"
+#include "vec3.h"
+
+// Geometry that any number of instances can share. Each kind has its own BVH, the
+// bottom level under the world's hierarchy over instances.
+using InstanceGeometry = std::variant<SphereSet, TriangleMesh>;
+
+Aabb bounding_box(const InstanceGeometry& geometry) {
+    return std::visit([](const auto& g) { return g.bounding_box(); }, geometry);
+}
+
+// Shared geometry placed in the world through an affine transform. An instance only
+// stores the inverse transform and a reference, so scene memory grows with the unique
+// geometry plus a small fixed cost per instance, whatever the size of that geometry.
+//
+// Hits take the material of the geometry (per sphere in a SphereSet, the one given to
+// World::add for a mesh) unless the instance overrides it.
+class Instance {
+public:
+    Instance(
+            std::shared_ptr<const InstanceGeometry> geometry,
+            const Transform& object_to_world = {},
+            std::optional<MaterialId> material = {})
+        : geometry_{std::move(geometry)}
+        , world_to_object_{object_to_world.inverse()}
+        , bounds_{object_to_world.apply(::bounding_box(*geometry_))}
+        , material_{material} {}
+
+    const InstanceGeometry& geometry() const {
+        return *geometry_;
+    }
+
+    const Transform& world_to_object() const {
+        return world_to_object_;
+    }
+
+    const std::optional<MaterialId>& material() const {
+        return material_;
+    }
+
+    Aabb bounding_box() const {
+        return bounds_;
+    }
+
+private:
+    std::shared_ptr<const InstanceGeometry> geometry_;
+    Transform world_to_object_;
+    Aabb bounds_;
+    std::optional<MaterialId> material_;
+};
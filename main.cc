@@ -1,13 +1,14 @@
+#include <fstream>
 #include <iostream>
 #include <assert.h>
 #include <mutex>
-#include <map>
 #include <assert.h>
 #include <math.h>
 #include <vector>
 #include <tuple>
 #include <variant>
 #include <optional>
+#include <string>
 #include <thread>
 
 #include "camera.h"
@@ -17,61 +18,38 @@
 #include "ray.h"
 #include "sphere.h"
 #include "ppm.h"
+#include "image_writer.h"
 #include "hit_record.h"
 #include "engine.h"
 #include "renderer.h"
+#include "denoiser.h"
+#include "distributed_renderer.h"
 #include "parallel_renderer.h"
+#include "progressive_renderer.h"
+#include "render_config.h"
+#include "scene_file.h"
+#include "scenes.h"
+#include "streaming_renderer.h"
+#include "thread_pool.h"
 
-Material choose_material() {
-      double random_sample = random_double();
-      if (random_sample < 0.8) {
-        // Diffuse.
-        Vec3 albedo = random_unit_vector() * random_unit_vector();
-        return LambertianMaterial{albedo};
-      } else if (random_sample < 0.95) {
-        // Metal.
-        Vec3 albedo = random_vector(0.5, 1);
-        double fuzz = random_double(0, 0.5);
-        return MetalMaterial{albedo, fuzz};
-      } else {
-        // Glass.
-        return DielectricMaterial{.refraction_index = 1.5};
-      }
-}
-
-World random_world() {
-  World world;
-
-  // Add ground (a very large sphere).
-  Material ground_material = LambertianMaterial{Vec3(0.5, 0.5, 0.5)};
-  world.add(Sphere(Vec3(0, -1000, 0), 1000), ground_material);
-
-  for (int x = -11; x < 11; x++) {
-    for (int z = -11; z < 11; z++) {
-      Vec3 center{x + 0.9 * random_double(), 0.2, z + 0.9 * random_double()};
-      double radius = 0.2;
-
-      if ((center - Vec3{4, 0.2, 0}).length() > 0.9) {
-        Material material = choose_material();
-        world.add(Sphere(std::move(center), radius), material);
-      }
-    }
+int main(int argc, char** argv) {
+  // Every setting of the render comes from the command line, see render_config.h.
+  std::optional<RenderConfig> config = parse_render_config(argc, argv);
+  if (!config) {
+    return 1;
+  }
+  if (config->show_help) {
+    print_render_usage(std::cerr, argv[0]);
+    return 0;
   }
 
-  world.add(Sphere({0, 1, 0}, 1.0), DielectricMaterial{1.5});
-  world.add(Sphere({-4, 1, 0}, 1.0), LambertianMaterial{Vec3{0.4, 0.2, 0.1}});
-  world.add(Sphere({4, 1, 0}, 1.0), MetalMaterial{{0.7, 0.6, 0.5}, 0.0});
-
-  return world;
-}
-
-int main(int argc, char** argv) {
   // Image
-  const double aspect_ratio = 16.0 / 9.0;
-  const int image_width = 1920;
-  const int image_height = static_cast<int>(image_width / aspect_ratio);
-  const int samples_per_pixel = 500;
-  const int max_ray_bounce_depth = 50;
+  const int image_width = config->image_width;
+  const int image_height = config->image_height;
+  const double aspect_ratio = double(image_width) / image_height;
+  const SampleSequence sample_sequence = config->sample_sequence;
+  const int samples_per_pixel = config->samples_per_pixel;
+  const int max_ray_bounce_depth = config->max_ray_bounce_depth;
 
   std::cerr << "Image size: " << image_width << ", " << image_height << std::endl;
 
@@ -83,61 +61,140 @@ int main(int argc, char** argv) {
   constexpr double aperture = 0.1;
   const double focus_distance = 10.0;
   const Camera camera(origin, look_at, view_up, vertical_field_of_view, aspect_ratio, aperture, focus_distance);
+  // The small worlds sit in front of the origin.
+  const Camera tutorial_camera({0, 0, 0}, {0, 0, -1}, view_up, 90.0, aspect_ratio, 0.0, 1.0);
+  const Camera room_camera({0, 1, 3.3}, {0, 1, 0}, view_up, 50.0, aspect_ratio, 0.0, 1.0);
 
-  // Materials
-  constexpr Vec3 center_color(0.7, 0.3, 0.3);
-  constexpr Vec3 left_color(0.8, 0.8, 0.8);
-  constexpr Vec3 right_color(0.8, 0.6, 0.2);
-
-  constexpr Material material_ground = LambertianMaterial{ground_color};
-  constexpr Material material_center = LambertianMaterial{center_color};
-  constexpr Material material_left = DielectricMaterial{1.5};
-  constexpr Material material_right = MetalMaterial{right_color, 0.5};
-  constexpr Material lambertian_blue = LambertianMaterial{pure_blue_color};
-  constexpr Material lambertian_red = LambertianMaterial{pure_red_color};
-
-  // World
+  // Worlds. A binary scene file (see scene_convert.cc) is rendered through its own camera;
+  // its BVH was built when the file was written.
   World world;
-  world.add(Sphere({0, -100.5, -1}, 100), material_ground);
-  world.add(Sphere({0, 0, -1}, 0.5), material_center);
-  world.add(Sphere({-1, 0, -1}, 0.5), material_left);
-  world.add(Sphere({-1, -0, -1}, -0.4), material_left);
-  world.add(Sphere({1, 0, -1}, 0.5), material_right);
-
-  // Another world
-  const double R = cos(PI / 4.0);
-  World another_world;
-  another_world.add(Sphere({-R, 0, -1}, R), lambertian_blue);
-  another_world.add(Sphere({R, 0, -1}, R), lambertian_red);
-
-  // Random big world
-  World big_world = random_world();
-
-  // Render
-  const int num_cores = 32;
-  std::cerr << "Number of cores:" << ' ' << num_cores << std::endl << std::flush;
-
-  Renderer renderer{big_world, camera, image_width, image_height, samples_per_pixel, max_ray_bounce_depth};
-
-  RenderedImage rendered_image = ParallelRenderer{renderer}.render(num_cores);
-
-  // Save in file
-  std::cout << "P3" << std::endl << image_width << ' ' << image_height << std::endl << 255 << std::endl;
-
-  for (int row = image_height - 1; row >= 0; row--) {
-    std::cerr << "\rScanlines remaining: " << (row) << ' ' << std::endl << std::flush;
-    for (int col = 0; col < image_width; col++) {
-      PixelLocation location{col, row};
-      auto it = rendered_image.pixels.find(location);
-      if (it != rendered_image.pixels.end()) {
-        Vec3 pixel_color = it->second;
-        write_pixel(std::cout, pixel_color);
-      } else {
-        assert(false);
-        std::cerr << "Missing pixel at location: " << to_debug(location) << std::endl;
-      }
+  std::optional<Scene> scene_file;
+  const Camera* scene_camera = &camera;
+  if (config->scene == "random") {
+    const uint64_t scene_seed = 1;
+    Sampler scene_sampler{scene_seed};
+    world = random_world(scene_sampler);
+  } else if (config->scene == "three_spheres") {
+    world = three_spheres_world();
+    scene_camera = &tutorial_camera;
+  } else if (config->scene == "two_spheres") {
+    world = two_spheres_world();
+    scene_camera = &tutorial_camera;
+  } else if (config->scene == "lit_room") {
+    world = lit_room_world();
+    scene_camera = &room_camera;
+  } else {
+    scene_file = load_scene_file(config->scene);
+    if (!scene_file) {
+      return 1;
     }
   }
+  // Acceleration structure. Without it every ray is tested against every object.
+  if (!scene_file && config->use_bvh) {
+    world.build_bvh();
+  }
+  const World& scene_world = scene_file ? scene_file->world : world;
+  const Camera file_camera = scene_file ? scene_file->camera.camera(aspect_ratio) : camera;
+  if (scene_file) {
+    scene_camera = &file_camera;
+  }
+
+  std::cerr << "Sphere kernels: " << to_debug(simd_level()) << std::endl;
+
+  // The same seed gives the same image for any number of threads and any tile order.
+  const uint64_t render_seed = config->seed;
+  const AdaptiveSamplingOptions adaptive_sampling = config->adaptive_sampling;
+  EngineOptions engine_options;
+  engine_options.sample_lights = config->sample_lights;
+  Renderer renderer{
+      scene_world, *scene_camera, image_width, image_height, samples_per_pixel, max_ray_bounce_depth, render_seed,
+      engine_options, adaptive_sampling, sample_sequence};
+
+  // `--connect` renders tiles for a coordinator started with `--listen`, over one
+  // connection per thread, and can join or leave at any time.
+  if (!config->coordinator_host.empty()) {
+    const int connections = config->threads > 0 ? config->threads : default_thread_count();
+    std::cerr << "Number of connections: " << connections << std::endl;
+    return run_render_worker(renderer, config->coordinator_host, config->coordinator_port, connections) ? 0 : 1;
+  }
+  std::optional<RenderCoordinator> coordinator;
+  if (config->listen_port) {
+    coordinator = RenderCoordinator::listen(*config->listen_port);
+    if (!coordinator) {
+      return 1;
+    }
+    coordinator->verbose = true;
+  }
+
+  // Render. The threads are started once, for the render and the denoiser.
+  ThreadPool pool{config->threads, config->pin_threads};
+  std::cerr << "Number of threads: " << pool.size() << (pool.is_pinned() ? " (pinned)" : "") << std::endl << std::flush;
+  std::optional<SceneReplicas> replicas;
+  if (config->numa_replicas && !coordinator) {
+    replicas.emplace(renderer, pool);
+    std::cerr << "Scene replicas: " << replicas->size() << std::endl;
+  }
+#ifdef RT_ENABLE_STATS
+  // The trace spans in render_trace.json count from here.
+  render_counter_registry().start_trace_clock();
+#endif
+
+  // Streaming writes each band of tiles as it finishes, so memory does not grow with the
+  // image height, for posters too large to hold.
+  if (config->stream) {
+    ImageStream image_stream{std::cout, image_width, image_height, config->output_format};
+    StreamingOptions streaming_options{.tile_size = config->tile_size};
+    StreamingRenderer streaming_renderer{renderer, streaming_options, replicas ? &*replicas : nullptr, true};
+    bool written = streaming_renderer.render(pool, image_stream);
+#ifdef RT_ENABLE_STATS
+    std::cerr << "Render counters:" << std::endl << render_counter_registry().total();
+#endif
+    std::cerr << "\nDone.\n";
+    return written ? 0 : 1;
+  }
+
+  // Tiles are pulled from per-thread queues and stolen between threads as they run dry.
+  SchedulerOptions scheduler_options{.tile_size = config->tile_size, .order = TileOrder::hilbert};
+  // Progressive rendering adds passes over the whole image until the sample target or the
+  // time budget is reached, with periodic snapshots. Running again resumes from the checkpoint.
+  const ProgressiveOptions progressive_options{
+      .target_samples = samples_per_pixel,
+      .time_budget_seconds = config->time_budget_seconds,
+      .samples_per_pass = 4,
+      .checkpoint_interval_seconds = 60.0,
+      .checkpoint_path = config->checkpoint_path,
+      .snapshot_path = config->snapshot_path};
+  // The denoiser is guided by first-hit albedo, normal and depth buffers, which the
+  // parallel renderer records on request. It makes 16-64 samples per pixel presentable.
+  const bool denoise_image = config->denoise;
+
+  RenderedImage rendered_image = coordinator
+      ? coordinator->render(renderer, scheduler_options, denoise_image)
+      : config->progressive
+      ? ProgressiveRenderer{renderer, progressive_options, scheduler_options, true}.render(pool)
+      : ParallelRenderer{
+          renderer, scheduler_options, denoise_image, !config->cost_maps_prefix.empty(), replicas ? &*replicas : nullptr,
+          true}.render(pool);
+  const Framebuffer framebuffer = rendered_image.has_aovs() ? denoise(rendered_image, {}, pool) : rendered_image.color;
+
+#ifdef RT_ENABLE_STATS
+  std::cerr << "Render counters:" << std::endl << render_counter_registry().total();
+  std::ofstream trace_file("render_trace.json");
+  render_counter_registry().write_chrome_trace(trace_file);
+#endif
+
+  // Save in file. The image is encoded in memory and written with a single call.
+  write_image(std::cout, framebuffer, config->output_format);
+
+  // Where the render time went: heatmaps, raw per-pixel values and tile totals.
+  if (rendered_image.has_costs()) {
+    write_cost_maps(config->cost_maps_prefix, rendered_image.costs, rendered_image.tile_costs);
+  }
+
+  if (adaptive_sampling.enabled) {
+    std::ofstream sample_count_file("sample_counts.pgm", std::ios::binary);
+    write_sample_counts(sample_count_file, rendered_image.sample_counts, adaptive_sampling.max_samples);
+  }
 
   std::cerr << "\nDone.\n";
   return 0;
@@ -1,7 +1,10 @@
 #pragma once
 
+#include <cstdint>
 #include <optional>
+#include <variant>
 
+#include "common.h"
 #include "vec3.h"
 #include "ray.h"
 
@@ -37,8 +40,8 @@ double reflectance(double cosine, double refraction_ratio) {
 struct LambertianMaterial {
     Vec3 albedo;
 
-    std::optional<ScatteredRay> scatter(const Ray& ray, const ScatterInfo& scatter_info) const {
-        Vec3 scatter_direction = scatter_info.normal + random_unit_vector();
+    std::optional<ScatteredRay> scatter(const Ray& ray, const ScatterInfo& scatter_info, Sampler& sampler) const {
+        Vec3 scatter_direction = scatter_info.normal + sample_unit_vector(sampler);
 
         // Catch degenerate scatter direction.
         if (scatter_direction.is_near_zero()) {
@@ -49,15 +52,24 @@ struct LambertianMaterial {
         Vec3 attenuation_color = albedo;
         return {{scattered_ray, attenuation_color}};
     }
+
+    // Density, per unit solid angle, of scatter() choosing `direction`: the normal plus a
+    // uniform unit vector is cosine distributed, cos / pi. Scattering weights by the albedo
+    // alone, so the reflected radiance for light from `direction` is albedo * density *
+    // incoming.
+    double scatter_pdf(const Vec3& normal, const Vec3& direction) const {
+        double cosine = dot(unit_vector(direction), normal);
+        return cosine > 0.0 ? cosine / PI : 0.0;
+    }
 };
 
 struct MetalMaterial {
     Vec3 albedo;
     double fuzz;
 
-    std::optional<ScatteredRay> scatter(const Ray& ray, const ScatterInfo& scatter_info) const {
+    std::optional<ScatteredRay> scatter(const Ray& ray, const ScatterInfo& scatter_info, Sampler& sampler) const {
         Vec3 reflected = reflect(unit_vector(ray.direction()), scatter_info.normal);
-        Vec3 direction = reflected + fuzz * random_in_unit_sphere();
+        Vec3 direction = reflected + fuzz * sample_in_unit_sphere(sampler);
         Ray scattered_ray{scatter_info.point, direction};
         Vec3 attenuation_color = albedo;
         return {{scattered_ray, attenuation_color}};
@@ -67,7 +79,7 @@ struct MetalMaterial {
 struct DielectricMaterial {
     double refraction_index;
 
-    std::optional<ScatteredRay> scatter(const Ray& ray, const ScatterInfo& scatter_info) const {
+    std::optional<ScatteredRay> scatter(const Ray& ray, const ScatterInfo& scatter_info, Sampler& sampler) const {
         double refraction_ratio = scatter_info.front_face ? (1.0 / refraction_index) : refraction_index;
         Vec3 attenuation = white_color;
         Vec3 unit_direction = unit_vector(ray.direction());
@@ -75,7 +87,7 @@ struct DielectricMaterial {
         double sin_theta = sqrt(1.0 - cos_theta * cos_theta);
         // If there is no solution to the refraction equation.
         bool cannot_refract = refraction_ratio * sin_theta > 1.0;
-        bool should_reflect = reflectance(cos_theta, refraction_index) > random_double();
+        bool should_reflect = reflectance(cos_theta, refraction_index) > random_double(sampler);
         
         Vec3 direction;
         if (cannot_refract || should_reflect) {
@@ -88,21 +100,59 @@ struct DielectricMaterial {
     }
 };
 
-using Material = std::variant<LambertianMaterial, MetalMaterial, DielectricMaterial>;
+// A light source: its front face emits `emitted` radiance in every direction, and it
+// reflects nothing. Spheres with it are sampled directly by the engine (see
+// EngineOptions::sample_lights); other geometry only shines on what scatters into it.
+struct EmissiveMaterial {
+    Vec3 emitted;
+
+    std::optional<ScatteredRay> scatter(const Ray&, const ScatterInfo&, Sampler&) const {
+        return {};
+    }
+};
+
+using Material = std::variant<LambertianMaterial, MetalMaterial, DielectricMaterial, EmissiveMaterial>;
+
+// Index into the material table of a `World`.
+using MaterialId = uint32_t;
 
 struct ScatterMaterialFn {
     const Ray& ray;
     const ScatterInfo& scatter_info;
+    Sampler& sampler;
 
     std::optional<ScatteredRay> operator () (const LambertianMaterial& material) const {
-        return material.scatter(ray, scatter_info);
+        return material.scatter(ray, scatter_info, sampler);
     }
 
     std::optional<ScatteredRay> operator () (const MetalMaterial& material) const {
-        return material.scatter(ray, scatter_info);
+        return material.scatter(ray, scatter_info, sampler);
     }
 
     std::optional<ScatteredRay> operator () (const DielectricMaterial& material) const {
-        return material.scatter(ray, scatter_info);
+        return material.scatter(ray, scatter_info, sampler);
+    }
+
+    std::optional<ScatteredRay> operator () (const EmissiveMaterial& material) const {
+        return material.scatter(ray, scatter_info, sampler);
+    }
+};
+
+// Reflectance of the surface without any lighting, the albedo a denoiser is guided by.
+struct AlbedoMaterialFn {
+    Vec3 operator () (const LambertianMaterial& material) const {
+        return material.albedo;
+    }
+
+    Vec3 operator () (const MetalMaterial& material) const {
+        return material.albedo;
+    }
+
+    Vec3 operator () (const DielectricMaterial&) const {
+        return white_color;
+    }
+
+    Vec3 operator () (const EmissiveMaterial&) const {
+        return white_color;
     }
 };
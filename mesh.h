@@ -0,0 +1,303 @@
+#pragma once
+
+#include <array>
+#include <cmath>
+#include <cstdint>
+#include <limits>
+#include <utility>
+#include <vector>
+
+#include "aabb.h"
+#include "bvh.h"
+#include "ray.h"
+#include "sphere_soa.h"
+#include "vec3.h"
+
+// Triangle corners in structure-of-arrays form: one array per corner and axis, so a SIMD
+// kernel can load the same coordinate of consecutive triangles at once. Like SphereSoA,
+// every array ends in NaN sentinels that make full-vector loads safe at the end of a range.
+class TriangleSoA {
+public:
+    static constexpr uint32_t padding = 4;
+
+    TriangleSoA() {
+        resize(0);
+    }
+
+    uint32_t size() const {
+        return size_;
+    }
+
+    void resize(uint32_t size) {
+        size_ = size;
+        for (std::vector<double>& coordinates : coordinates_) {
+            coordinates.assign(size + padding, std::numeric_limits<double>::quiet_NaN());
+        }
+    }
+
+    void set(uint32_t index, const Vec3& v0, const Vec3& v1, const Vec3& v2) {
+        const Vec3* corners[3] = {&v0, &v1, &v2};
+        for (int corner = 0; corner < 3; corner++) {
+            for (int axis = 0; axis < 3; axis++) {
+                coordinates_[3 * corner + axis][index] = (*corners[corner])[axis];
+            }
+        }
+    }
+
+    const double* coordinates(int corner, int axis) const {
+        return coordinates_[3 * corner + axis].data();
+    }
+
+private:
+    uint32_t size_ = 0;
+    std::array<std::vector<double>, 9> coordinates_;
+};
+
+// Watertight ray-triangle intersection (Woop, Benthin and Wald, JCGT 2013). The ray is
+// transformed so that it starts at the origin and points along +z, after which the edge
+// tests are 2D and exactly consistent between triangles sharing an edge: rays cannot slip
+// through a closed mesh between its triangles.
+//
+// The kernels find the closest triangle in [first, first + count) hit in [t_min, t_max].
+// On a hit they lower `t_max` to it, store the triangle index and return true.
+namespace detail {
+    struct TriangleRayConstants {
+        // Axes of the ray space, `kz` is the dominant axis of the direction.
+        int kx, ky, kz;
+        double ox, oy, oz;
+        double sx, sy, sz;
+
+        explicit TriangleRayConstants(const Ray& ray) {
+            const Vec3& d = ray.direction();
+            kz = std::fabs(d[0]) > std::fabs(d[1])
+                ? (std::fabs(d[0]) > std::fabs(d[2]) ? 0 : 2)
+                : (std::fabs(d[1]) > std::fabs(d[2]) ? 1 : 2);
+            kx = (kz + 1) % 3;
+            ky = (kx + 1) % 3;
+            // Keep the winding of the triangles when looking down -z.
+            if (d[kz] < 0.0) {
+                std::swap(kx, ky);
+            }
+            ox = ray.origin()[kx];
+            oy = ray.origin()[ky];
+            oz = ray.origin()[kz];
+            sx = d[kx] / d[kz];
+            sy = d[ky] / d[kz];
+            sz = 1.0 / d[kz];
+        }
+    };
+
+    bool closest_triangle_hit_scalar(
+            const TriangleSoA& triangles, uint32_t first, uint32_t count,
+            const TriangleRayConstants& ray, double t_min, double& t_max, uint32_t& hit_index) {
+        const double* ax = triangles.coordinates(0, ray.kx);
+        const double* ay = triangles.coordinates(0, ray.ky);
+        const double* az = triangles.coordinates(0, ray.kz);
+        const double* bx = triangles.coordinates(1, ray.kx);
+        const double* by = triangles.coordinates(1, ray.ky);
+        const double* bz = triangles.coordinates(1, ray.kz);
+        const double* cx = triangles.coordinates(2, ray.kx);
+        const double* cy = triangles.coordinates(2, ray.ky);
+        const double* cz = triangles.coordinates(2, ray.kz);
+        bool hit_anything = false;
+        for (uint32_t i = first; i < first + count; i++) {
+            double a_z = az[i] - ray.oz;
+            double b_z = bz[i] - ray.oz;
+            double c_z = cz[i] - ray.oz;
+            double a_x = (ax[i] - ray.ox) - ray.sx * a_z;
+            double a_y = (ay[i] - ray.oy) - ray.sy * a_z;
+            double b_x = (bx[i] - ray.ox) - ray.sx * b_z;
+            double b_y = (by[i] - ray.oy) - ray.sy * b_z;
+            double c_x = (cx[i] - ray.ox) - ray.sx * c_z;
+            double c_y = (cy[i] - ray.oy) - ray.sy * c_z;
+            double u = c_x * b_y - c_y * b_x;
+            double v = a_x * c_y - a_y * c_x;
+            double w = b_x * a_y - b_y * a_x;
+            if ((u < 0.0 || v < 0.0 || w < 0.0) && (u > 0.0 || v > 0.0 || w > 0.0)) {
+                continue;
+            }
+            double det = u + v + w;
+            if (det == 0.0) {
+                continue;
+            }
+            double t = ray.sz * (u * a_z + v * b_z + w * c_z) / det;
+            if (t_min <= t && t <= t_max) {
+                t_max = t;
+                hit_index = i;
+                hit_anything = true;
+            }
+        }
+        return hit_anything;
+    }
+
+#if RT_SIMD_X86
+    // The same arithmetic four triangles at a time. There is no SSE2 variant, two lanes do
+    // not pay for the extra bookkeeping of this test.
+    __attribute__((target("avx2")))
+    bool closest_triangle_hit_avx2(
+            const TriangleSoA& triangles, uint32_t first, uint32_t count,
+            const TriangleRayConstants& ray, double t_min, double& t_max, uint32_t& hit_index) {
+        const double* ax = triangles.coordinates(0, ray.kx);
+        const double* ay = triangles.coordinates(0, ray.ky);
+        const double* az = triangles.coordinates(0, ray.kz);
+        const double* bx = triangles.coordinates(1, ray.kx);
+        const double* by = triangles.coordinates(1, ray.ky);
+        const double* bz = triangles.coordinates(1, ray.kz);
+        const double* cx = triangles.coordinates(2, ray.kx);
+        const double* cy = triangles.coordinates(2, ray.ky);
+        const double* cz = triangles.coordinates(2, ray.kz);
+        const __m256d ox = _mm256_set1_pd(ray.ox), oy = _mm256_set1_pd(ray.oy), oz = _mm256_set1_pd(ray.oz);
+        const __m256d sx = _mm256_set1_pd(ray.sx), sy = _mm256_set1_pd(ray.sy), sz = _mm256_set1_pd(ray.sz);
+        const __m256d lower = _mm256_set1_pd(t_min);
+        const __m256d zero = _mm256_setzero_pd();
+        bool hit_anything = false;
+        for (uint32_t i = first; i < first + count; i += 4) {
+            __m256d a_z = _mm256_sub_pd(_mm256_loadu_pd(az + i), oz);
+            __m256d b_z = _mm256_sub_pd(_mm256_loadu_pd(bz + i), oz);
+            __m256d c_z = _mm256_sub_pd(_mm256_loadu_pd(cz + i), oz);
+            __m256d a_x = _mm256_sub_pd(_mm256_sub_pd(_mm256_loadu_pd(ax + i), ox), _mm256_mul_pd(sx, a_z));
+            __m256d a_y = _mm256_sub_pd(_mm256_sub_pd(_mm256_loadu_pd(ay + i), oy), _mm256_mul_pd(sy, a_z));
+            __m256d b_x = _mm256_sub_pd(_mm256_sub_pd(_mm256_loadu_pd(bx + i), ox), _mm256_mul_pd(sx, b_z));
+            __m256d b_y = _mm256_sub_pd(_mm256_sub_pd(_mm256_loadu_pd(by + i), oy), _mm256_mul_pd(sy, b_z));
+            __m256d c_x = _mm256_sub_pd(_mm256_sub_pd(_mm256_loadu_pd(cx + i), ox), _mm256_mul_pd(sx, c_z));
+            __m256d c_y = _mm256_sub_pd(_mm256_sub_pd(_mm256_loadu_pd(cy + i), oy), _mm256_mul_pd(sy, c_z));
+            __m256d u = _mm256_sub_pd(_mm256_mul_pd(c_x, b_y), _mm256_mul_pd(c_y, b_x));
+            __m256d v = _mm256_sub_pd(_mm256_mul_pd(a_x, c_y), _mm256_mul_pd(a_y, c_x));
+            __m256d w = _mm256_sub_pd(_mm256_mul_pd(b_x, a_y), _mm256_mul_pd(b_y, a_x));
+            // Inside if the edge functions agree in sign. NaN lanes (the padding) pass this
+            // test like in the scalar code and are rejected by the range test below.
+            __m256d any_negative = _mm256_or_pd(
+                _mm256_or_pd(_mm256_cmp_pd(u, zero, _CMP_LT_OQ), _mm256_cmp_pd(v, zero, _CMP_LT_OQ)),
+                _mm256_cmp_pd(w, zero, _CMP_LT_OQ));
+            __m256d any_positive = _mm256_or_pd(
+                _mm256_or_pd(_mm256_cmp_pd(u, zero, _CMP_GT_OQ), _mm256_cmp_pd(v, zero, _CMP_GT_OQ)),
+                _mm256_cmp_pd(w, zero, _CMP_GT_OQ));
+            __m256d det = _mm256_add_pd(_mm256_add_pd(u, v), w);
+            __m256d mask = _mm256_andnot_pd(
+                _mm256_and_pd(any_negative, any_positive), _mm256_cmp_pd(det, zero, _CMP_NEQ_UQ));
+            if (_mm256_movemask_pd(mask) == 0) {
+                continue;
+            }
+            __m256d t = _mm256_div_pd(
+                _mm256_mul_pd(sz, _mm256_add_pd(
+                    _mm256_add_pd(_mm256_mul_pd(u, a_z), _mm256_mul_pd(v, b_z)), _mm256_mul_pd(w, c_z))),
+                det);
+            mask = _mm256_and_pd(mask, _mm256_and_pd(
+                _mm256_cmp_pd(lower, t, _CMP_LE_OQ), _mm256_cmp_pd(t, _mm256_set1_pd(t_max), _CMP_LE_OQ)));
+            int bits = _mm256_movemask_pd(mask);
+            if (bits == 0) {
+                continue;
+            }
+            alignas(32) double ts[4];
+            _mm256_store_pd(ts, t);
+            for (uint32_t lane = 0; lane < 4 && i + lane < first + count; lane++) {
+                if ((bits >> lane) & 1 && ts[lane] <= t_max) {
+                    t_max = ts[lane];
+                    hit_index = i + lane;
+                    hit_anything = true;
+                }
+            }
+        }
+        return hit_anything;
+    }
+#endif
+}
+
+bool closest_triangle_hit(
+        const TriangleSoA& triangles, uint32_t first, uint32_t count,
+        const Ray& ray, double t_min, double& t_max, uint32_t& hit_index,
+        SimdLevel level = simd_level()) {
+    detail::TriangleRayConstants constants{ray};
+#if RT_SIMD_X86
+    if (level == SimdLevel::avx2) {
+        return detail::closest_triangle_hit_avx2(triangles, first, count, constants, t_min, t_max, hit_index);
+    }
+#endif
+    return detail::closest_triangle_hit_scalar(triangles, first, count, constants, t_min, t_max, hit_index);
+}
+
+// Indexed triangle mesh with a BVH of its own. The world treats a mesh as one object and
+// only descends into its hierarchy when the ray reaches the mesh bounds.
+//
+// Triangles are reordered into the leaf order of the hierarchy at construction, and their
+// corners are also copied into a TriangleSoA for the intersection kernels.
+class TriangleMesh {
+public:
+    // `indices` holds three vertex indices per triangle, counter-clockwise when seen from
+    // the front.
+    TriangleMesh(std::vector<Vec3> vertices, std::vector<uint32_t> indices, const BvhBuildOptions& options = {})
+        : vertices_{std::move(vertices)}, indices_{std::move(indices)} {
+        uint32_t count = triangle_count();
+        std::vector<BvhPrimitive> primitives;
+        primitives.reserve(count);
+        for (uint32_t i = 0; i < count; i++) {
+            Aabb bounds;
+            bounds.expand(vertex(i, 0));
+            bounds.expand(vertex(i, 1));
+            bounds.expand(vertex(i, 2));
+            primitives.push_back({bounds, bounds.centroid()});
+            bounds_.expand(bounds);
+        }
+        bvh_ = Bvh{primitives, options};
+
+        std::vector<uint32_t> order = bvh_.release_primitive_indices();
+        std::vector<uint32_t> permuted(indices_.size());
+        for (uint32_t i = 0; i < order.size(); i++) {
+            for (int corner = 0; corner < 3; corner++) {
+                permuted[3 * i + corner] = indices_[3 * order[i] + corner];
+            }
+        }
+        indices_ = std::move(permuted);
+
+        triangles_.resize(count);
+        for (uint32_t i = 0; i < count; i++) {
+            triangles_.set(i, vertex(i, 0), vertex(i, 1), vertex(i, 2));
+        }
+    }
+
+    uint32_t triangle_count() const {
+        return indices_.size() / 3;
+    }
+
+    const std::vector<Vec3>& vertices() const {
+        return vertices_;
+    }
+
+    const std::vector<uint32_t>& indices() const {
+        return indices_;
+    }
+
+    const Vec3& vertex(uint32_t triangle, int corner) const {
+        return vertices_[indices_[3 * triangle + corner]];
+    }
+
+    Aabb bounding_box() const {
+        return bounds_;
+    }
+
+    const Bvh& bvh() const {
+        return bvh_;
+    }
+
+    // Closest triangle hit in [t_min, t_max]. On a hit lowers `t_max` to it and stores the
+    // triangle index.
+    bool closest_hit(const Ray& ray, double t_min, double& t_max, uint32_t& triangle) const {
+        return bvh_.traverse(ray, t_min, t_max, [&](uint32_t first, uint32_t count, double& leaf_t_max) {
+            RT_STATS(counters.triangle_tests += count);
+            return closest_triangle_hit(triangles_, first, count, ray, t_min, leaf_t_max, triangle);
+        });
+    }
+
+    // Unit geometric normal, on the side from which the triangle winds counter-clockwise.
+    Vec3 normal(uint32_t triangle) const {
+        const Vec3& v0 = vertex(triangle, 0);
+        return unit_vector(cross(vertex(triangle, 1) - v0, vertex(triangle, 2) - v0));
+    }
+
+private:
+    std::vector<Vec3> vertices_;
+    std::vector<uint32_t> indices_;
+    Aabb bounds_;
+    Bvh bvh_;
+    TriangleSoA triangles_;
+};
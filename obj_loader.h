@@ -0,0 +1,173 @@
+#pragma once
+
+#include <charconv>
+#include <cstdint>
+#include <cstring>
+#include <fstream>
+#include <iostream>
+#include <optional>
+#include <string>
+#include <vector>
+
+#include "bvh.h"
+#include "mesh.h"
+#include "vec3.h"
+
+// Wavefront OBJ reader for triangle meshes. Only vertex positions (`v`) and faces (`f`) are
+// read; texture coordinates, normals, groups and materials are skipped. Polygons are split
+// into triangle fans and negative (relative) indices are resolved.
+//
+// The input is streamed in fixed-size chunks and parsed in place with std::from_chars, so
+// the only memory that grows with the file is the mesh itself.
+namespace detail {
+    class ObjParser {
+    public:
+        std::vector<Vec3> vertices;
+        std::vector<uint32_t> indices;
+        std::string error;
+
+        // Parses one line, without its line break. Returns false on malformed input.
+        bool parse_line(const char* begin, const char* end) {
+            const char* p = skip_space(begin, end);
+            if (end - p < 2 || !is_space(p[1])) {
+                return true;
+            }
+            if (p[0] == 'v') {
+                return parse_vertex(p + 1, end);
+            }
+            if (p[0] == 'f') {
+                return parse_face(p + 1, end);
+            }
+            return true;
+        }
+
+    private:
+        static bool is_space(char c) {
+            return c == ' ' || c == '\t' || c == '\r';
+        }
+
+        static const char* skip_space(const char* p, const char* end) {
+            while (p < end && is_space(*p)) {
+                p++;
+            }
+            return p;
+        }
+
+        bool parse_vertex(const char* p, const char* end) {
+            Vec3 position;
+            for (int axis = 0; axis < 3; axis++) {
+                p = skip_space(p, end);
+                auto [next, ec] = std::from_chars(p, end, position[axis]);
+                if (ec != std::errc{}) {
+                    error = "bad vertex coordinate";
+                    return false;
+                }
+                p = next;
+            }
+            vertices.push_back(position);
+            return true;
+        }
+
+        bool parse_face(const char* p, const char* end) {
+            uint32_t first = 0;
+            uint32_t previous = 0;
+            int corners = 0;
+            while (true) {
+                p = skip_space(p, end);
+                if (p == end) {
+                    break;
+                }
+                int64_t index = 0;
+                auto [next, ec] = std::from_chars(p, end, index);
+                if (ec != std::errc{} || index == 0) {
+                    error = "bad face index";
+                    return false;
+                }
+                // Relative indices count back from the last vertex read so far.
+                index = index > 0 ? index - 1 : static_cast<int64_t>(vertices.size()) + index;
+                if (index < 0 || index > UINT32_MAX) {
+                    error = "face index out of range";
+                    return false;
+                }
+                // Skip the texture coordinate and normal indices, "/vt/vn".
+                p = next;
+                while (p < end && !is_space(*p)) {
+                    p++;
+                }
+
+                uint32_t vertex = static_cast<uint32_t>(index);
+                if (corners == 0) {
+                    first = vertex;
+                } else if (corners >= 2) {
+                    indices.insert(indices.end(), {first, previous, vertex});
+                }
+                previous = vertex;
+                corners++;
+            }
+            if (corners < 3) {
+                error = "face with fewer than three vertices";
+                return false;
+            }
+            return true;
+        }
+    };
+}
+
+std::optional<TriangleMesh> load_obj(std::istream& in, const BvhBuildOptions& options = {}) {
+    constexpr std::size_t chunk_size = 1 << 20;
+    detail::ObjParser parser;
+    std::vector<char> buffer(chunk_size);
+    // Bytes at the start of the buffer that belong to a line continued in the next chunk.
+    std::size_t carried = 0;
+    uint64_t line_number = 0;
+    bool at_end = false;
+    while (!at_end) {
+        if (carried == buffer.size()) {
+            buffer.resize(2 * buffer.size());
+        }
+        in.read(buffer.data() + carried, buffer.size() - carried);
+        std::size_t size = carried + in.gcount();
+        at_end = !in;
+
+        const char* begin = buffer.data();
+        const char* end = begin + size;
+        while (true) {
+            const char* newline = static_cast<const char*>(std::memchr(begin, '\n', end - begin));
+            if (!newline) {
+                if (!at_end) {
+                    break;
+                }
+                // The last line need not end in a line break.
+                newline = end;
+            }
+            line_number++;
+            if (!parser.parse_line(begin, newline)) {
+                std::cerr << "OBJ line " << line_number << ": " << parser.error << std::endl;
+                return {};
+            }
+            if (newline == end) {
+                break;
+            }
+            begin = newline + 1;
+        }
+        carried = end - begin;
+        std::memmove(buffer.data(), begin, carried);
+    }
+
+    for (uint32_t index : parser.indices) {
+        if (index >= parser.vertices.size()) {
+            std::cerr << "OBJ face refers to vertex " << index + 1 << " of " << parser.vertices.size() << std::endl;
+            return {};
+        }
+    }
+    return TriangleMesh{std::move(parser.vertices), std::move(parser.indices), options};
+}
+
+std::optional<TriangleMesh> load_obj(const std::string& path, const BvhBuildOptions& options = {}) {
+    std::ifstream in(path, std::ios::binary);
+    if (!in) {
+        std::cerr << "Could not open " << path << std::endl;
+        return {};
+    }
+    return load_obj(in, options);
+}
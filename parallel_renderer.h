@@ -1,62 +1,145 @@
 #pragma once
 
+#include <algorithm>
+#include <atomic>
+#include <chrono>
+#include <memory>
+#include <vector>
+
+#include "framebuffer.h"
 #include "renderer.h"
+#include "stats.h"
 #include "task_splitter.h"
 #include "task_renderer.h"
+#include "thread_pool.h"
+#include "tile_scheduler.h"
 
-struct RenderedImage {
-    std::map<PixelLocation, Vec3> pixels;
-
-    void add(const RenderedImage& image) {
-        for (const auto& entry : image.pixels) {
-        pixels.insert(entry);
+// A copy of the scene on every NUMA node the threads of a pool run on, each made by a
+// thread of that node so its memory is allocated there, and a renderer over each. The
+// BVH nodes and spheres every ray reads then come from local memory. With the threads
+// on a single node, or unpinned, the original renderer is used. Geometry that worlds
+// share by pointer (instanced meshes) and scenes mapped from a file are not copied.
+class SceneReplicas {
+public:
+    SceneReplicas(const Renderer& renderer, ThreadPool& pool) : renderer_{renderer}, replica_of_thread_(pool.size(), -1) {
+        std::vector<int> nodes = pool.numa_nodes();
+        if (nodes.size() < 2) {
+            return;
         }
+        worlds_.resize(nodes.size());
+        renderers_.resize(nodes.size());
+        pool.run([&](int thread) {
+            int replica = std::lower_bound(nodes.begin(), nodes.end(), pool.numa_node(thread)) - nodes.begin();
+            replica_of_thread_[thread] = replica;
+            for (int other = 0; other < thread; other++) {
+                if (pool.numa_node(other) == pool.numa_node(thread)) {
+                    return;
+                }
+            }
+            worlds_[replica] = std::make_unique<World>(renderer.world());
+            renderers_[replica] = std::make_unique<Renderer>(renderer, *worlds_[replica]);
+        });
     }
+
+    // The renderer thread `thread` of the pool should use.
+    const Renderer& renderer(int thread) const {
+        int replica = replica_of_thread_[thread];
+        return replica < 0 ? renderer_ : *renderers_[replica];
+    }
+
+    int size() const {
+        return worlds_.size();
+    }
+
+private:
+    const Renderer& renderer_;
+    std::vector<int> replica_of_thread_;
+    std::vector<std::unique_ptr<World>> worlds_;
+    std::vector<std::unique_ptr<Renderer>> renderers_;
 };
 
 class ParallelRenderer {
 public:
     const Renderer& renderer;
+    SchedulerOptions scheduler_options = {};
+    // Also fill the albedo, normal and depth buffers of the image.
+    bool output_aovs = false;
+    // Also record what every pixel and tile cost, see cost_map.h.
+    bool output_costs = false;
+    // Per-node copies of the scene, made for the pool passed to render().
+    const SceneReplicas* replicas = nullptr;
+    // Report the tile count, progress and per-thread stats on stderr.
+    bool verbose = false;
 
-    RenderedImage render(int num_cores) const {
-        auto tasks = split_tasks(renderer.image_height(), renderer.image_width(), num_cores);
+    // Renders with a pool of `num_cores` threads started for this image alone.
+    RenderedImage render(int num_cores, std::vector<ThreadStats>* thread_stats = nullptr) const {
+        ThreadPool pool{num_cores};
+        return render(pool, thread_stats);
+    }
+
+    RenderedImage render(ThreadPool& pool, std::vector<ThreadStats>* thread_stats = nullptr) const {
+        using Clock = std::chrono::steady_clock;
+        const int num_cores = pool.size();
 
-        for (const auto& tasks_per_core : tasks) {
-            std::cerr 
-                << "  Num tasks[" << tasks_per_core.core_id << "]: "
-                << tasks_per_core.tasks.size()
-                << std::endl
-                << std::flush;
+        auto tasks = split_tiles(renderer.image_height(), renderer.image_width(), scheduler_options.tile_size, scheduler_options.order);
+        if (verbose) {
+            std::cerr << "Number of tiles: " << tasks.size() << std::endl << std::flush;
         }
 
-        std::vector<RenderedImage> rendered_images;
-        rendered_images.resize(num_cores);
-
-        std::vector<std::thread> threads;
-        for (const auto& tasks_per_core : tasks) {
-            std::thread thread([this, &tasks_per_core, &rendered_images]() mutable {
-            auto& rendered_image = rendered_images[tasks_per_core.core_id];
-            for (const auto& task : tasks_per_core.tasks) {
-                auto result = render_task(tasks_per_core.core_id, task, renderer, tasks_per_core.core_id == 0);
-                // Populate result in the rendered_image map.
-                for (std::size_t i = 0; i < result.pixels.size(); i++) {
-                auto location = result.location_of(i);
-                rendered_image.pixels[location] = result.pixels[i];
+        WorkStealingScheduler scheduler{tasks, num_cores};
+        std::atomic<int> remaining_tiles = tasks.size();
+        std::vector<ThreadStats> stats(num_cores);
+        std::vector<std::vector<TileCost>> tile_costs(num_cores);
+
+        // Tasks cover disjoint tiles, so every thread writes into the shared buffers.
+        RenderedImage image{renderer.image_width(), renderer.image_height(), output_aovs, output_costs};
+
+        auto render_start = Clock::now();
+        pool.run([&](CoreId core_id) {
+            const Renderer& thread_renderer = replicas ? replicas->renderer(core_id) : renderer;
+            ThreadStats& thread_stats = stats[core_id];
+            thread_stats.core_id = core_id;
+            bool stolen = false;
+            while (auto task = scheduler.next(core_id, stolen)) {
+                auto task_start = Clock::now();
+                uint64_t tests_before = output_costs ? local_intersection_tests() : 0;
+                uint64_t rays_traced = render_task(*task, thread_renderer, image);
+                auto task_end = Clock::now();
+                double task_seconds = std::chrono::duration<double>(task_end - task_start).count();
+                thread_stats.rays_traced += rays_traced;
+                thread_stats.busy_seconds += task_seconds;
+                if (output_costs) {
+                    tile_costs[core_id].push_back(
+                        {*task, core_id, task_seconds, rays_traced, local_intersection_tests() - tests_before});
+                }
+                RT_STATS(counters.spans.push_back({
+                    "tile", trace_clock_us(task_start), trace_clock_us(task_end) - trace_clock_us(task_start),
+                    task->start_x, task->end_x, task->start_y, task->end_y}));
+                thread_stats.tiles_rendered++;
+                thread_stats.tiles_stolen += stolen;
+                int remaining = --remaining_tiles;
+                if (verbose && core_id == 0) {
+                    std::cerr << "\rRemaining tiles: " << remaining << ' ' << std::flush;
                 }
             }
-            });
-            threads.push_back(std::move(thread));
+        });
+        double render_seconds = std::chrono::duration<double>(Clock::now() - render_start).count();
+        if (verbose) {
+            std::cerr << std::endl;
         }
 
-        // Merge image parts into one image.
-        for (auto& thread : threads) {
-            thread.join();
+        for (auto& thread_stats : stats) {
+            thread_stats.idle_seconds = render_seconds - thread_stats.busy_seconds;
+            if (verbose) {
+                std::cerr << thread_stats << std::endl;
+            }
         }
-
-        RenderedImage rendered_image = std::move(rendered_images[0]);
-        for (std::size_t i = 1; i < rendered_images.size(); i++) {
-            rendered_image.add(rendered_images[i]);
+        if (thread_stats) {
+            *thread_stats = std::move(stats);
         }
-        return rendered_image;
+        for (const auto& thread_tile_costs : tile_costs) {
+            image.tile_costs.insert(image.tile_costs.end(), thread_tile_costs.begin(), thread_tile_costs.end());
+        }
+        return image;
     }
-};
\ No newline at end of file
+};
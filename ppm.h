@@ -1,7 +1,11 @@
 #pragma once
 
+#include <algorithm>
+#include <string>
+
 #include "vec3.h"
 #include "common.h"
+#include "framebuffer.h"
 
 double gamma_correct(double value, double gamma = 2.0) {
     return pow(value, 1.0 / gamma);
@@ -11,5 +15,18 @@ void write_pixel(std::ostream& out, const Vec3& pixel) {
     int r = static_cast<int>(256 * clamp(gamma_correct(pixel[0]), 0.0, 0.999));
     int g = static_cast<int>(256 * clamp(gamma_correct(pixel[1]), 0.0, 0.999));
     int b = static_cast<int>(256 * clamp(gamma_correct(pixel[2]), 0.0, 0.999));
-    out << r << ' ' << g << ' ' << b << std::endl;
-}
\ No newline at end of file
+    out << r << ' ' << g << ' ' << b << '\n';
+}
+
+// Binary greyscale PGM of the samples taken per pixel, white at `max_samples`.
+void write_sample_counts(std::ostream& out, const ImageBuffer<int>& sample_counts, int max_samples) {
+    out << "P5\n" << sample_counts.width() << ' ' << sample_counts.height() << "\n255\n";
+    std::string bytes(sample_counts.width(), '\0');
+    for (int row = sample_counts.height() - 1; row >= 0; row--) {
+        const int* scanline = sample_counts.scanline(row);
+        for (int col = 0; col < sample_counts.width(); col++) {
+            bytes[col] = static_cast<char>(std::min(255, 255 * scanline[col] / std::max(max_samples, 1)));
+        }
+        out.write(bytes.data(), bytes.size());
+    }
+}
@@ -0,0 +1,287 @@
+#pragma once
+
+#include <algorithm>
+#include <atomic>
+#include <chrono>
+#include <cstdint>
+#include <cstdio>
+#include <fstream>
+#include <iostream>
+#include <optional>
+#include <string>
+#include <vector>
+
+#include "content_hash.h"
+#include "framebuffer.h"
+#include "image_writer.h"
+#include "renderer.h"
+#include "stats.h"
+#include "task_renderer.h"
+#include "task_splitter.h"
+#include "thread_pool.h"
+#include "tile_scheduler.h"
+
+struct ProgressiveOptions {
+    // Samples per pixel to reach in total, resumed samples included.
+    int target_samples = 256;
+    // Wall time after which no new pass is started. Zero means no limit.
+    double time_budget_seconds = 0.0;
+    // Samples every pixel gets in one pass over the image.
+    int samples_per_pass = 1;
+    // A snapshot and a checkpoint are written whenever this much time has passed since the
+    // last ones, and a checkpoint once more at the end. Empty paths turn them off.
+    double checkpoint_interval_seconds = 60.0;
+    std::string checkpoint_path;
+    std::string snapshot_path;
+    ImageFormat snapshot_format = ImageFormat::ppm;
+};
+
+// Sum of the first `samples` samples of every pixel. Samples are seeded by their pixel and
+// index, so continuing an accumulation gives the same image as rendering in one go.
+struct Accumulation {
+    uint64_t seed = 0;
+    SampleSequence sample_sequence = SampleSequence::independent;
+    // Hash of the scene and of the settings that are not stored above (see
+    // ProgressiveRenderer::settings_hash).
+    uint64_t settings_hash = 0;
+    int samples = 0;
+    Framebuffer sums;
+
+    Framebuffer average() const {
+        Framebuffer image{sums.width(), sums.height()};
+        for (int row = 0; row < sums.height(); row++) {
+            const Vec3* sum = sums.scanline(row);
+            Vec3* pixel = image.scanline(row);
+            for (int col = 0; col < sums.width(); col++) {
+                pixel[col] = samples > 0 ? sum[col] / samples : Vec3{0, 0, 0};
+            }
+        }
+        return image;
+    }
+};
+
+namespace detail {
+    constexpr char checkpoint_magic[8] = {'R', 'T', 'C', 'K', 'P', 'T', '0', '2'};
+
+    template <typename T>
+    void write_value(std::ostream& out, const T& value) {
+        out.write(reinterpret_cast<const char*>(&value), sizeof(T));
+    }
+
+    template <typename T>
+    bool read_value(std::istream& in, T& value) {
+        return static_cast<bool>(in.read(reinterpret_cast<char*>(&value), sizeof(T)));
+    }
+}
+
+// Checkpoint layout, native byte order: magic, width, height, seed, sample sequence,
+// settings hash, samples, then the sums as width * height * 3 doubles, bottom row first.
+void write_checkpoint(std::ostream& out, const Accumulation& accumulation) {
+    out.write(detail::checkpoint_magic, sizeof(detail::checkpoint_magic));
+    detail::write_value(out, static_cast<int32_t>(accumulation.sums.width()));
+    detail::write_value(out, static_cast<int32_t>(accumulation.sums.height()));
+    detail::write_value(out, accumulation.seed);
+    detail::write_value(out, static_cast<int32_t>(accumulation.sample_sequence));
+    detail::write_value(out, accumulation.settings_hash);
+    detail::write_value(out, static_cast<int32_t>(accumulation.samples));
+    for (const Vec3& sum : accumulation.sums.pixels()) {
+        double values[3] = {sum[0], sum[1], sum[2]};
+        out.write(reinterpret_cast<const char*>(values), sizeof(values));
+    }
+}
+
+// Returns nothing if the data is not a complete checkpoint.
+std::optional<Accumulation> read_checkpoint(std::istream& in) {
+    char magic[sizeof(detail::checkpoint_magic)];
+    if (!in.read(magic, sizeof(magic)) || !std::equal(magic, magic + sizeof(magic), detail::checkpoint_magic)) {
+        return {};
+    }
+    int32_t width, height, sample_sequence, samples;
+    Accumulation accumulation;
+    if (!detail::read_value(in, width) || !detail::read_value(in, height) || !detail::read_value(in, accumulation.seed)
+            || !detail::read_value(in, sample_sequence) || !detail::read_value(in, accumulation.settings_hash)
+            || !detail::read_value(in, samples)
+            || width <= 0 || height <= 0 || samples < 0) {
+        return {};
+    }
+    accumulation.sample_sequence = static_cast<SampleSequence>(sample_sequence);
+    accumulation.samples = samples;
+    accumulation.sums = Framebuffer{width, height};
+    for (int row = 0; row < height; row++) {
+        for (int col = 0; col < width; col++) {
+            double values[3];
+            if (!in.read(reinterpret_cast<char*>(values), sizeof(values))) {
+                return {};
+            }
+            accumulation.sums.at(row, col) = Vec3{values[0], values[1], values[2]};
+        }
+    }
+    return accumulation;
+}
+
+// Renders in passes over the whole image, each adding `samples_per_pass` samples to every
+// pixel, until the sample target or the time budget is reached. Unlike ParallelRenderer
+// there is a usable image after every pass: it is snapshotted periodically, and the
+// accumulation is checkpointed so an interrupted render can resume where it stopped.
+// Adaptive sampling does not apply, every pixel gets the same number of samples.
+class ProgressiveRenderer {
+public:
+    const Renderer& renderer;
+    ProgressiveOptions options = {};
+    SchedulerOptions scheduler_options = {};
+    // Report the samples reached after every pass on stderr.
+    bool verbose = false;
+
+    // Continues from the checkpoint file if there is a matching one.
+    RenderedImage render(int num_cores) const {
+        ThreadPool pool{num_cores};
+        return render(pool);
+    }
+
+    // The passes share the threads of `pool` instead of starting new ones each.
+    RenderedImage render(ThreadPool& pool) const {
+        Accumulation accumulation = resume_or_start();
+        if (accumulation.samples > 0) {
+            std::cerr << "Resuming from " << options.checkpoint_path << " at " << accumulation.samples
+                      << " samples per pixel" << std::endl;
+        }
+        render(accumulation, pool);
+
+        RenderedImage image{renderer.image_width(), renderer.image_height()};
+        image.color = accumulation.average();
+        image.sample_counts = ImageBuffer<int>{renderer.image_width(), renderer.image_height(), accumulation.samples};
+        return image;
+    }
+
+    // Adds passes to the accumulation until a stopping condition is met.
+    void render(Accumulation& accumulation, int num_cores) const {
+        ThreadPool pool{num_cores};
+        render(accumulation, pool);
+    }
+
+    void render(Accumulation& accumulation, ThreadPool& pool) const {
+        using Clock = std::chrono::steady_clock;
+        auto tasks = split_tiles(renderer.image_height(), renderer.image_width(), scheduler_options.tile_size, scheduler_options.order);
+        auto start = Clock::now();
+        auto last_checkpoint = start;
+
+        while (accumulation.samples < options.target_samples) {
+            int pass_samples = std::min(options.samples_per_pass, options.target_samples - accumulation.samples);
+            render_pass(tasks, accumulation, pass_samples, pool);
+            accumulation.samples += pass_samples;
+
+            auto now = Clock::now();
+            double elapsed = std::chrono::duration<double>(now - start).count();
+            if (verbose) {
+                std::cerr << "\rSamples per pixel: " << accumulation.samples << " (" << elapsed << " s) " << std::flush;
+            }
+            if (options.time_budget_seconds > 0.0 && elapsed >= options.time_budget_seconds) {
+                break;
+            }
+            if (std::chrono::duration<double>(now - last_checkpoint).count() >= options.checkpoint_interval_seconds) {
+                save(accumulation, true);
+                last_checkpoint = now;
+            }
+        }
+        if (verbose) {
+            std::cerr << std::endl;
+        }
+        save(accumulation, false);
+    }
+
+private:
+    Accumulation resume_or_start() const {
+        if (!options.checkpoint_path.empty()) {
+            std::ifstream in(options.checkpoint_path, std::ios::binary);
+            if (in) {
+                std::optional<Accumulation> checkpoint = read_checkpoint(in);
+                if (checkpoint && is_compatible(*checkpoint)) {
+                    return std::move(*checkpoint);
+                }
+                std::cerr << "Ignoring checkpoint " << options.checkpoint_path
+                          << (checkpoint ? ": rendered with another scene or settings" : ": unreadable")
+                          << ", starting over" << std::endl;
+            }
+        }
+        Accumulation accumulation;
+        accumulation.seed = renderer.seed();
+        accumulation.sample_sequence = renderer.sample_sequence();
+        accumulation.settings_hash = settings_hash();
+        accumulation.sums = Framebuffer{renderer.image_width(), renderer.image_height()};
+        return accumulation;
+    }
+
+    bool is_compatible(const Accumulation& accumulation) const {
+        return accumulation.sums.width() == renderer.image_width()
+            && accumulation.sums.height() == renderer.image_height()
+            && accumulation.seed == renderer.seed()
+            && accumulation.sample_sequence == renderer.sample_sequence()
+            && accumulation.settings_hash == settings_hash();
+    }
+
+    // Hash of the scene, the camera, the engine options and the bounce depth, so a
+    // checkpoint is only resumed by the same render. The sample target is left out: samples
+    // are seeded by their index, so a higher target adds to the checkpoint.
+    uint64_t settings_hash() const {
+        ContentHash hash;
+        hash.add_value(renderer.world().content_hash());
+        const Camera& camera = renderer.camera();
+        for (const Vec3& v : {camera.origin(), camera.lower_left_corner(), camera.horizontal(), camera.vertical()}) {
+            hash.add_value(v[0]);
+            hash.add_value(v[1]);
+            hash.add_value(v[2]);
+        }
+        hash.add_value(camera.lens_radius());
+        const EngineOptions& engine_options = renderer.engine_options();
+        hash.add_value(engine_options.path_tracing);
+        hash.add_value(engine_options.russian_roulette_min_depth);
+        hash.add_value(engine_options.russian_roulette_max_survival);
+        hash.add_value(engine_options.wavefront_batch_size);
+        hash.add_value(engine_options.packet_size);
+        hash.add_value(engine_options.sample_lights);
+        hash.add_value(renderer.max_ray_bounce_depth());
+        return hash.value();
+    }
+
+    void render_pass(const std::vector<RenderTask>& tasks, Accumulation& accumulation, int pass_samples, ThreadPool& pool) const {
+        WorkStealingScheduler scheduler{tasks, pool.size()};
+        // Tasks cover disjoint tiles, so every thread adds into the shared sums.
+        pool.run([&](CoreId core_id) {
+            bool stolen = false;
+            while (auto task = scheduler.next(core_id, stolen)) {
+                [[maybe_unused]] auto task_start = std::chrono::steady_clock::now();
+                accumulate_task(*task, renderer, accumulation.samples, pass_samples, accumulation.sums);
+                RT_STATS(counters.spans.push_back({
+                    "pass tile", trace_clock_us(task_start),
+                    trace_clock_us(std::chrono::steady_clock::now()) - trace_clock_us(task_start),
+                    task->start_x, task->end_x, task->start_y, task->end_y}));
+            }
+        });
+    }
+
+    void save(const Accumulation& accumulation, bool with_snapshot) const {
+        if (!options.checkpoint_path.empty()) {
+            replace_file(options.checkpoint_path, [&](std::ostream& out) {
+                write_checkpoint(out, accumulation);
+            });
+        }
+        if (with_snapshot && !options.snapshot_path.empty()) {
+            replace_file(options.snapshot_path, [&](std::ostream& out) {
+                write_image(out, accumulation.average(), options.snapshot_format);
+            });
+        }
+    }
+
+    // Writes next to the final path and renames over it, so an interruption never leaves
+    // a truncated checkpoint or snapshot behind.
+    template <typename WriteFn>
+    static void replace_file(const std::string& path, WriteFn write) {
+        std::string temporary_path = path + ".tmp";
+        std::ofstream out(temporary_path, std::ios::binary);
+        write(out);
+        out.close();
+        if (!out || std::rename(temporary_path.c_str(), path.c_str()) != 0) {
+            std::cerr << "Could not write " << path << std::endl;
+        }
+    }
+};
@@ -2,21 +2,26 @@
 
 #include "vec3.h"
 
-class Ray {
+template <typename T>
+class BasicRay {
 public:
-    Ray() {}
-    Ray(const Vec3& origin, const Vec3& direction) : origin_{origin}, direction_{direction} {}
-    Ray(Vec3&& origin, Vec3&& direction) : origin_{std::move(origin)}, direction_{std::move(direction)} {}
+    using Vector = BasicVec3<T>;
 
-    const Vec3& origin() const { return origin_; }
+    BasicRay() {}
+    BasicRay(const Vector& origin, const Vector& direction) : origin_{origin}, direction_{direction} {}
+    BasicRay(Vector&& origin, Vector&& direction) : origin_{std::move(origin)}, direction_{std::move(direction)} {}
 
-    const Vec3& direction() const { return direction_; }
+    const Vector& origin() const { return origin_; }
 
-    Vec3 at(double t) const {
+    const Vector& direction() const { return direction_; }
+
+    Vector at(T t) const {
         return origin_ + t * direction_;
     }
 
 private:
-    Vec3 origin_;
-    Vec3 direction_;
-};
\ No newline at end of file
+    Vector origin_;
+    Vector direction_;
+};
+
+using Ray = BasicRay<Real>;
\ No newline at end of file
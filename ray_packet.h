@@ -0,0 +1,254 @@
+#pragma once
+
+#include <array>
+#include <cassert>
+#include <cmath>
+#include <cstdint>
+#include <limits>
+#include <utility>
+
+#include "bvh.h"
+#include "ray.h"
+#include "sphere_soa.h"
+#include "stats.h"
+#include "vec3.h"
+
+// Up to `max_size` rays traced through the sphere BVH together, stored by component.
+// Arrays are padded to a multiple of four rays with lanes that hit nothing: their
+// directions are NaN, and callers give them a t_max of -infinity.
+struct RayPacket {
+    static constexpr int max_size = 16;
+
+    const Ray* rays;
+    int size;
+    // Number of rays rounded up to whole SIMD groups.
+    int padded_size;
+    // Whether all rays point into the same octant, which a shared front-to-back
+    // traversal needs. Rays of an incoherent packet are traced one by one.
+    bool is_coherent = true;
+    std::array<bool, 3> is_direction_negative;
+    alignas(32) double origin[3][max_size];
+    alignas(32) double direction[3][max_size];
+    alignas(32) double inverse_direction[3][max_size];
+    alignas(32) double a[max_size];
+
+    RayPacket(const Ray* rays, int size) : rays{rays}, size{size}, padded_size{(size + 3) / 4 * 4} {
+        const double nan = std::numeric_limits<double>::quiet_NaN();
+        for (int i = 0; i < padded_size; i++) {
+            for (int axis = 0; axis < 3; axis++) {
+                origin[axis][i] = i < size ? rays[i].origin()[axis] : 0.0;
+                direction[axis][i] = i < size ? rays[i].direction()[axis] : nan;
+                inverse_direction[axis][i] = 1.0 / direction[axis][i];
+            }
+            a[i] = i < size ? rays[i].direction().length_squared() : nan;
+        }
+        for (int axis = 0; axis < 3; axis++) {
+            is_direction_negative[axis] = inverse_direction[axis][0] < 0.0;
+            for (int i = 1; i < size; i++) {
+                if ((inverse_direction[axis][i] < 0.0) != is_direction_negative[axis]) {
+                    is_coherent = false;
+                }
+            }
+        }
+    }
+};
+
+// The kernels below compute, lane by lane, exactly what `Aabb::hit` and the single-ray
+// sphere kernels do, so a packet finds the same hits as its rays traced alone. Results go
+// to per-ray arrays of `RayPacket::max_size` entries: `t_max` is lowered on a hit and
+// `hit_index` set to the sphere.
+namespace detail {
+    // Bit i is set if ray i hits the box within [t_min, t_max[i]].
+    uint32_t packet_box_hits_scalar(const Aabb& box, const RayPacket& packet, double t_min, const double* t_max) {
+        uint32_t hits = 0;
+        for (int i = 0; i < packet.size; i++) {
+            Vec3 origin{packet.origin[0][i], packet.origin[1][i], packet.origin[2][i]};
+            Vec3 inverse_direction{
+                packet.inverse_direction[0][i], packet.inverse_direction[1][i], packet.inverse_direction[2][i]};
+            if (box.hit(origin, inverse_direction, t_min, t_max[i])) {
+                hits |= 1u << i;
+            }
+        }
+        return hits;
+    }
+
+    // Tests the spheres in [first, first + count) against the rays of every group of four
+    // with a bit in `groups`. Returns the rays that found a closer hit.
+    uint32_t packet_sphere_hits_scalar(
+            const SphereSoA& spheres, uint32_t first, uint32_t count, const RayPacket& packet,
+            uint32_t groups, double t_min, double* t_max, uint32_t* hit_index) {
+        uint32_t hits = 0;
+        for (int i = 0; i < packet.size; i++) {
+            if (!((groups >> i) & 1)) {
+                continue;
+            }
+            RayConstants ray{packet.rays[i]};
+            if (closest_sphere_hit_scalar(spheres, first, count, ray, t_min, t_max[i], hit_index[i])) {
+                hits |= 1u << i;
+            }
+        }
+        return hits;
+    }
+
+#if RT_SIMD_X86
+    __attribute__((target("avx2")))
+    uint32_t packet_box_hits_avx2(const Aabb& box, const RayPacket& packet, double t_min, const double* t_max) {
+        uint32_t hits = 0;
+        for (int g = 0; g < packet.padded_size; g += 4) {
+            // Same comparisons as Aabb::hit: max_pd(a, b) is a > b ? a : b, min_pd(a, b) is
+            // a < b ? a : b, so NaNs leave the interval alone.
+            __m256d lower = _mm256_set1_pd(t_min);
+            __m256d upper = _mm256_load_pd(t_max + g);
+            for (int axis = 0; axis < 3; axis++) {
+                __m256d origin = _mm256_load_pd(packet.origin[axis] + g);
+                __m256d inverse_direction = _mm256_load_pd(packet.inverse_direction[axis] + g);
+                __m256d t0 = _mm256_mul_pd(_mm256_sub_pd(_mm256_set1_pd(box.min()[axis]), origin), inverse_direction);
+                __m256d t1 = _mm256_mul_pd(_mm256_sub_pd(_mm256_set1_pd(box.max()[axis]), origin), inverse_direction);
+                if (packet.is_direction_negative[axis]) {
+                    std::swap(t0, t1);
+                }
+                lower = _mm256_max_pd(t0, lower);
+                upper = _mm256_min_pd(t1, upper);
+            }
+            hits |= _mm256_movemask_pd(_mm256_cmp_pd(upper, lower, _CMP_GE_OQ)) << g;
+        }
+        return hits & ((1u << packet.size) - 1);
+    }
+
+    __attribute__((target("avx2")))
+    uint32_t packet_sphere_hits_avx2(
+            const SphereSoA& spheres, uint32_t first, uint32_t count, const RayPacket& packet,
+            uint32_t groups, double t_min, double* t_max, uint32_t* hit_index) {
+        const __m256d lower = _mm256_set1_pd(t_min);
+        const __m256d zero = _mm256_setzero_pd();
+        uint32_t hits = 0;
+        for (int g = 0; g < packet.padded_size; g += 4) {
+            if (!((groups >> g) & 0xf)) {
+                continue;
+            }
+            const __m256d ox = _mm256_load_pd(packet.origin[0] + g);
+            const __m256d oy = _mm256_load_pd(packet.origin[1] + g);
+            const __m256d oz = _mm256_load_pd(packet.origin[2] + g);
+            const __m256d dx = _mm256_load_pd(packet.direction[0] + g);
+            const __m256d dy = _mm256_load_pd(packet.direction[1] + g);
+            const __m256d dz = _mm256_load_pd(packet.direction[2] + g);
+            const __m256d a = _mm256_load_pd(packet.a + g);
+            __m256d upper = _mm256_load_pd(t_max + g);
+            // Spheres in ascending order, as the single-ray kernels see them, so ties go
+            // to the same sphere.
+            for (uint32_t i = first; i < first + count; i++) {
+                __m256d cx = _mm256_sub_pd(ox, _mm256_set1_pd(spheres.xs()[i]));
+                __m256d cy = _mm256_sub_pd(oy, _mm256_set1_pd(spheres.ys()[i]));
+                __m256d cz = _mm256_sub_pd(oz, _mm256_set1_pd(spheres.zs()[i]));
+                __m256d r = _mm256_set1_pd(spheres.radii()[i]);
+                __m256d half_b = _mm256_add_pd(
+                    _mm256_add_pd(_mm256_mul_pd(cx, dx), _mm256_mul_pd(cy, dy)), _mm256_mul_pd(cz, dz));
+                __m256d c = _mm256_sub_pd(
+                    _mm256_add_pd(_mm256_add_pd(_mm256_mul_pd(cx, cx), _mm256_mul_pd(cy, cy)), _mm256_mul_pd(cz, cz)),
+                    _mm256_mul_pd(r, r));
+                __m256d discriminant = _mm256_sub_pd(_mm256_mul_pd(half_b, half_b), _mm256_mul_pd(a, c));
+                __m256d mask = _mm256_cmp_pd(discriminant, zero, _CMP_GT_OQ);
+                if (_mm256_movemask_pd(mask) == 0) {
+                    continue;
+                }
+                __m256d t = _mm256_div_pd(_mm256_sub_pd(_mm256_sub_pd(zero, half_b), _mm256_sqrt_pd(discriminant)), a);
+                mask = _mm256_and_pd(mask, _mm256_and_pd(
+                    _mm256_cmp_pd(lower, t, _CMP_LE_OQ), _mm256_cmp_pd(t, upper, _CMP_LE_OQ)));
+                int bits = _mm256_movemask_pd(mask);
+                if (bits == 0) {
+                    continue;
+                }
+                upper = _mm256_blendv_pd(upper, t, mask);
+                for (int lane = 0; lane < 4; lane++) {
+                    if ((bits >> lane) & 1) {
+                        hit_index[g + lane] = i;
+                    }
+                }
+                hits |= bits << g;
+            }
+            _mm256_store_pd(t_max + g, upper);
+        }
+        return hits & ((1u << packet.size) - 1);
+    }
+#endif
+}
+
+// Closest sphere hits of a coherent packet, each ray within [t_min, t_max[i]]. All rays
+// descend the BVH together, near child first, and a node is only entered by the rays
+// that hit its box; once a single ray is left in a subtree it finishes that subtree on
+// its own. Returns a bit per ray that hit a sphere, with `t_max` and `hit_index` set as
+// for closest_sphere_hit(). `t_max` and `hit_index` hold `RayPacket::max_size` entries.
+uint32_t closest_sphere_hits(
+        const Bvh& bvh, const SphereSoA& spheres, const RayPacket& packet, double t_min, double* t_max,
+        uint32_t* hit_index, SimdLevel level = simd_level()) {
+    if (bvh.nodes().empty()) {
+        return 0;
+    }
+    for (int i = packet.size; i < packet.padded_size; i++) {
+        t_max[i] = -std::numeric_limits<double>::infinity();
+    }
+    auto box_hits = [&](const Aabb& box) {
+#if RT_SIMD_X86
+        if (level == SimdLevel::avx2) {
+            return detail::packet_box_hits_avx2(box, packet, t_min, t_max);
+        }
+#endif
+        return detail::packet_box_hits_scalar(box, packet, t_min, t_max);
+    };
+    auto sphere_hits = [&](uint32_t first, uint32_t count, uint32_t active) {
+        // Whole groups of four are tested; extra rays cannot hit spheres outside their boxes.
+        uint32_t groups = 0;
+        for (int g = 0; g < packet.padded_size; g += 4) {
+            if ((active >> g) & 0xf) {
+                groups |= 0xfu << g;
+            }
+        }
+#if RT_SIMD_X86
+        if (level == SimdLevel::avx2) {
+            return detail::packet_sphere_hits_avx2(spheres, first, count, packet, groups, t_min, t_max, hit_index);
+        }
+#endif
+        return detail::packet_sphere_hits_scalar(spheres, first, count, packet, groups, t_min, t_max, hit_index);
+    };
+
+    const BvhNode* nodes = bvh.nodes().data();
+    uint32_t hits = 0;
+    std::array<uint32_t, max_bvh_depth> stack;
+    int stack_size = 0;
+    uint32_t current = 0;
+    while (true) {
+        const BvhNode& node = nodes[current];
+        RT_STATS(counters.bvh_node_tests++);
+        uint32_t active = box_hits(node.bounds);
+        if (__builtin_popcount(active) == 1) {
+            int i = __builtin_ctz(active);
+            bool hit = bvh.traverse_from(current, packet.rays[i], t_min, t_max[i], [&](uint32_t first, uint32_t count, double& leaf_t_max) {
+                RT_STATS(counters.sphere_tests += count);
+                return closest_sphere_hit(spheres, first, count, packet.rays[i], t_min, leaf_t_max, hit_index[i], level);
+            });
+            if (hit) {
+                hits |= 1u << i;
+            }
+        } else if (active) {
+            if (node.is_leaf()) {
+                RT_STATS(counters.sphere_tests += uint64_t{node.count} * __builtin_popcount(active));
+                hits |= sphere_hits(node.offset, node.count, active);
+            } else {
+                assert(stack_size < max_bvh_depth);
+                if (packet.is_direction_negative[node.axis]) {
+                    stack[stack_size++] = current + 1;
+                    current = node.offset;
+                } else {
+                    stack[stack_size++] = node.offset;
+                    current = current + 1;
+                }
+                continue;
+            }
+        }
+        if (stack_size == 0) {
+            break;
+        }
+        current = stack[--stack_size];
+    }
+    return hits;
+}
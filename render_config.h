@@ -0,0 +1,277 @@
+#pragma once
+
+#include <algorithm>
+#include <cerrno>
+#include <cmath>
+#include <cstdint>
+#include <cstdlib>
+#include <iterator>
+#include <iostream>
+#include <limits>
+#include <optional>
+#include <string>
+#include <utility>
+
+#include "image_writer.h"
+#include "renderer.h"
+#include "sampler.h"
+
+// Everything about a render of the demo that is chosen per run, so one binary can be tuned
+// for each machine without rebuilding. Defaults are what main.cc used to hard-code, except
+// that the thread count follows the CPUs the process may use.
+struct RenderConfig {
+    int image_width = 1920;
+    // Zero keeps the 16:9 aspect ratio of the width.
+    int image_height = 0;
+    int samples_per_pixel = 256;
+    int max_ray_bounce_depth = 50;
+    uint64_t seed = 1;
+    // "random", "three_spheres", "two_spheres", "lit_room", or the path of a binary scene file.
+    std::string scene = "random";
+    // Sample the lights at diffuse hits, see EngineOptions::sample_lights.
+    bool sample_lights = true;
+    // Builds the BVH; without it every ray is tested against every sphere, which is kept
+    // to check that both give the same image. Scene files always come with their BVH.
+    bool use_bvh = true;
+    SampleSequence sample_sequence = SampleSequence::sobol;
+    // Adaptive sampling stops converged pixels early, the samples per pixel are then unused.
+    AdaptiveSamplingOptions adaptive_sampling{
+        .enabled = false, .min_samples = 16, .max_samples = 1000, .noise_threshold = 0.004};
+
+    // Zero is one thread per allowed CPU.
+    int threads = 0;
+    // Binds every thread to one CPU, spread over cores and NUMA nodes first.
+    bool pin_threads = false;
+    // Copies the scene to every NUMA node the pinned threads run on.
+    bool numa_replicas = false;
+    int tile_size = 16;
+
+    bool progressive = false;
+    // Wall time after which --progressive starts no new pass, zero for none.
+    double time_budget_seconds = 0.0;
+    // Where --progressive keeps its checkpoint and snapshot. Empty turns either off.
+    std::string checkpoint_path = "render.checkpoint";
+    std::string snapshot_path = "snapshot.ppm";
+    bool denoise = false;
+    // Writes bands of the image as they finish instead of holding all of it, see
+    // streaming_renderer.h.
+    bool stream = false;
+    ImageFormat output_format = ImageFormat::ppm;
+    // Where per-pixel and per-tile cost maps go, see cost_map.h. Empty for none.
+    std::string cost_maps_prefix;
+
+    std::optional<uint16_t> listen_port;
+    std::string coordinator_host;
+    uint16_t coordinator_port = 0;
+
+    bool show_help = false;
+};
+
+void print_render_usage(std::ostream& out, const char* program) {
+    out << "Usage: " << program << " [OPTIONS] [SCENE_FILE] > image.ppm\n"
+        << "\n"
+        << "  --width N          image width in pixels (1920)\n"
+        << "  --height N         image height in pixels (width * 9 / 16)\n"
+        << "  --samples N        samples per pixel (256)\n"
+        << "  --max-depth N      maximum ray bounces (50)\n"
+        << "  --seed N           render seed (1)\n"
+        << "  --scene NAME       random, three_spheres, two_spheres, lit_room or a scene file (random)\n"
+        << "  --no-light-sampling  find lights only through scattered rays\n"
+        << "  --accel ACCEL      bvh or linear, for the built-in scenes (bvh)\n"
+        << "  --sample-sequence SEQUENCE  independent, sobol or blue_noise (sobol)\n"
+        << "  --adaptive         stop sampling converged pixels, write sample_counts.pgm\n"
+        << "  --min-samples N    --adaptive samples every pixel gets (16)\n"
+        << "  --max-samples N    --adaptive samples no pixel goes beyond (1000)\n"
+        << "  --noise-threshold X  --adaptive relative error at which a pixel stops (0.004)\n"
+        << "  --threads N        render threads, 0 for one per allowed CPU (0)\n"
+        << "  --pin              pin threads to CPUs, one per physical core first\n"
+        << "  --numa-replicas    copy the scene to every NUMA node of the pinned threads\n"
+        << "  --tile-size N      tile edge in pixels (16)\n"
+        << "  --progressive      render in passes with checkpoints and snapshots\n"
+        << "  --time-budget SECONDS  stop --progressive passes after this long, 0 for no limit (0)\n"
+        << "  --checkpoint PATH  --progressive checkpoint, resumed if it matches (render.checkpoint)\n"
+        << "  --snapshot PATH    --progressive snapshot image (snapshot.ppm)\n"
+        << "  --denoise          render AOVs and denoise the image\n"
+        << "  --stream           write the image band by band, in bounded memory\n"
+        << "  --format FORMAT    ppm, ppm16, pfm or raw (ppm)\n"
+        << "  --cost-maps PREFIX write time, ray and intersection test heatmaps and tile totals\n"
+        << "  --listen PORT      hand out tiles to workers on PORT (1-65535) instead of rendering\n"
+        << "  --connect HOST:PORT  render tiles for a coordinator\n"
+        << "  --help             show this message\n"
+        << "\n"
+        << "Workers have to be given the same scene and image options as the coordinator.\n";
+}
+
+namespace detail {
+    // Whole decimal numbers in [min, max] only, unlike std::stoi.
+    template <typename T>
+    bool parse_number(const std::string& text, T min, T max, T& value) {
+        errno = 0;
+        char* end = nullptr;
+        long long parsed = std::strtoll(text.c_str(), &end, 10);
+        if (text.empty() || *end != '\0' || errno != 0 || parsed < static_cast<long long>(min)
+                || parsed > static_cast<long long>(max)) {
+            return false;
+        }
+        value = static_cast<T>(parsed);
+        return true;
+    }
+
+    // Finite non-negative decimal numbers only, unlike std::stod.
+    bool parse_non_negative(const std::string& text, double& value) {
+        errno = 0;
+        char* end = nullptr;
+        double parsed = std::strtod(text.c_str(), &end);
+        if (text.empty() || *end != '\0' || errno != 0 || !std::isfinite(parsed) || parsed < 0.0) {
+            return false;
+        }
+        value = parsed;
+        return true;
+    }
+}
+
+// Returns nothing, after saying why, if the command line is not valid.
+std::optional<RenderConfig> parse_render_config(int argc, char** argv) {
+    RenderConfig config;
+    auto fail = [&](const std::string& message) -> std::optional<RenderConfig> {
+        std::cerr << message << std::endl;
+        print_render_usage(std::cerr, argv[0]);
+        return {};
+    };
+    const int max_int = std::numeric_limits<int>::max();
+    const std::string value_options[] = {
+        "--width", "--height", "--samples", "--max-depth", "--seed", "--scene", "--threads", "--tile-size",
+        "--format", "--cost-maps", "--listen", "--connect", "--time-budget", "--checkpoint", "--snapshot", "--accel", "--sample-sequence", "--min-samples",
+        "--max-samples", "--noise-threshold"};
+    for (int i = 1; i < argc; i++) {
+        std::string arg = argv[i];
+        bool has_value = i + 1 < argc;
+        std::string value = has_value ? argv[i + 1] : "";
+        bool valid = true;
+        if (arg == "--help" || arg == "-h") {
+            config.show_help = true;
+            continue;
+        } else if (arg == "--no-light-sampling") {
+            config.sample_lights = false;
+            continue;
+        } else if (arg == "--adaptive") {
+            config.adaptive_sampling.enabled = true;
+            continue;
+        } else if (arg == "--pin") {
+            config.pin_threads = true;
+            continue;
+        } else if (arg == "--numa-replicas") {
+            config.numa_replicas = true;
+            continue;
+        } else if (arg == "--progressive") {
+            config.progressive = true;
+            continue;
+        } else if (arg == "--denoise") {
+            config.denoise = true;
+            continue;
+        } else if (arg == "--stream") {
+            config.stream = true;
+            continue;
+        } else if (arg.rfind("-", 0) != 0) {
+            // A bare argument is a scene file, as before the options existed.
+            config.scene = arg;
+            continue;
+        } else if (std::find(std::begin(value_options), std::end(value_options), arg) == std::end(value_options)) {
+            return fail("Unknown option " + arg);
+        } else if (!has_value) {
+            return fail("Missing value after " + arg);
+        } else if (arg == "--width") {
+            valid = detail::parse_number(value, 2, max_int, config.image_width);
+        } else if (arg == "--height") {
+            valid = detail::parse_number(value, 2, max_int, config.image_height);
+        } else if (arg == "--samples") {
+            valid = detail::parse_number(value, 1, max_int, config.samples_per_pixel);
+        } else if (arg == "--max-depth") {
+            valid = detail::parse_number(value, 1, max_int, config.max_ray_bounce_depth);
+        } else if (arg == "--seed") {
+            valid = detail::parse_number<uint64_t>(value, 0, std::numeric_limits<int64_t>::max(), config.seed);
+        } else if (arg == "--scene") {
+            config.scene = value;
+        } else if (arg == "--format") {
+            const std::pair<const char*, ImageFormat> formats[] = {
+                {"ppm", ImageFormat::ppm}, {"ppm16", ImageFormat::ppm16}, {"pfm", ImageFormat::pfm},
+                {"raw", ImageFormat::raw}};
+            auto format = std::find_if(std::begin(formats), std::end(formats), [&](const auto& entry) {
+                return value == entry.first;
+            });
+            valid = format != std::end(formats);
+            config.output_format = valid ? format->second : config.output_format;
+        } else if (arg == "--accel") {
+            valid = value == "bvh" || value == "linear";
+            config.use_bvh = value != "linear";
+        } else if (arg == "--sample-sequence") {
+            const std::pair<const char*, SampleSequence> sequences[] = {
+                {"independent", SampleSequence::independent}, {"sobol", SampleSequence::sobol},
+                {"blue_noise", SampleSequence::blue_noise}};
+            auto sequence = std::find_if(std::begin(sequences), std::end(sequences), [&](const auto& entry) {
+                return value == entry.first;
+            });
+            valid = sequence != std::end(sequences);
+            config.sample_sequence = valid ? sequence->second : config.sample_sequence;
+        } else if (arg == "--min-samples") {
+            valid = detail::parse_number(value, 1, max_int, config.adaptive_sampling.min_samples);
+        } else if (arg == "--max-samples") {
+            valid = detail::parse_number(value, 1, max_int, config.adaptive_sampling.max_samples);
+        } else if (arg == "--noise-threshold") {
+            valid = detail::parse_non_negative(value, config.adaptive_sampling.noise_threshold);
+        } else if (arg == "--time-budget") {
+            valid = detail::parse_non_negative(value, config.time_budget_seconds);
+        } else if (arg == "--checkpoint") {
+            config.checkpoint_path = value;
+        } else if (arg == "--snapshot") {
+            config.snapshot_path = value;
+        } else if (arg == "--cost-maps") {
+            config.cost_maps_prefix = value;
+        } else if (arg == "--threads") {
+            valid = detail::parse_number(value, 0, 4096, config.threads);
+        } else if (arg == "--tile-size") {
+            valid = detail::parse_number(value, 1, 4096, config.tile_size);
+        } else if (arg == "--listen") {
+            uint16_t port = 0;
+            valid = detail::parse_number<uint16_t>(value, 1, 65535, port);
+            config.listen_port = port;
+        } else if (arg == "--connect") {
+            std::size_t colon = value.rfind(':');
+            valid = colon != std::string::npos && colon > 0
+                && detail::parse_number<uint16_t>(value.substr(colon + 1), 1, 65535, config.coordinator_port);
+            config.coordinator_host = value.substr(0, colon);
+        }
+        if (!valid) {
+            return fail("Invalid value " + value + " for " + arg);
+        }
+        i++;
+    }
+    if (config.image_height == 0) {
+        config.image_height = std::max(2, static_cast<int>(config.image_width / (16.0 / 9.0)));
+    }
+    const char* built_in_scenes[] = {"random", "three_spheres", "two_spheres", "lit_room"};
+    bool built_in_scene =
+        std::find(std::begin(built_in_scenes), std::end(built_in_scenes), config.scene) != std::end(built_in_scenes);
+    if (!config.use_bvh && !built_in_scene) {
+        return fail("--accel linear needs a built-in scene, scene files come with their BVH");
+    }
+    if (config.adaptive_sampling.enabled && config.progressive) {
+        return fail("--adaptive does not apply to --progressive, which gives every pixel the same samples");
+    }
+    if (config.adaptive_sampling.min_samples > config.adaptive_sampling.max_samples) {
+        return fail("--min-samples is above --max-samples");
+    }
+    if (config.listen_port && !config.coordinator_host.empty()) {
+        return fail("--listen and --connect exclude each other");
+    }
+    if (config.denoise && config.progressive) {
+        return fail("--denoise needs AOVs, which --progressive passes do not record");
+    }
+    if (!config.cost_maps_prefix.empty() && (config.progressive || config.listen_port)) {
+        return fail("--cost-maps needs a local render without --progressive");
+    }
+    if (config.stream && (config.progressive || config.denoise || config.listen_port || !config.cost_maps_prefix.empty())) {
+        return fail("--stream works without --progressive, --denoise, --listen and --cost-maps");
+    }
+    return config;
+}
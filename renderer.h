@@ -1,10 +1,54 @@
 #pragma once
 
+#include <algorithm>
+#include <cmath>
+#include <vector>
+
 #include "common.h"
 #include "camera.h"
 #include "ray.h"
 #include "vec3.h"
 #include "engine.h"
+#include "wavefront.h"
+
+// When enabled, every pixel takes at least `min_samples` and then stops as soon as the
+// estimated noise of its mean drops below `noise_threshold`, or at `max_samples`.
+// The noise is the standard error of the pixel luminance, measured after the gamma 2
+// output transform, so the threshold is in display units (1/255 is one 8-bit step).
+struct AdaptiveSamplingOptions {
+    bool enabled = false;
+    int min_samples = 16;
+    int max_samples = 1024;
+    double noise_threshold = 0.004;
+};
+
+struct PixelSample {
+    Vec3 color;
+    int sample_count;
+    uint64_t rays_traced;
+};
+
+// One sample of one pixel.
+struct SampleIndex {
+    int row;
+    int col;
+    int sample;
+};
+
+// Auxiliary values of a pixel: the first-hit values averaged over its samples, and the
+// variance of the pixel's mean luminance, which tells the denoiser how noisy it is.
+struct PixelAovs {
+    Vec3 albedo;
+    Vec3 normal;
+    double depth = 0.0;
+    double variance = 0.0;
+};
+
+namespace detail {
+    inline double luminance(const Vec3& color) {
+        return 0.2126 * color[0] + 0.7152 * color[1] + 0.0722 * color[2];
+    }
+}
 
 class Renderer {
 public:
@@ -14,40 +58,300 @@ public:
         int image_width,
         int image_height,
         int samples_per_pixel, 
-        int max_ray_bounce_depth) 
+        int max_ray_bounce_depth,
+        uint64_t seed = 0,
+        const EngineOptions& engine_options = {},
+        const AdaptiveSamplingOptions& adaptive_sampling = {},
+        SampleSequence sample_sequence = SampleSequence::independent)
     : world_{world}
     , camera_{camera}
     , image_width_{image_width}
     , image_height_{image_height}
     , samples_per_pixel_{samples_per_pixel}
-    , max_ray_bounce_depth_{max_ray_bounce_depth} {}
+    , max_ray_bounce_depth_{max_ray_bounce_depth}
+    , seed_{seed}
+    , engine_options_{engine_options}
+    , adaptive_sampling_{adaptive_sampling}
+    , sample_sequence_{sample_sequence} {}
+
+    // The same render settings over another copy of the world, such as a replica on
+    // another NUMA node. Both give the same image.
+    Renderer(const Renderer& other, const World& world)
+    : world_{world}
+    , camera_{other.camera_}
+    , image_width_{other.image_width_}
+    , image_height_{other.image_height_}
+    , samples_per_pixel_{other.samples_per_pixel_}
+    , max_ray_bounce_depth_{other.max_ray_bounce_depth_}
+    , seed_{other.seed_}
+    , engine_options_{other.engine_options_}
+    , adaptive_sampling_{other.adaptive_sampling_}
+    , sample_sequence_{other.sample_sequence_} {}
 
     Vec3 color_at(int row, int col) const {
-        Engine engine{};
+        return render_pixel(row, col).color;
+    }
+
+    // Also fills `aovs`, if given.
+    PixelSample render_pixel(int row, int col, PixelAovs* aovs = nullptr) const {
+        if (adaptive_sampling_.enabled) {
+            return render_pixel_adaptive(row, col, aovs);
+        }
+        Engine engine{engine_options_};
+        AovAccumulator aov_accumulator{aovs};
         Vec3 pixel_color{0, 0, 0};
         for (int s = 0; s < samples_per_pixel_; s++) {
-            double u = (double(col) + random_double()) / (image_width_ - 1);
-            double v = (double(row) + random_double()) / (image_height_ - 1);
-            Ray ray = camera_.ray_at(u, v);
-            pixel_color += engine.ray_color(ray, world_, max_ray_bounce_depth_);
+            Vec3 color = sample(engine, row, col, s, aov_accumulator.next());
+            aov_accumulator.add(color);
+            pixel_color += color;
         }
         pixel_color /= samples_per_pixel_;
-        return pixel_color;
+        aov_accumulator.finish(samples_per_pixel_);
+        return {pixel_color, samples_per_pixel_, engine.rays_traced()};
+    }
+
+    // Traces the sample with the given index through the pixel.
+    Vec3 sample(Engine& engine, int row, int col, int sample_index, FirstHit* first_hit = nullptr) const {
+        PathStart start = start_path(row, col, sample_index);
+        return engine.ray_color(start.ray, world_, max_ray_bounce_depth_, start.sampler, first_hit);
+    }
+
+    // Traces the samples together, and writes the color of the i-th to `colors[i]` and its
+    // first hit to `first_hits[i]` if given. The colors are those sample() gives.
+    void trace_samples(
+            WavefrontEngine& engine, const std::vector<SampleIndex>& samples, Vec3* colors,
+            FirstHit* first_hits = nullptr) const {
+        auto start = [&](std::size_t i) {
+            return start_path(samples[i].row, samples[i].col, samples[i].sample);
+        };
+        engine.trace(world_, max_ray_bounce_depth_, samples.size(), start, colors, first_hits);
+    }
+
+    // Renders the pixels of rows [first_row, last_row] and columns [first_col, last_col],
+    // row by row into `pixels` and `aovs` if given, with the samples of all of them traced
+    // together by a WavefrontEngine. The pixels are the ones render_pixel() gives; their
+    // rays are only counted for the whole block, which returns them.
+    uint64_t render_block(
+            int first_row, int last_row, int first_col, int last_col, std::vector<PixelSample>& pixels,
+            std::vector<PixelAovs>* aovs = nullptr) const {
+        const int width = last_col - first_col + 1;
+        const std::size_t count = std::size_t(width) * (last_row - first_row + 1);
+        pixels.assign(count, PixelSample{});
+        if (aovs) {
+            aovs->resize(count);
+        }
+        std::vector<AovAccumulator> aov_accumulators;
+        std::vector<NoiseEstimate> noise(count);
+        aov_accumulators.reserve(count);
+        for (std::size_t p = 0; p < count; p++) {
+            aov_accumulators.emplace_back(aovs ? &(*aovs)[p] : nullptr);
+        }
+
+        // Every pixel takes its first samples at once. With adaptive sampling, the pixels
+        // that have not converged then take one more sample per round, which checks them
+        // after every sample just like render_pixel_adaptive().
+        WavefrontEngine engine{engine_options_};
+        std::vector<uint32_t> active(count);
+        for (std::size_t p = 0; p < count; p++) {
+            active[p] = p;
+        }
+        int round_samples = adaptive_sampling_.enabled
+            ? std::min(adaptive_sampling_.min_samples, adaptive_sampling_.max_samples)
+            : samples_per_pixel_;
+        std::vector<SampleIndex> samples;
+        std::vector<Vec3> colors;
+        std::vector<FirstHit> first_hits;
+        while (!active.empty() && round_samples > 0) {
+            samples.clear();
+            for (uint32_t p : active) {
+                for (int s = pixels[p].sample_count; s < pixels[p].sample_count + round_samples; s++) {
+                    samples.push_back({first_row + int(p) / width, first_col + int(p) % width, s});
+                }
+            }
+            colors.resize(samples.size());
+            first_hits.resize(aovs ? samples.size() : 0);
+            trace_samples(engine, samples, colors.data(), aovs ? first_hits.data() : nullptr);
+
+            std::size_t i = 0;
+            std::size_t still_active = 0;
+            for (uint32_t p : active) {
+                for (int s = 0; s < round_samples; s++, i++) {
+                    if (aovs) {
+                        *aov_accumulators[p].next() = first_hits[i];
+                    }
+                    aov_accumulators[p].add(colors[i]);
+                    noise[p].add(colors[i]);
+                    pixels[p].color += colors[i];
+                    pixels[p].sample_count++;
+                }
+                if (adaptive_sampling_.enabled && pixels[p].sample_count < adaptive_sampling_.max_samples
+                        && !noise[p].is_converged(adaptive_sampling_)) {
+                    active[still_active++] = p;
+                }
+            }
+            active.resize(still_active);
+            round_samples = 1;
+        }
+
+        for (std::size_t p = 0; p < count; p++) {
+            pixels[p].color /= pixels[p].sample_count;
+            aov_accumulators[p].finish(pixels[p].sample_count);
+        }
+        return engine.rays_traced();
+    }
+
+    const EngineOptions& engine_options() const {
+        return engine_options_;
+    }
+
+    const AdaptiveSamplingOptions& adaptive_sampling() const {
+        return adaptive_sampling_;
+    }
+
+    uint64_t seed() const {
+        return seed_;
+    }
+
+    SampleSequence sample_sequence() const {
+        return sample_sequence_;
     }
 
     int image_height() const {
         return image_height_;
     }
 
+    int samples_per_pixel() const {
+        return samples_per_pixel_;
+    }
+
+    int max_ray_bounce_depth() const {
+        return max_ray_bounce_depth_;
+    }
+
+    const Camera& camera() const {
+        return camera_;
+    }
+
+    const World& world() const {
+        return world_;
+    }
+
     int image_width() const {
         return image_width_;
     }
 
 private:
+    // Sums the first-hit values of the samples into the pixel AOVs and averages them at the
+    // end. Without a destination it does nothing and the engine skips recording them.
+    class AovAccumulator {
+    public:
+        explicit AovAccumulator(PixelAovs* aovs) : aovs_{aovs} {
+            if (aovs_) {
+                *aovs_ = PixelAovs{};
+            }
+        }
+
+        FirstHit* next() {
+            return aovs_ ? &sample_ : nullptr;
+        }
+
+        void add(const Vec3& color) {
+            if (aovs_) {
+                aovs_->albedo += sample_.albedo;
+                aovs_->normal += sample_.normal;
+                aovs_->depth += sample_.distance;
+                double value = detail::luminance(color);
+                luminance_sum_ += value;
+                squared_luminance_sum_ += value * value;
+            }
+        }
+
+        void finish(int sample_count) {
+            if (aovs_) {
+                aovs_->albedo /= sample_count;
+                aovs_->normal /= sample_count;
+                aovs_->depth /= sample_count;
+                double mean = luminance_sum_ / sample_count;
+                double variance = std::max(0.0, squared_luminance_sum_ / sample_count - mean * mean);
+                aovs_->variance = sample_count > 1 ? variance / (sample_count - 1) : variance;
+            }
+        }
+
+    private:
+        PixelAovs* aovs_;
+        FirstHit sample_;
+        double luminance_sum_ = 0.0;
+        double squared_luminance_sum_ = 0.0;
+    };
+
+    // Welford's running mean and sum of squared deviations of the pixel luminance, which
+    // tell when adaptive sampling can stop.
+    class NoiseEstimate {
+    public:
+        void add(const Vec3& color) {
+            n_++;
+            double value = detail::luminance(color);
+            double delta = value - mean_;
+            mean_ += delta / n_;
+            squared_deviations_ += delta * (value - mean_);
+        }
+
+        bool is_converged(const AdaptiveSamplingOptions& options) const {
+            if (n_ < options.min_samples) {
+                return false;
+            }
+            double standard_error = std::sqrt(squared_deviations_ / (n_ - 1) / n_);
+            // d(sqrt(L)) = dL / (2 sqrt(L)): the error as it shows up after gamma correction.
+            double display_error = standard_error / (2.0 * std::sqrt(std::max(mean_, 1e-4)));
+            return display_error <= options.noise_threshold;
+        }
+
+    private:
+        double mean_ = 0.0;
+        double squared_deviations_ = 0.0;
+        int n_ = 0;
+    };
+
+    // The camera ray through a jittered point of the pixel.
+    PathStart start_path(int row, int col, int sample_index) const {
+        // Every sample gets its own stream, so the image does not depend on scheduling.
+        // The jitter takes dimensions 0 and 1, the lens 2 and 3.
+        Sampler sampler{seed_, row, col, sample_index, sample_sequence_};
+        double u = (double(col) + random_double(sampler)) / (image_width_ - 1);
+        double v = (double(row) + random_double(sampler)) / (image_height_ - 1);
+        Ray ray = camera_.ray_at(u, v, sampler);
+        return {ray, sampler};
+    }
+
+    PixelSample render_pixel_adaptive(int row, int col, PixelAovs* aovs) const {
+        Engine engine{engine_options_};
+        AovAccumulator aov_accumulator{aovs};
+        NoiseEstimate noise;
+        Vec3 pixel_color{0, 0, 0};
+        int n = 0;
+        while (n < adaptive_sampling_.max_samples) {
+            Vec3 color = sample(engine, row, col, n, aov_accumulator.next());
+            aov_accumulator.add(color);
+            noise.add(color);
+            pixel_color += color;
+            n++;
+            if (noise.is_converged(adaptive_sampling_)) {
+                break;
+            }
+        }
+        pixel_color /= n;
+        aov_accumulator.finish(n);
+        return {pixel_color, n, engine.rays_traced()};
+    }
+
     const World& world_;
     const Camera& camera_;
     int image_width_;
     int image_height_;
     int samples_per_pixel_;
     int max_ray_bounce_depth_;
+    uint64_t seed_;
+    EngineOptions engine_options_;
+    AdaptiveSamplingOptions adaptive_sampling_;
+    SampleSequence sample_sequence_;
 };
\ No newline at end of file
@@ -0,0 +1,275 @@
+#pragma once
+
+#include <algorithm>
+#include <array>
+#include <cmath>
+#include <cstdint>
+#include <vector>
+
+namespace detail {
+    // SplitMix64 finalizer, used to turn structured seeds (pixel, sample) into well mixed state.
+    constexpr uint64_t mix_bits(uint64_t x) {
+        x += 0x9e3779b97f4a7c15ull;
+        x = (x ^ (x >> 30)) * 0xbf58476d1ce4e5b9ull;
+        x = (x ^ (x >> 27)) * 0x94d049bb133111ebull;
+        return x ^ (x >> 31);
+    }
+}
+
+// PCG32 (XSH-RR variant): 64 bits of state, 32 bits of output per step.
+class Pcg32 {
+public:
+    constexpr Pcg32(uint64_t seed, uint64_t stream) : state_{0}, increment_{(stream << 1) | 1} {
+        next_uint();
+        state_ += seed;
+        next_uint();
+    }
+
+    constexpr uint32_t next_uint() {
+        uint64_t old_state = state_;
+        state_ = old_state * 6364136223846793005ull + increment_;
+        uint32_t xor_shifted = static_cast<uint32_t>(((old_state >> 18) ^ old_state) >> 27);
+        uint32_t rotation = static_cast<uint32_t>(old_state >> 59);
+        return (xor_shifted >> rotation) | (xor_shifted << ((32 - rotation) & 31));
+    }
+
+private:
+    uint64_t state_;
+    uint64_t increment_;
+};
+
+// Building blocks of the low-discrepancy samplers: a 2D Sobol sequence, hash-based Owen
+// scrambling (Burley, "Practical Hash-based Owen Scrambling", 2020) and a blue-noise
+// dither mask.
+namespace detail {
+    constexpr uint32_t reverse_bits(uint32_t x) {
+        x = ((x >> 1) & 0x55555555u) | ((x & 0x55555555u) << 1);
+        x = ((x >> 2) & 0x33333333u) | ((x & 0x33333333u) << 2);
+        x = ((x >> 4) & 0x0f0f0f0fu) | ((x & 0x0f0f0f0fu) << 4);
+        x = ((x >> 8) & 0x00ff00ffu) | ((x & 0x00ff00ffu) << 8);
+        return (x >> 16) | (x << 16);
+    }
+
+    // Second Sobol dimension of every byte value at every byte position. The sequence is
+    // linear over GF(2), so a point is the xor of the entries of its index bytes.
+    constexpr std::array<std::array<uint32_t, 256>, 4> make_sobol_tables() {
+        std::array<std::array<uint32_t, 256>, 4> tables{};
+        uint32_t directions[32] = {};
+        uint32_t v = 1u << 31;
+        for (int bit = 0; bit < 32; bit++, v ^= v >> 1) {
+            directions[bit] = v;
+        }
+        for (int byte = 0; byte < 4; byte++) {
+            for (uint32_t value = 0; value < 256; value++) {
+                for (int bit = 0; bit < 8; bit++) {
+                    if ((value >> bit) & 1) {
+                        tables[byte][value] ^= directions[8 * byte + bit];
+                    }
+                }
+            }
+        }
+        return tables;
+    }
+
+    constexpr std::array<std::array<uint32_t, 256>, 4> sobol_tables = make_sobol_tables();
+
+    // First two dimensions of the Sobol sequence, as 32-bit fixed point fractions.
+    constexpr uint32_t sobol(uint32_t index, int dimension) {
+        if (dimension == 0) {
+            return reverse_bits(index);
+        }
+        return sobol_tables[0][index & 0xff] ^ sobol_tables[1][(index >> 8) & 0xff]
+            ^ sobol_tables[2][(index >> 16) & 0xff] ^ sobol_tables[3][index >> 24];
+    }
+
+    // Laine-Karras style permutation: every bit only depends on the bits below it.
+    constexpr uint32_t laine_karras_permutation(uint32_t x, uint32_t seed) {
+        x += seed;
+        x ^= x * 0x6c50b47cu;
+        x ^= x * 0xb82f1e52u;
+        x ^= x * 0xc7afe638u;
+        x ^= x * 0x8d22f6e6u;
+        return x;
+    }
+
+    // Owen scrambling of a fixed point fraction: flips every bit depending on the bits above it.
+    constexpr uint32_t nested_uniform_scramble(uint32_t x, uint32_t seed) {
+        return reverse_bits(laine_karras_permutation(reverse_bits(x), seed));
+    }
+
+    // Dimensions are taken in pairs, each pair is a 2D Sobol sequence with its own shuffle
+    // and scramble. Pairs do not correlate and there is no limit on the number of dimensions.
+    constexpr std::array<uint32_t, 2> owen_scrambled_sobol(uint32_t index, int pair, uint64_t seed) {
+        uint64_t pair_seed = mix_bits(seed ^ mix_bits(pair));
+        uint32_t shuffled_index = nested_uniform_scramble(index, static_cast<uint32_t>(pair_seed));
+        uint32_t value_seed = static_cast<uint32_t>(pair_seed >> 32);
+        return {
+            nested_uniform_scramble(sobol(shuffled_index, 0), value_seed),
+            nested_uniform_scramble(sobol(shuffled_index, 1), value_seed + 1)};
+    }
+
+    constexpr int blue_noise_size = 64;
+
+    // Ranks the cells of a toroidal blue_noise_size^2 grid with the void-and-cluster method
+    // (Ulichney 1993): cells are taken one at a time, always from the largest void. The
+    // rank, scaled to 32-bit fixed point, gives a dither mask with blue-noise spectrum.
+    std::vector<uint32_t> make_blue_noise_mask() {
+        const int size = blue_noise_size;
+        const int cells = size * size;
+        const double sigma = 1.9;
+        std::vector<double> kernel(cells);
+        for (int dy = 0; dy < size; dy++) {
+            for (int dx = 0; dx < size; dx++) {
+                int x = std::min(dx, size - dx);
+                int y = std::min(dy, size - dy);
+                kernel[dy * size + dx] = std::exp(-(x * x + y * y) / (2.0 * sigma * sigma));
+            }
+        }
+
+        std::vector<double> energy(cells, 0.0);
+        std::vector<bool> taken(cells, false);
+        std::vector<uint32_t> mask(cells);
+        for (int rank = 0; rank < cells; rank++) {
+            int best = -1;
+            for (int cell = 0; cell < cells; cell++) {
+                if (!taken[cell] && (best < 0 || energy[cell] < energy[best])) {
+                    best = cell;
+                }
+            }
+            taken[best] = true;
+            mask[best] = static_cast<uint32_t>((rank + 0.5) / cells * 0x1p32);
+            int best_x = best % size;
+            int best_y = best / size;
+            for (int y = 0; y < size; y++) {
+                int dy = (y - best_y + size) % size;
+                for (int x = 0; x < size; x++) {
+                    int dx = (x - best_x + size) % size;
+                    energy[y * size + x] += kernel[dy * size + dx];
+                }
+            }
+        }
+        return mask;
+    }
+
+    inline const std::vector<uint32_t>& blue_noise_mask() {
+        static const std::vector<uint32_t> mask = make_blue_noise_mask();
+        return mask;
+    }
+}
+
+// Where the numbers of a Sampler come from.
+enum class SampleSequence {
+    // Independent uniform random numbers.
+    independent,
+    // Owen-scrambled Sobol points, scrambled differently in every pixel.
+    sobol,
+    // One Owen-scrambled Sobol sequence shared by all pixels, each pixel shifted by a
+    // blue-noise dither mask (Georgiev and Fajardo 2016). The error left at a given sample
+    // count is spread as blue noise over the image, which looks less noisy and denoises well.
+    blue_noise,
+};
+
+const char* to_debug(SampleSequence sequence) {
+    switch (sequence) {
+        case SampleSequence::independent:
+            return "independent";
+        case SampleSequence::sobol:
+            return "sobol";
+        case SampleSequence::blue_noise:
+            return "blue_noise";
+    }
+    return "unknown";
+}
+
+// Source of random numbers for one path. It is owned by the caller and passed down
+// explicitly, so there is no shared state between threads. Seeding from the pixel and the
+// sample index makes every sample independent of which thread renders it and when.
+//
+// Every number comes from a dimension of the sample. Dimensions 0-3 are the pixel jitter
+// and the lens, then every bounce starts at its own `bounce_dimension` (and samples
+// lights at its `light_dimension`). With the
+// low-discrepancy sequences a dimension has to mean the same thing in every sample,
+// so code drawing a varying count of numbers should call `start_dimension` first.
+class Sampler {
+public:
+    static constexpr int dimensions_per_bounce = 4;
+    // Offset of the Russian roulette decision within the dimensions of a bounce.
+    static constexpr int russian_roulette_dimension = 3;
+
+    static constexpr int bounce_dimension(int bounce) {
+        return 4 + bounce * dimensions_per_bounce;
+    }
+
+    // Sampling a light at a bounce takes a light (first dimension) and a point on it (third
+    // and fourth, one pair). These come from a range of their own, past any bounce a path
+    // reaches, so scenes without lights draw the same numbers as before lights existed.
+    static constexpr int dimensions_per_light_sample = 4;
+
+    static constexpr int light_dimension(int bounce) {
+        return (1 << 24) + bounce * dimensions_per_light_sample;
+    }
+
+    explicit constexpr Sampler(uint64_t seed) : generator_{detail::mix_bits(seed), 0} {}
+
+    constexpr Sampler(
+            uint64_t seed, int row, int col, int sample_index,
+            SampleSequence sequence = SampleSequence::independent)
+        : generator_{
+            detail::mix_bits(seed ^ detail::mix_bits(sample_index)),
+            detail::mix_bits((static_cast<uint64_t>(row) << 32) | static_cast<uint32_t>(col))}
+        , sequence_{sequence}
+        , sample_index_{static_cast<uint32_t>(sample_index)}
+        , row_{row}
+        , col_{col}
+        , scramble_seed_{sequence == SampleSequence::sobol
+            ? detail::mix_bits(seed ^ detail::mix_bits((static_cast<uint64_t>(row) << 32) | static_cast<uint32_t>(col)))
+            : detail::mix_bits(seed)} {}
+
+    SampleSequence sequence() const {
+        return sequence_;
+    }
+
+    void start_dimension(int dimension) {
+        dimension_ = dimension;
+    }
+
+    // Returns a random real in [0, 1).
+    double next_double() {
+        int dimension = dimension_++;
+        if (sequence_ == SampleSequence::independent) {
+            return generator_.next_uint() * 0x1p-32;
+        }
+        if (dimension / 2 != pair_) {
+            start_pair(dimension / 2);
+        }
+        return pair_values_[dimension % 2] * 0x1p-32;
+    }
+
+private:
+    Pcg32 generator_;
+    SampleSequence sequence_ = SampleSequence::independent;
+    uint32_t sample_index_ = 0;
+    int row_ = 0;
+    int col_ = 0;
+    uint64_t scramble_seed_ = 0;
+    int dimension_ = 0;
+    // Both values of the current dimension pair are computed together.
+    int pair_ = -1;
+    std::array<uint32_t, 2> pair_values_ = {};
+
+    void start_pair(int pair) {
+        pair_ = pair;
+        pair_values_ = detail::owen_scrambled_sobol(sample_index_, pair, scramble_seed_);
+        if (sequence_ == SampleSequence::blue_noise) {
+            // A toroidal shift by the mask value, the mask is offset per dimension.
+            const std::vector<uint32_t>& mask = detail::blue_noise_mask();
+            const int wrap = detail::blue_noise_size - 1;
+            uint64_t offsets = detail::mix_bits(scramble_seed_ + pair);
+            for (int i = 0; i < 2; i++) {
+                int x = (col_ + static_cast<int>((offsets >> (24 * i)) & wrap)) & wrap;
+                int y = (row_ + static_cast<int>((offsets >> (24 * i + 12)) & wrap)) & wrap;
+                pair_values_[i] += mask[y * detail::blue_noise_size + x];
+            }
+        }
+    }
+};
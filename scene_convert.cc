@@ -0,0 +1,25 @@
+#include <iostream>
+#include <optional>
+
+#include "scene_file.h"
+#include "scene_text.h"
+
+// Converts a text scene description (see scene_text.h) to the binary scene format, with
+// the BVH built once here instead of on every load.
+int main(int argc, char** argv) {
+  if (argc != 3) {
+    std::cerr << "Usage: " << argv[0] << " INPUT.txt OUTPUT.scene" << std::endl;
+    return 1;
+  }
+  std::optional<Scene> scene = load_scene_text(argv[1]);
+  if (!scene) {
+    return 1;
+  }
+  scene->world.build_bvh();
+  if (!write_scene_file(argv[2], scene->world, scene->camera)) {
+    return 1;
+  }
+  std::cerr << "Wrote " << scene->world.spheres().size() << " spheres and " << scene->world.materials().size()
+            << " materials to " << argv[2] << std::endl;
+  return 0;
+}
@@ -0,0 +1,395 @@
+#pragma once
+
+#include <fcntl.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <unistd.h>
+
+#include <algorithm>
+#include <cstdint>
+#include <cstring>
+#include <fstream>
+#include <iostream>
+#include <optional>
+#include <string>
+#include <type_traits>
+#include <utility>
+#include <variant>
+#include <vector>
+
+#include "bvh.h"
+#include "camera.h"
+#include "material.h"
+#include "sphere_soa.h"
+#include "vec3.h"
+#include "world.h"
+
+// Camera placement stored with a scene. The aspect ratio belongs to the image, so the
+// camera itself is only made once that is known.
+struct SceneCamera {
+    Vec3 origin{13, 2, 3};
+    Vec3 look_at{0, 0, 0};
+    Vec3 view_up{0, 1, 0};
+    double vertical_fov_degrees = 45.0;
+    double aperture = 0.1;
+    double focus_distance = 10.0;
+
+    Camera camera(double aspect_ratio) const {
+        return Camera(origin, look_at, view_up, vertical_fov_degrees, aspect_ratio, aperture, focus_distance);
+    }
+};
+
+// Read-only mapping of a whole file, unmapped on destruction.
+class MappedFile {
+public:
+    MappedFile() {}
+
+    MappedFile(MappedFile&& other) noexcept
+        : data_{std::exchange(other.data_, nullptr)}, size_{std::exchange(other.size_, 0)} {}
+
+    MappedFile& operator=(MappedFile&& other) noexcept {
+        std::swap(data_, other.data_);
+        std::swap(size_, other.size_);
+        return *this;
+    }
+
+    ~MappedFile() {
+        if (data_) {
+            munmap(const_cast<char*>(data_), size_);
+        }
+    }
+
+    static std::optional<MappedFile> open(const std::string& path) {
+        int fd = ::open(path.c_str(), O_RDONLY);
+        if (fd < 0) {
+            std::cerr << "Could not open " << path << std::endl;
+            return {};
+        }
+        struct stat status;
+        if (fstat(fd, &status) != 0 || status.st_size == 0) {
+            std::cerr << "Could not read " << path << std::endl;
+            close(fd);
+            return {};
+        }
+        void* data = mmap(nullptr, status.st_size, PROT_READ, MAP_PRIVATE, fd, 0);
+        close(fd);
+        if (data == MAP_FAILED) {
+            std::cerr << "Could not map " << path << std::endl;
+            return {};
+        }
+        MappedFile file;
+        file.data_ = static_cast<const char*>(data);
+        file.size_ = status.st_size;
+        return file;
+    }
+
+    const char* data() const {
+        return data_;
+    }
+
+    std::size_t size() const {
+        return size_;
+    }
+
+private:
+    const char* data_ = nullptr;
+    std::size_t size_ = 0;
+};
+
+// A world with the camera it is meant to be seen through. A world loaded from a scene
+// file refers to the file's mapping, which is kept here and has to outlive it. The scene
+// can be moved but not copied; a copy of the world alone still points into the mapping.
+struct Scene {
+    MappedFile file;
+    World world;
+    SceneCamera camera;
+};
+
+// Binary scene layout, native byte order: a header followed by sections that each start
+// on a cache line. The sphere arrays are those of SphereSoA, padding included, in the
+// leaf order of the BVH nodes that follow them, so a loaded scene uses the file in place.
+namespace detail {
+    constexpr char scene_file_magic[8] = {'R', 'T', 'S', 'C', 'E', 'N', 'E', '\0'};
+    constexpr uint32_t scene_file_version = 2;
+    constexpr uint64_t scene_section_alignment = 64;
+
+    enum SceneSection {
+        materials_section,
+        sphere_xs_section,
+        sphere_ys_section,
+        sphere_zs_section,
+        sphere_radii_section,
+        sphere_material_ids_section,
+        bvh_nodes_section,
+        scene_section_count,
+    };
+
+    struct SceneSectionRange {
+        uint64_t offset;
+        uint64_t size;
+    };
+
+    // `kind` is the index of the alternative in `Material`.
+    struct MaterialRecord {
+        uint32_t kind;
+        uint32_t unused;
+        double values[4];
+    };
+
+    // How the writing build laid out the sections. They are used in place, so a build
+    // that would read them differently has to reject the file.
+    struct SceneFileLayout {
+        // 0x01020304 as written, which reads back differently in the other byte order.
+        uint32_t byte_order;
+        uint32_t scalar_size;
+        uint32_t bvh_node_size;
+        uint32_t material_record_size;
+
+        bool operator==(const SceneFileLayout& other) const {
+            return byte_order == other.byte_order && scalar_size == other.scalar_size
+                && bvh_node_size == other.bvh_node_size && material_record_size == other.material_record_size;
+        }
+    };
+
+    constexpr SceneFileLayout native_scene_file_layout = {
+        0x01020304, sizeof(Aabb::Point::Scalar), sizeof(BvhNode), sizeof(MaterialRecord)};
+
+    struct SceneFileHeader {
+        char magic[8];
+        uint32_t version;
+        uint32_t sphere_count;
+        SceneFileLayout layout;
+        // Origin, look-at point and view up, then field of view, aperture and focus distance.
+        double camera[12];
+        SceneSectionRange sections[scene_section_count];
+    };
+
+    static_assert(std::is_standard_layout_v<BvhNode> && sizeof(BvhNode) == 64);
+
+    struct MaterialRecordFn {
+        MaterialRecord operator () (const LambertianMaterial& material) const {
+            return {0, 0, {material.albedo[0], material.albedo[1], material.albedo[2], 0.0}};
+        }
+
+        MaterialRecord operator () (const MetalMaterial& material) const {
+            return {1, 0, {material.albedo[0], material.albedo[1], material.albedo[2], material.fuzz}};
+        }
+
+        MaterialRecord operator () (const DielectricMaterial& material) const {
+            return {2, 0, {material.refraction_index, 0.0, 0.0, 0.0}};
+        }
+
+        MaterialRecord operator () (const EmissiveMaterial& material) const {
+            return {3, 0, {material.emitted[0], material.emitted[1], material.emitted[2], 0.0}};
+        }
+    };
+
+    std::optional<Material> to_material(const MaterialRecord& record) {
+        const double* v = record.values;
+        switch (record.kind) {
+            case 0:
+                return LambertianMaterial{Vec3{v[0], v[1], v[2]}};
+            case 1:
+                return MetalMaterial{Vec3{v[0], v[1], v[2]}, v[3]};
+            case 2:
+                return DielectricMaterial{v[0]};
+            case 3:
+                return EmissiveMaterial{Vec3{v[0], v[1], v[2]}};
+        }
+        return {};
+    }
+
+    uint64_t align_section(uint64_t offset) {
+        return (offset + scene_section_alignment - 1) / scene_section_alignment * scene_section_alignment;
+    }
+
+    // One pass over the BVH nodes and sphere materials, so that nothing the renderer
+    // follows points outside the file: every leaf covers existing spheres, children come
+    // after their parent (so traversal ends) within the node array and no deeper than
+    // the traversal stack, and every sphere's material exists. Returns what is wrong, or
+    // nullptr.
+    const char* check_scene_contents(
+            const BvhNode* nodes, uint64_t node_count, const uint32_t* material_ids, uint64_t sphere_count,
+            uint64_t material_count) {
+        if (node_count == 0 && sphere_count > 0) {
+            return "spheres without a BVH";
+        }
+        std::vector<uint8_t> depths(node_count, 0);
+        for (uint64_t i = 0; i < node_count; i++) {
+            const BvhNode& node = nodes[i];
+            if (node.is_leaf()) {
+                if (uint64_t{node.offset} + node.count > sphere_count) {
+                    return "BVH leaf outside the sphere arrays";
+                }
+                continue;
+            }
+            if (node.offset <= i + 1 || node.offset >= node_count || node.axis > 2) {
+                return "corrupt BVH node";
+            }
+            if (depths[i] >= max_bvh_depth) {
+                return "BVH deeper than the traversal supports";
+            }
+            depths[i + 1] = std::max<uint8_t>(depths[i + 1], depths[i] + 1);
+            depths[node.offset] = std::max<uint8_t>(depths[node.offset], depths[i] + 1);
+        }
+        for (uint64_t i = 0; i < sphere_count; i++) {
+            if (material_ids[i] >= material_count) {
+                return "sphere material outside the material table";
+            }
+        }
+        return nullptr;
+    }
+}
+
+// Writes the camera, the material table, the spheres and their BVH. The world has to be
+// made of spheres only, with its BVH built.
+bool write_scene_file(std::ostream& out, const World& world, const SceneCamera& camera) {
+    if (!world.instances().empty()) {
+        std::cerr << "Scene files only hold spheres, not meshes or instances" << std::endl;
+        return false;
+    }
+    if (!world.bvh()) {
+        std::cerr << "Scene files need the BVH of the world, call build_bvh() first" << std::endl;
+        return false;
+    }
+    const SphereSoA& spheres = world.spheres();
+    const Bvh& bvh = *world.bvh();
+    const uint64_t padded_count = spheres.size() + SphereSoA::padding;
+
+    std::vector<detail::MaterialRecord> materials;
+    materials.reserve(world.materials().size());
+    for (const Material& material : world.materials()) {
+        materials.push_back(std::visit(detail::MaterialRecordFn{}, material));
+    }
+
+    // Sections in file order, with the address of their contents.
+    std::pair<const void*, uint64_t> contents[detail::scene_section_count] = {
+        {materials.data(), materials.size() * sizeof(detail::MaterialRecord)},
+        {spheres.xs(), padded_count * sizeof(double)},
+        {spheres.ys(), padded_count * sizeof(double)},
+        {spheres.zs(), padded_count * sizeof(double)},
+        {spheres.radii(), padded_count * sizeof(double)},
+        {spheres.material_ids(), padded_count * sizeof(uint32_t)},
+        {bvh.nodes().data(), bvh.nodes().size() * sizeof(BvhNode)},
+    };
+
+    detail::SceneFileHeader header = {};
+    std::memcpy(header.magic, detail::scene_file_magic, sizeof(header.magic));
+    header.version = detail::scene_file_version;
+    header.sphere_count = spheres.size();
+    header.layout = detail::native_scene_file_layout;
+    for (int axis = 0; axis < 3; axis++) {
+        header.camera[axis] = camera.origin[axis];
+        header.camera[3 + axis] = camera.look_at[axis];
+        header.camera[6 + axis] = camera.view_up[axis];
+    }
+    header.camera[9] = camera.vertical_fov_degrees;
+    header.camera[10] = camera.aperture;
+    header.camera[11] = camera.focus_distance;
+    uint64_t offset = sizeof(header);
+    for (int section = 0; section < detail::scene_section_count; section++) {
+        offset = detail::align_section(offset);
+        header.sections[section] = {offset, contents[section].second};
+        offset += contents[section].second;
+    }
+
+    out.write(reinterpret_cast<const char*>(&header), sizeof(header));
+    uint64_t written = sizeof(header);
+    const char zeros[detail::scene_section_alignment] = {};
+    for (int section = 0; section < detail::scene_section_count; section++) {
+        out.write(zeros, header.sections[section].offset - written);
+        out.write(static_cast<const char*>(contents[section].first), contents[section].second);
+        written = header.sections[section].offset + contents[section].second;
+    }
+    return static_cast<bool>(out);
+}
+
+bool write_scene_file(const std::string& path, const World& world, const SceneCamera& camera) {
+    std::ofstream out(path, std::ios::binary);
+    if (!out || !write_scene_file(out, world, camera)) {
+        std::cerr << "Could not write " << path << std::endl;
+        return false;
+    }
+    return true;
+}
+
+// Maps the file and uses its spheres and BVH in place; only the small material table is
+// converted. The header, the section bounds and everything in the sections that indexes
+// other data (see detail::check_scene_contents) are checked.
+std::optional<Scene> load_scene_file(const std::string& path) {
+    std::optional<MappedFile> file = MappedFile::open(path);
+    if (!file) {
+        return {};
+    }
+    auto fail = [&](const char* message) {
+        std::cerr << path << ": " << message << std::endl;
+        return std::optional<Scene>{};
+    };
+    detail::SceneFileHeader header;
+    if (file->size() < sizeof(header)) {
+        return fail("not a scene file");
+    }
+    std::memcpy(&header, file->data(), sizeof(header));
+    if (std::memcmp(header.magic, detail::scene_file_magic, sizeof(header.magic)) != 0) {
+        return fail("not a scene file");
+    }
+    if (header.version != detail::scene_file_version) {
+        return fail("unsupported scene file version");
+    }
+    if (!(header.layout == detail::native_scene_file_layout)) {
+        return fail("scene file written for another byte order or data layout");
+    }
+
+    const uint64_t padded_count = uint64_t{header.sphere_count} + SphereSoA::padding;
+    const uint64_t element_sizes[detail::scene_section_count] = {
+        sizeof(detail::MaterialRecord), sizeof(double), sizeof(double), sizeof(double), sizeof(double),
+        sizeof(uint32_t), sizeof(BvhNode)};
+    for (int section = 0; section < detail::scene_section_count; section++) {
+        const detail::SceneSectionRange& range = header.sections[section];
+        bool is_sphere_array = section >= detail::sphere_xs_section && section <= detail::sphere_material_ids_section;
+        if (range.offset % detail::scene_section_alignment != 0 || range.offset > file->size()
+                || range.size > file->size() - range.offset || range.size % element_sizes[section] != 0
+                || (is_sphere_array && range.size != padded_count * element_sizes[section])) {
+            return fail("corrupt section table");
+        }
+    }
+    auto section_data = [&](detail::SceneSection section) {
+        return file->data() + header.sections[section].offset;
+    };
+
+    Scene scene;
+    const double* c = header.camera;
+    scene.camera = {
+        Vec3{c[0], c[1], c[2]}, Vec3{c[3], c[4], c[5]}, Vec3{c[6], c[7], c[8]}, c[9], c[10], c[11]};
+
+    const auto* materials = reinterpret_cast<const detail::MaterialRecord*>(section_data(detail::materials_section));
+    uint64_t material_count = header.sections[detail::materials_section].size / sizeof(detail::MaterialRecord);
+    scene.world.reserve_materials(material_count);
+    for (uint64_t i = 0; i < material_count; i++) {
+        std::optional<Material> material = detail::to_material(materials[i]);
+        if (!material) {
+            return fail("unknown material kind");
+        }
+        scene.world.add_material(*material);
+    }
+
+    const auto* nodes = reinterpret_cast<const BvhNode*>(section_data(detail::bvh_nodes_section));
+    const uint64_t node_count = header.sections[detail::bvh_nodes_section].size / sizeof(BvhNode);
+    const auto* material_ids = reinterpret_cast<const uint32_t*>(section_data(detail::sphere_material_ids_section));
+    if (const char* error = detail::check_scene_contents(
+            nodes, node_count, material_ids, header.sphere_count, material_count)) {
+        return fail(error);
+    }
+
+    SphereSoA spheres = SphereSoA::view(
+        header.sphere_count,
+        reinterpret_cast<const double*>(section_data(detail::sphere_xs_section)),
+        reinterpret_cast<const double*>(section_data(detail::sphere_ys_section)),
+        reinterpret_cast<const double*>(section_data(detail::sphere_zs_section)),
+        reinterpret_cast<const double*>(section_data(detail::sphere_radii_section)),
+        material_ids);
+    Bvh bvh = Bvh::view(nodes, node_count);
+    scene.world.set_spheres(std::move(spheres), std::move(bvh));
+    scene.file = std::move(*file);
+    return scene;
+}
@@ -0,0 +1,135 @@
+#pragma once
+
+#include <fstream>
+#include <iostream>
+#include <map>
+#include <optional>
+#include <sstream>
+#include <string>
+
+#include "material.h"
+#include "scene_file.h"
+#include "sphere.h"
+#include "vec3.h"
+
+// Text scene description, one statement per line, `#` starting a comment:
+//
+//   camera <origin x y z> <look-at x y z> <view up x y z> <fov degrees> <aperture> <focus distance>
+//   material <name> lambertian <r g b>
+//   material <name> metal <r g b> <fuzz>
+//   material <name> dielectric <refraction index>
+//   material <name> emissive <r g b>
+//   sphere <center x y z> <radius> <material name>
+//
+// Materials have to be defined before the spheres that use them. Without a camera line
+// the scene is seen from the default SceneCamera.
+namespace detail {
+    std::istream& operator >> (std::istream& in, Vec3& v) {
+        return in >> v[0] >> v[1] >> v[2];
+    }
+
+    class SceneTextParser {
+    public:
+        Scene scene;
+        std::string error;
+
+        // Parses one line. Returns false on malformed input.
+        bool parse_line(const std::string& line) {
+            std::istringstream in(line.substr(0, line.find('#')));
+            std::string keyword;
+            if (!(in >> keyword)) {
+                return true;
+            }
+            if (keyword == "camera") {
+                SceneCamera& camera = scene.camera;
+                in >> camera.origin >> camera.look_at >> camera.view_up
+                    >> camera.vertical_fov_degrees >> camera.aperture >> camera.focus_distance;
+            } else if (keyword == "material") {
+                parse_material(in);
+            } else if (keyword == "sphere") {
+                parse_sphere(in);
+            } else {
+                error = "unknown statement " + keyword;
+                return false;
+            }
+            std::string rest;
+            if (error.empty() && (in.fail() || in >> rest)) {
+                error = "malformed " + keyword;
+            }
+            return error.empty();
+        }
+
+    private:
+        void parse_material(std::istream& in) {
+            std::string name;
+            std::string kind;
+            in >> name >> kind;
+            Material material;
+            if (kind == "lambertian") {
+                LambertianMaterial lambertian;
+                in >> lambertian.albedo;
+                material = lambertian;
+            } else if (kind == "metal") {
+                MetalMaterial metal;
+                in >> metal.albedo >> metal.fuzz;
+                material = metal;
+            } else if (kind == "dielectric") {
+                DielectricMaterial dielectric;
+                in >> dielectric.refraction_index;
+                material = dielectric;
+            } else if (kind == "emissive") {
+                EmissiveMaterial emissive;
+                in >> emissive.emitted;
+                material = emissive;
+            } else {
+                error = "unknown material kind " + kind;
+                return;
+            }
+            if (materials_.count(name)) {
+                error = "material " + name + " defined twice";
+                return;
+            }
+            materials_[name] = scene.world.add_material(material);
+        }
+
+        void parse_sphere(std::istream& in) {
+            Vec3 center;
+            double radius = 0.0;
+            std::string material;
+            in >> center >> radius >> material;
+            auto found = materials_.find(material);
+            if (in && found == materials_.end()) {
+                error = "undefined material " + material;
+                return;
+            }
+            if (in) {
+                scene.world.add(Sphere(std::move(center), radius), found->second);
+            }
+        }
+
+        std::map<std::string, MaterialId> materials_;
+    };
+}
+
+std::optional<Scene> parse_scene_text(std::istream& in) {
+    detail::SceneTextParser parser;
+    std::string line;
+    uint64_t line_number = 0;
+    while (std::getline(in, line)) {
+        line_number++;
+        if (!parser.parse_line(line)) {
+            std::cerr << "Scene line " << line_number << ": " << parser.error << std::endl;
+            return {};
+        }
+    }
+    return std::move(parser.scene);
+}
+
+std::optional<Scene> load_scene_text(const std::string& path) {
+    std::ifstream in(path);
+    if (!in) {
+        std::cerr << "Could not open " << path << std::endl;
+        return {};
+    }
+    return parse_scene_text(in);
+}
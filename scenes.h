@@ -0,0 +1,170 @@
+#pragma once
+
+#include <math.h>
+
+#include <memory>
+#include <optional>
+
+#include "common.h"
+#include "instance.h"
+#include "material.h"
+#include "sampler.h"
+#include "sphere.h"
+#include "sphere_set.h"
+#include "sphere_soa.h"
+#include "transform.h"
+#include "vec3.h"
+#include "world.h"
+
+// Unit vector with non-negative components, drawn by rejection in the positive octant as
+// the random scene always has been, so its colours and layout stay the same.
+Vec3 random_unit_color(Sampler& sampler) {
+  while (true) {
+    Vec3 u{random_double(sampler), random_double(sampler), random_double(sampler)};
+    if (u.length_squared() <= 1.0) {
+      return unit_vector(u);
+    }
+  }
+}
+
+Material choose_material(Sampler& sampler) {
+      double random_sample = random_double(sampler);
+      if (random_sample < 0.8) {
+        // Diffuse.
+        Vec3 albedo = random_unit_color(sampler) * random_unit_color(sampler);
+        return LambertianMaterial{albedo};
+      } else if (random_sample < 0.95) {
+        // Metal.
+        Vec3 albedo = random_vector(sampler, 0.5, 1);
+        double fuzz = random_double(sampler, 0, 0.5);
+        return MetalMaterial{albedo, fuzz};
+      } else {
+        // Glass.
+        return DielectricMaterial{.refraction_index = 1.5};
+      }
+}
+
+// Small spheres on a (2 * extent) x (2 * extent) grid around three big ones. The default
+// extent is the classic cover scene; larger ones generate big scenes for benchmarks.
+World random_world(Sampler& sampler, int extent = 11) {
+  World world;
+
+  // Add ground (a very large sphere).
+  Material ground_material = LambertianMaterial{Vec3(0.5, 0.5, 0.5)};
+  world.add(Sphere(Vec3(0, -1000, 0), 1000), ground_material);
+
+  for (int x = -extent; x < extent; x++) {
+    for (int z = -extent; z < extent; z++) {
+      Vec3 center{x + 0.9 * random_double(sampler), 0.2, z + 0.9 * random_double(sampler)};
+      double radius = 0.2;
+
+      if ((center - Vec3{4, 0.2, 0}).length() > 0.9) {
+        Material material = choose_material(sampler);
+        world.add(Sphere(std::move(center), radius), material);
+      }
+    }
+  }
+
+  world.add(Sphere({0, 1, 0}, 1.0), DielectricMaterial{1.5});
+  world.add(Sphere({-4, 1, 0}, 1.0), LambertianMaterial{Vec3{0.4, 0.2, 0.1}});
+  world.add(Sphere({4, 1, 0}, 1.0), MetalMaterial{{0.7, 0.6, 0.5}, 0.0});
+
+  return world;
+}
+
+// The random scene again, but every (tile x tile) block of small spheres is an instance of
+// one shared tile, turned by a multiple of 90 degrees. Some instances override the
+// materials of the tile with one of their own. The memory taken grows with the number of
+// instances, not with the number of spheres they show.
+World instanced_world(Sampler& sampler, int extent = 11, int tile = 4) {
+  World world;
+
+  // Add ground (a very large sphere).
+  Material ground_material = LambertianMaterial{Vec3(0.5, 0.5, 0.5)};
+  world.add(Sphere(Vec3(0, -1000, 0), 1000), ground_material);
+
+  // Spheres of the tile span [0, tile) along x and z.
+  SphereSoA tile_spheres;
+  for (int x = 0; x < tile; x++) {
+    for (int z = 0; z < tile; z++) {
+      Vec3 center{x + 0.9 * random_double(sampler), 0.2, z + 0.9 * random_double(sampler)};
+      tile_spheres.add(Sphere(std::move(center), 0.2), world.add_material(choose_material(sampler)));
+    }
+  }
+  auto geometry = std::make_shared<const InstanceGeometry>(SphereSet{std::move(tile_spheres)});
+
+  // Instances of a sphere set take their materials from it, this one is never used.
+  MaterialId unused_material = world.add_material(LambertianMaterial{ground_color});
+  Transform to_tile_center = Transform::translation({-0.5 * tile, 0, -0.5 * tile});
+  for (int x = -extent; x + tile <= extent; x += tile) {
+    for (int z = -extent; z + tile <= extent; z += tile) {
+      int quarter_turns = static_cast<int>(4 * random_double(sampler)) % 4;
+      Transform object_to_world = Transform::translation({x + 0.5 * tile, 0, z + 0.5 * tile})
+          * Transform::rotation({0, 1, 0}, 90.0 * quarter_turns) * to_tile_center;
+      std::optional<MaterialId> material;
+      if (random_double(sampler) < 0.1) {
+        material = world.add_material(choose_material(sampler));
+      }
+      world.add(Instance{geometry, object_to_world, material}, unused_material);
+    }
+  }
+
+  world.add(Sphere({0, 1, 0}, 1.0), DielectricMaterial{1.5});
+  world.add(Sphere({-4, 1, 0}, 1.0), LambertianMaterial{Vec3{0.4, 0.2, 0.1}});
+  world.add(Sphere({4, 1, 0}, 1.0), MetalMaterial{{0.7, 0.6, 0.5}, 0.0});
+
+  return world;
+}
+
+World three_spheres_world() {
+  // Materials
+  constexpr Vec3 center_color(0.7, 0.3, 0.3);
+  constexpr Vec3 right_color(0.8, 0.6, 0.2);
+
+  World world;
+  MaterialId material_ground = world.add_material(LambertianMaterial{ground_color});
+  MaterialId material_center = world.add_material(LambertianMaterial{center_color});
+  MaterialId material_left = world.add_material(DielectricMaterial{1.5});
+  MaterialId material_right = world.add_material(MetalMaterial{right_color, 0.5});
+
+  world.add(Sphere({0, -100.5, -1}, 100), material_ground);
+  world.add(Sphere({0, 0, -1}, 0.5), material_center);
+  world.add(Sphere({-1, 0, -1}, 0.5), material_left);
+  world.add(Sphere({-1, -0, -1}, -0.4), material_left);
+  world.add(Sphere({1, 0, -1}, 0.5), material_right);
+  return world;
+}
+
+World two_spheres_world() {
+  constexpr Material lambertian_blue = LambertianMaterial{pure_blue_color};
+  constexpr Material lambertian_red = LambertianMaterial{pure_red_color};
+
+  const double R = cos(PI / 4.0);
+  World world;
+  world.add(Sphere({-R, 0, -1}, R), lambertian_blue);
+  world.add(Sphere({R, 0, -1}, R), lambertian_red);
+  return world;
+}
+
+// A closed room, its walls the insides of huge spheres, lit only by one small light
+// near the ceiling. Scattered rays rarely find the light on their own; light sampling
+// (EngineOptions::sample_lights) makes it converge. Seen from {0, 1, 3.3} towards
+// {0, 1, 0}, inside the front wall.
+World lit_room_world() {
+  constexpr double wall_radius = 100.0;
+  World world;
+  MaterialId white = world.add_material(LambertianMaterial{Vec3{0.75, 0.75, 0.75}});
+  world.add(Sphere({-1.5 - wall_radius, 1, 1}, wall_radius), LambertianMaterial{Vec3{0.75, 0.25, 0.25}});
+  world.add(Sphere({1.5 + wall_radius, 1, 1}, wall_radius), LambertianMaterial{Vec3{0.25, 0.75, 0.25}});
+  world.add(Sphere({0, -wall_radius, 1}, wall_radius), white);
+  world.add(Sphere({0, 2 + wall_radius, 1}, wall_radius), white);
+  world.add(Sphere({0, 1, -1.5 - wall_radius}, wall_radius), white);
+  world.add(Sphere({0, 1, 3.5 + wall_radius}, wall_radius), white);
+
+  world.add(Sphere({-0.8, 0.4, -0.6}, 0.4), MetalMaterial{{0.9, 0.9, 0.9}, 0.1});
+  world.add(Sphere({0.7, 0.4, 0.2}, 0.4), DielectricMaterial{1.5});
+  world.add(Sphere({0, 0.3, -0.9}, 0.3), LambertianMaterial{Vec3{0.2, 0.3, 0.8}});
+
+  world.add(Sphere({0, 1.8, -0.3}, 0.1), EmissiveMaterial{Vec3{120, 120, 120}});
+  return world;
+}
@@ -1,5 +1,6 @@
 #pragma once
 
+#include "aabb.h"
 #include "vec3.h"
 
 class Sphere {
@@ -15,6 +16,12 @@ public:
         return radius_;
     }
 
+    Aabb bounding_box() const {
+        // Negative radii are used for hollow spheres, the extent is the same.
+        Vec3 half_extent{fabs(radius_), fabs(radius_), fabs(radius_)};
+        return {center_ - half_extent, center_ + half_extent};
+    }
+
 private: 
     Vec3 center_;
     double radius_;
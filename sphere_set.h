@@ -0,0 +1,62 @@
+#pragma once
+
+#include <cstdint>
+#include <vector>
+
+#include "aabb.h"
+#include "bvh.h"
+#include "ray.h"
+#include "sphere_soa.h"
+#include "stats.h"
+
+// Builds a hierarchy over the spheres and reorders them so that every leaf covers a
+// contiguous run of them.
+Bvh build_sphere_bvh(SphereSoA& spheres, const BvhBuildOptions& options = {}) {
+    std::vector<BvhPrimitive> primitives;
+    primitives.reserve(spheres.size());
+    for (uint32_t i = 0; i < spheres.size(); i++) {
+        Aabb bounds = spheres.sphere(i).bounding_box();
+        primitives.push_back({bounds, bounds.centroid()});
+    }
+    Bvh bvh{primitives, options};
+    spheres.permute(bvh.release_primitive_indices());
+    return bvh;
+}
+
+// A group of spheres, each with its own material, behind a BVH of their own. Like a
+// TriangleMesh it is one piece of geometry that instances can share.
+class SphereSet {
+public:
+    explicit SphereSet(SphereSoA spheres, const BvhBuildOptions& options = {}) : spheres_{std::move(spheres)} {
+        for (uint32_t i = 0; i < spheres_.size(); i++) {
+            bounds_.expand(spheres_.sphere(i).bounding_box());
+        }
+        bvh_ = build_sphere_bvh(spheres_, options);
+    }
+
+    const SphereSoA& spheres() const {
+        return spheres_;
+    }
+
+    const Bvh& bvh() const {
+        return bvh_;
+    }
+
+    Aabb bounding_box() const {
+        return bounds_;
+    }
+
+    // Closest sphere hit in [t_min, t_max]. On a hit lowers `t_max` to it and stores the
+    // sphere index.
+    bool closest_hit(const Ray& ray, double t_min, double& t_max, uint32_t& sphere) const {
+        return bvh_.traverse(ray, t_min, t_max, [&](uint32_t first, uint32_t count, double& leaf_t_max) {
+            RT_STATS(counters.sphere_tests += count);
+            return closest_sphere_hit(spheres_, first, count, ray, t_min, leaf_t_max, sphere);
+        });
+    }
+
+private:
+    SphereSoA spheres_;
+    Aabb bounds_;
+    Bvh bvh_;
+};
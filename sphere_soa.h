@@ -0,0 +1,297 @@
+#pragma once
+
+#include <algorithm>
+#include <cmath>
+#include <cstdint>
+#include <limits>
+#include <vector>
+
+#if defined(__x86_64__) || defined(__i386__)
+#include <immintrin.h>
+#define RT_SIMD_X86 1
+#endif
+
+#include "array_storage.h"
+#include "ray.h"
+#include "sphere.h"
+#include "vec3.h"
+
+// Highest instruction set the sphere kernels may use. The build can lower it (see the
+// `simd` option in meson_options.txt); within that limit the CPU is probed at runtime.
+#ifndef RT_MAX_SIMD_LEVEL
+#define RT_MAX_SIMD_LEVEL 2
+#endif
+
+enum class SimdLevel {
+    scalar = 0,
+    sse2 = 1,
+    avx2 = 2,
+};
+
+SimdLevel detect_simd_level() {
+    int level = 0;
+#if RT_SIMD_X86
+    __builtin_cpu_init();
+    if (__builtin_cpu_supports("sse2")) {
+        level = 1;
+    }
+    if (__builtin_cpu_supports("avx2")) {
+        level = 2;
+    }
+#endif
+    return static_cast<SimdLevel>(std::min(level, RT_MAX_SIMD_LEVEL));
+}
+
+inline SimdLevel simd_level() {
+    static const SimdLevel level = detect_simd_level();
+    return level;
+}
+
+const char* to_debug(SimdLevel level) {
+    switch (level) {
+        case SimdLevel::scalar:
+            return "scalar";
+        case SimdLevel::sse2:
+            return "sse2";
+        case SimdLevel::avx2:
+            return "avx2";
+    }
+    return "unknown";
+}
+
+// Structure-of-arrays sphere storage: one array per field, so a SIMD kernel can load the
+// same field of several consecutive spheres at once. Every array is followed by a few
+// NaN sentinels, which lets the kernels load full vectors at the end of any range.
+class SphereSoA {
+public:
+    static constexpr uint32_t padding = 4;
+
+    SphereSoA() {
+        pad();
+    }
+
+    // Spheres stored elsewhere, e.g. in a mapped scene file. Every array holds `size`
+    // spheres followed by `padding` sentinels, and has to outlive the store. Adding
+    // spheres copies them first.
+    static SphereSoA view(
+            uint32_t size, const double* xs, const double* ys, const double* zs, const double* radii,
+            const uint32_t* material_ids) {
+        SphereSoA spheres{size};
+        spheres.xs_ = ArrayStorage<double>::view(xs, size + padding);
+        spheres.ys_ = ArrayStorage<double>::view(ys, size + padding);
+        spheres.zs_ = ArrayStorage<double>::view(zs, size + padding);
+        spheres.radii_ = ArrayStorage<double>::view(radii, size + padding);
+        spheres.material_ids_ = ArrayStorage<uint32_t>::view(material_ids, size + padding);
+        return spheres;
+    }
+
+    uint32_t size() const {
+        return size_;
+    }
+
+    bool empty() const {
+        return size_ == 0;
+    }
+
+    void clear() {
+        *this = SphereSoA{};
+    }
+
+    void add(const Sphere& sphere, uint32_t material_id) {
+        xs_.vector()[size_] = sphere.center()[0];
+        ys_.vector()[size_] = sphere.center()[1];
+        zs_.vector()[size_] = sphere.center()[2];
+        radii_.vector()[size_] = sphere.radius();
+        material_ids_.vector()[size_] = material_id;
+        size_++;
+        pad();
+    }
+
+    Sphere sphere(uint32_t index) const {
+        return Sphere(Vec3{xs_[index], ys_[index], zs_[index]}, radii_[index]);
+    }
+
+    uint32_t material_id(uint32_t index) const {
+        return material_ids_[index];
+    }
+
+    // Reorders the spheres so that the new i-th sphere is the old order[i]-th one.
+    void permute(const std::vector<uint32_t>& order) {
+        SphereSoA permuted;
+        for (uint32_t index : order) {
+            permuted.add(sphere(index), material_ids_[index]);
+        }
+        *this = std::move(permuted);
+    }
+
+    const double* xs() const { return xs_.data(); }
+    const double* ys() const { return ys_.data(); }
+    const double* zs() const { return zs_.data(); }
+    const double* radii() const { return radii_.data(); }
+    const uint32_t* material_ids() const { return material_ids_.data(); }
+
+private:
+    explicit SphereSoA(uint32_t size) : size_{size} {}
+
+    void pad() {
+        const double nan = std::numeric_limits<double>::quiet_NaN();
+        xs_.vector().resize(size_ + padding, nan);
+        ys_.vector().resize(size_ + padding, nan);
+        zs_.vector().resize(size_ + padding, nan);
+        radii_.vector().resize(size_ + padding, nan);
+        material_ids_.vector().resize(size_ + padding, 0);
+    }
+
+    uint32_t size_ = 0;
+    ArrayStorage<double> xs_;
+    ArrayStorage<double> ys_;
+    ArrayStorage<double> zs_;
+    ArrayStorage<double> radii_;
+    ArrayStorage<uint32_t> material_ids_;
+};
+
+// The kernels find the closest sphere in [first, first + count) whose near intersection
+// lies in [t_min, t_max]. They compute exactly what `detail::hit_sphere` does, lane by lane.
+// On a hit they lower `t_max` to it, store the sphere index and return true.
+namespace detail {
+    struct RayConstants {
+        double ox, oy, oz;
+        double dx, dy, dz;
+        double a;
+
+        explicit RayConstants(const Ray& ray)
+            : ox{ray.origin()[0]}, oy{ray.origin()[1]}, oz{ray.origin()[2]}
+            , dx{ray.direction()[0]}, dy{ray.direction()[1]}, dz{ray.direction()[2]}
+            , a{ray.direction().length_squared()} {}
+    };
+
+    bool closest_sphere_hit_scalar(
+            const SphereSoA& spheres, uint32_t first, uint32_t count,
+            const RayConstants& ray, double t_min, double& t_max, uint32_t& hit_index) {
+        bool hit_anything = false;
+        for (uint32_t i = first; i < first + count; i++) {
+            double cx = ray.ox - spheres.xs()[i];
+            double cy = ray.oy - spheres.ys()[i];
+            double cz = ray.oz - spheres.zs()[i];
+            double half_b = cx * ray.dx + cy * ray.dy + cz * ray.dz;
+            double c = (cx * cx + cy * cy + cz * cz) - spheres.radii()[i] * spheres.radii()[i];
+            double discriminant = half_b * half_b - ray.a * c;
+            if (discriminant > 0) {
+                double t = (-half_b - std::sqrt(discriminant)) / ray.a;
+                if (t_min <= t && t <= t_max) {
+                    t_max = t;
+                    hit_index = i;
+                    hit_anything = true;
+                }
+            }
+        }
+        return hit_anything;
+    }
+
+#if RT_SIMD_X86
+    __attribute__((target("sse2")))
+    bool closest_sphere_hit_sse2(
+            const SphereSoA& spheres, uint32_t first, uint32_t count,
+            const RayConstants& ray, double t_min, double& t_max, uint32_t& hit_index) {
+        const __m128d ox = _mm_set1_pd(ray.ox), oy = _mm_set1_pd(ray.oy), oz = _mm_set1_pd(ray.oz);
+        const __m128d dx = _mm_set1_pd(ray.dx), dy = _mm_set1_pd(ray.dy), dz = _mm_set1_pd(ray.dz);
+        const __m128d a = _mm_set1_pd(ray.a);
+        const __m128d lower = _mm_set1_pd(t_min);
+        const __m128d zero = _mm_setzero_pd();
+        bool hit_anything = false;
+        for (uint32_t i = first; i < first + count; i += 2) {
+            __m128d cx = _mm_sub_pd(ox, _mm_loadu_pd(spheres.xs() + i));
+            __m128d cy = _mm_sub_pd(oy, _mm_loadu_pd(spheres.ys() + i));
+            __m128d cz = _mm_sub_pd(oz, _mm_loadu_pd(spheres.zs() + i));
+            __m128d r = _mm_loadu_pd(spheres.radii() + i);
+            __m128d half_b = _mm_add_pd(_mm_add_pd(_mm_mul_pd(cx, dx), _mm_mul_pd(cy, dy)), _mm_mul_pd(cz, dz));
+            __m128d c = _mm_sub_pd(
+                _mm_add_pd(_mm_add_pd(_mm_mul_pd(cx, cx), _mm_mul_pd(cy, cy)), _mm_mul_pd(cz, cz)),
+                _mm_mul_pd(r, r));
+            __m128d discriminant = _mm_sub_pd(_mm_mul_pd(half_b, half_b), _mm_mul_pd(a, c));
+            __m128d mask = _mm_cmpgt_pd(discriminant, zero);
+            if (_mm_movemask_pd(mask) == 0) {
+                continue;
+            }
+            __m128d t = _mm_div_pd(_mm_sub_pd(_mm_sub_pd(zero, half_b), _mm_sqrt_pd(discriminant)), a);
+            mask = _mm_and_pd(mask, _mm_and_pd(_mm_cmple_pd(lower, t), _mm_cmple_pd(t, _mm_set1_pd(t_max))));
+            int bits = _mm_movemask_pd(mask);
+            if (bits == 0) {
+                continue;
+            }
+            alignas(16) double ts[2];
+            _mm_store_pd(ts, t);
+            for (uint32_t lane = 0; lane < 2 && i + lane < first + count; lane++) {
+                if ((bits >> lane) & 1 && ts[lane] <= t_max) {
+                    t_max = ts[lane];
+                    hit_index = i + lane;
+                    hit_anything = true;
+                }
+            }
+        }
+        return hit_anything;
+    }
+
+    __attribute__((target("avx2")))
+    bool closest_sphere_hit_avx2(
+            const SphereSoA& spheres, uint32_t first, uint32_t count,
+            const RayConstants& ray, double t_min, double& t_max, uint32_t& hit_index) {
+        const __m256d ox = _mm256_set1_pd(ray.ox), oy = _mm256_set1_pd(ray.oy), oz = _mm256_set1_pd(ray.oz);
+        const __m256d dx = _mm256_set1_pd(ray.dx), dy = _mm256_set1_pd(ray.dy), dz = _mm256_set1_pd(ray.dz);
+        const __m256d a = _mm256_set1_pd(ray.a);
+        const __m256d lower = _mm256_set1_pd(t_min);
+        const __m256d zero = _mm256_setzero_pd();
+        bool hit_anything = false;
+        for (uint32_t i = first; i < first + count; i += 4) {
+            __m256d cx = _mm256_sub_pd(ox, _mm256_loadu_pd(spheres.xs() + i));
+            __m256d cy = _mm256_sub_pd(oy, _mm256_loadu_pd(spheres.ys() + i));
+            __m256d cz = _mm256_sub_pd(oz, _mm256_loadu_pd(spheres.zs() + i));
+            __m256d r = _mm256_loadu_pd(spheres.radii() + i);
+            __m256d half_b = _mm256_add_pd(
+                _mm256_add_pd(_mm256_mul_pd(cx, dx), _mm256_mul_pd(cy, dy)), _mm256_mul_pd(cz, dz));
+            __m256d c = _mm256_sub_pd(
+                _mm256_add_pd(_mm256_add_pd(_mm256_mul_pd(cx, cx), _mm256_mul_pd(cy, cy)), _mm256_mul_pd(cz, cz)),
+                _mm256_mul_pd(r, r));
+            __m256d discriminant = _mm256_sub_pd(_mm256_mul_pd(half_b, half_b), _mm256_mul_pd(a, c));
+            __m256d mask = _mm256_cmp_pd(discriminant, zero, _CMP_GT_OQ);
+            if (_mm256_movemask_pd(mask) == 0) {
+                continue;
+            }
+            __m256d t = _mm256_div_pd(_mm256_sub_pd(_mm256_sub_pd(zero, half_b), _mm256_sqrt_pd(discriminant)), a);
+            mask = _mm256_and_pd(mask, _mm256_and_pd(
+                _mm256_cmp_pd(lower, t, _CMP_LE_OQ), _mm256_cmp_pd(t, _mm256_set1_pd(t_max), _CMP_LE_OQ)));
+            int bits = _mm256_movemask_pd(mask);
+            if (bits == 0) {
+                continue;
+            }
+            alignas(32) double ts[4];
+            _mm256_store_pd(ts, t);
+            for (uint32_t lane = 0; lane < 4 && i + lane < first + count; lane++) {
+                if ((bits >> lane) & 1 && ts[lane] <= t_max) {
+                    t_max = ts[lane];
+                    hit_index = i + lane;
+                    hit_anything = true;
+                }
+            }
+        }
+        return hit_anything;
+    }
+#endif
+}
+
+bool closest_sphere_hit(
+        const SphereSoA& spheres, uint32_t first, uint32_t count,
+        const Ray& ray, double t_min, double& t_max, uint32_t& hit_index,
+        SimdLevel level = simd_level()) {
+    detail::RayConstants constants{ray};
+    switch (level) {
+#if RT_SIMD_X86
+        case SimdLevel::avx2:
+            return detail::closest_sphere_hit_avx2(spheres, first, count, constants, t_min, t_max, hit_index);
+        case SimdLevel::sse2:
+            return detail::closest_sphere_hit_sse2(spheres, first, count, constants, t_min, t_max, hit_index);
+#endif
+        default:
+            return detail::closest_sphere_hit_scalar(spheres, first, count, constants, t_min, t_max, hit_index);
+    }
+}
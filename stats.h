@@ -0,0 +1,215 @@
+#pragma once
+
+// Hot-path counters and per-tile trace spans. Everything here only exists when the build
+// defines RT_ENABLE_STATS (meson option `stats`); otherwise RT_STATS(...) expands to
+// nothing and the instrumented code is exactly the uninstrumented one.
+//
+// Every thread increments its own counters, so there is no sharing or locking on the hot
+// path. Counters are registered globally on first use and outlive their threads, which
+// lets the totals be collected after a render has joined its workers.
+
+#ifdef RT_ENABLE_STATS
+
+#include <array>
+#include <chrono>
+#include <cstdint>
+#include <memory>
+#include <mutex>
+#include <ostream>
+#include <string>
+#include <vector>
+
+#include "material.h"
+
+#define RT_STATS(...) \
+    do { \
+        RenderCounters& counters = local_render_counters(); \
+        __VA_ARGS__; \
+    } while (0)
+
+struct TraceSpan {
+    const char* name;
+    int64_t start_us;
+    int64_t duration_us;
+    int start_x;
+    int end_x;
+    int start_y;
+    int end_y;
+};
+
+enum class PathTermination {
+    escaped,
+    absorbed,
+    russian_roulette,
+    depth_limit,
+};
+
+struct alignas(64) RenderCounters {
+    static constexpr int max_tracked_depth = 64;
+
+    uint64_t rays_cast = 0;
+    uint64_t shadow_rays_cast = 0;
+    uint64_t bvh_node_tests = 0;
+    uint64_t sphere_tests = 0;
+    uint64_t triangle_tests = 0;
+    std::array<uint64_t, std::variant_size_v<Material>> material_hits = {};
+    // Number of bounces a path made before it ended, the last bucket collects the rest.
+    std::array<uint64_t, max_tracked_depth + 1> bounce_depths = {};
+    std::array<uint64_t, 4> terminations = {};
+    std::vector<TraceSpan> spans;
+
+    void end_path(int bounces, PathTermination termination) {
+        bounce_depths[std::min(bounces, max_tracked_depth)]++;
+        terminations[static_cast<int>(termination)]++;
+    }
+
+    void add(const RenderCounters& other) {
+        rays_cast += other.rays_cast;
+        shadow_rays_cast += other.shadow_rays_cast;
+        bvh_node_tests += other.bvh_node_tests;
+        sphere_tests += other.sphere_tests;
+        triangle_tests += other.triangle_tests;
+        for (std::size_t i = 0; i < material_hits.size(); i++) {
+            material_hits[i] += other.material_hits[i];
+        }
+        for (std::size_t i = 0; i < bounce_depths.size(); i++) {
+            bounce_depths[i] += other.bounce_depths[i];
+        }
+        for (std::size_t i = 0; i < terminations.size(); i++) {
+            terminations[i] += other.terminations[i];
+        }
+    }
+};
+
+class RenderCounterRegistry {
+public:
+    RenderCounters& add_thread() {
+        std::lock_guard<std::mutex> lock(mutex_);
+        threads_.push_back(std::make_unique<RenderCounters>());
+        return *threads_.back();
+    }
+
+    // Only call these while no thread is rendering.
+    RenderCounters total() const {
+        std::lock_guard<std::mutex> lock(mutex_);
+        RenderCounters total;
+        for (const auto& counters : threads_) {
+            total.add(*counters);
+        }
+        return total;
+    }
+
+    void reset() {
+        std::lock_guard<std::mutex> lock(mutex_);
+        for (auto& counters : threads_) {
+            *counters = RenderCounters{};
+        }
+    }
+
+    // Makes now time zero of the trace spans. The registry starts its clock when it is
+    // created; a render calls this before it takes its first timestamp.
+    void start_trace_clock() {
+        trace_epoch_ = std::chrono::steady_clock::now();
+    }
+
+    std::chrono::steady_clock::time_point trace_epoch() const {
+        return trace_epoch_;
+    }
+
+    // Chrome trace-event JSON (chrome://tracing, Perfetto) with one track per thread.
+    void write_chrome_trace(std::ostream& out) const {
+        std::lock_guard<std::mutex> lock(mutex_);
+        out << "{\"displayTimeUnit\": \"ms\", \"traceEvents\": [\n";
+        bool first = true;
+        for (std::size_t tid = 0; tid < threads_.size(); tid++) {
+            out << (first ? "" : ",\n")
+                << "{\"name\": \"thread_name\", \"ph\": \"M\", \"pid\": 1, \"tid\": " << tid
+                << ", \"args\": {\"name\": \"render thread " << tid << "\"}}";
+            first = false;
+            for (const TraceSpan& span : threads_[tid]->spans) {
+                out << ",\n{\"name\": \"" << span.name << "\", \"cat\": \"render\", \"ph\": \"X\""
+                    << ", \"pid\": 1, \"tid\": " << tid
+                    << ", \"ts\": " << span.start_us << ", \"dur\": " << span.duration_us
+                    << ", \"args\": {\"x\": \"" << span.start_x << ".." << span.end_x
+                    << "\", \"y\": \"" << span.start_y << ".." << span.end_y << "\"}}";
+            }
+        }
+        out << "\n]}\n";
+    }
+
+private:
+    mutable std::mutex mutex_;
+    std::vector<std::unique_ptr<RenderCounters>> threads_;
+    std::chrono::steady_clock::time_point trace_epoch_ = std::chrono::steady_clock::now();
+};
+
+inline RenderCounterRegistry& render_counter_registry() {
+    static RenderCounterRegistry registry;
+    return registry;
+}
+
+inline RenderCounters& local_render_counters() {
+    thread_local RenderCounters& counters = render_counter_registry().add_thread();
+    return counters;
+}
+
+// BVH node, sphere and triangle tests made by this thread so far.
+inline uint64_t local_intersection_tests() {
+    const RenderCounters& counters = local_render_counters();
+    return counters.bvh_node_tests + counters.sphere_tests + counters.triangle_tests;
+}
+
+// Microseconds since the registry's trace epoch, the time base of all trace spans.
+inline int64_t trace_clock_us(std::chrono::steady_clock::time_point time) {
+    return std::chrono::duration_cast<std::chrono::microseconds>(time - render_counter_registry().trace_epoch()).count();
+}
+
+const char* material_name(std::size_t material_index) {
+    switch (material_index) {
+        case 0:
+            return "lambertian";
+        case 1:
+            return "metal";
+        case 2:
+            return "dielectric";
+        case 3:
+            return "emissive";
+    }
+    return "other";
+}
+
+std::ostream& operator << (std::ostream& out, const RenderCounters& counters) {
+    const char* termination_names[] = {"escaped", "absorbed", "russian roulette", "depth limit"};
+    out << "  Rays cast: " << counters.rays_cast << '\n'
+        << "  Shadow rays cast: " << counters.shadow_rays_cast << '\n'
+        << "  BVH node tests: " << counters.bvh_node_tests << '\n'
+        << "  Sphere tests: " << counters.sphere_tests << '\n'
+        << "  Triangle tests: " << counters.triangle_tests << '\n';
+    for (std::size_t i = 0; i < counters.material_hits.size(); i++) {
+        out << "  Hits on " << material_name(i) << ": " << counters.material_hits[i] << '\n';
+    }
+    for (std::size_t i = 0; i < counters.terminations.size(); i++) {
+        out << "  Paths ended by " << termination_names[i] << ": " << counters.terminations[i] << '\n';
+    }
+    out << "  Bounce depth histogram:";
+    for (std::size_t depth = 0; depth < counters.bounce_depths.size(); depth++) {
+        if (counters.bounce_depths[depth] > 0) {
+            out << ' ' << depth << (depth == RenderCounters::max_tracked_depth ? "+" : "")
+                << ':' << counters.bounce_depths[depth];
+        }
+    }
+    return out << '\n';
+}
+
+#else
+
+#include <cstdint>
+
+#define RT_STATS(...) do {} while (0)
+
+// Intersection tests are only counted in stats builds.
+inline uint64_t local_intersection_tests() {
+    return 0;
+}
+
+#endif
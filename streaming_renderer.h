@@ -0,0 +1,176 @@
+#pragma once
+
+#include <algorithm>
+#include <atomic>
+#include <chrono>
+#include <condition_variable>
+#include <iostream>
+#include <mutex>
+#include <vector>
+
+#include "framebuffer.h"
+#include "image_writer.h"
+#include "parallel_renderer.h"
+#include "renderer.h"
+#include "stats.h"
+#include "task_renderer.h"
+#include "task_splitter.h"
+#include "thread_pool.h"
+#include "tile_scheduler.h"
+
+struct StreamingOptions {
+    int tile_size = 16;
+    // Bands of one tile row each that are held in memory at once: the one being written
+    // out and those threads render ahead into. Memory is bounded by this many bands, so
+    // about max_bands * tile_size * image width pixels, whatever the image height.
+    int max_bands = 2;
+};
+
+// Renders an image band by band and writes every band to an ImageStream as soon as all of
+// its tiles are done, in the order the file stores them, so an image far larger than
+// memory can be rendered. Threads take tiles in file order from a shared counter rather
+// than from the work-stealing scheduler, which would spread them over the whole image;
+// a thread that gets ahead of the bands in memory waits for the oldest to be written.
+// Gives the same image as ParallelRenderer, without AOVs or cost maps.
+class StreamingRenderer {
+public:
+    const Renderer& renderer;
+    StreamingOptions options = {};
+    // Per-node copies of the scene, made for the pool passed to render().
+    const SceneReplicas* replicas = nullptr;
+    // Report the tile count, band memory, progress and per-thread stats on stderr.
+    bool verbose = false;
+
+    // Returns whether the whole image was written.
+    bool render(ThreadPool& pool, ImageStream& out, std::vector<ThreadStats>* thread_stats = nullptr) const {
+        using Clock = std::chrono::steady_clock;
+        const int width = renderer.image_width();
+        const int height = renderer.image_height();
+        const int tile_size = options.tile_size;
+        const int tiles_x = (width + tile_size - 1) / tile_size;
+        const int num_bands = (height + tile_size - 1) / tile_size;
+        const int max_bands = std::clamp(options.max_bands, 1, num_bands);
+        const int num_tiles = tiles_x * num_bands;
+        const bool bottom_up = out.bottom_up();
+        if (verbose) {
+            std::cerr << "Number of tiles: " << num_tiles << std::endl;
+            std::cerr << "Bands in memory: " << max_bands << " of " << num_bands << " ("
+                      << double(max_bands) * tile_size * width * sizeof(Vec3) / (1 << 20) << " MiB)" << std::endl
+                      << std::flush;
+        }
+
+        // Band b covers rows [first_row, first_row + pixels.height()), counted in file order.
+        struct Band {
+            int index = -1;
+            int first_row = 0;
+            int remaining_tiles = 0;
+            Framebuffer pixels;
+        };
+        auto band_rows = [&](int index, int& first_row) {
+            int file_start = index * tile_size;
+            int rows = std::min(tile_size, height - file_start);
+            first_row = bottom_up ? file_start : height - file_start - rows;
+            return rows;
+        };
+        std::vector<Band> slots(max_bands);
+        auto start_band = [&](int index) {
+            Band& band = slots[index % max_bands];
+            band.index = index;
+            band.remaining_tiles = tiles_x;
+            int rows = band_rows(index, band.first_row);
+            band.pixels = Framebuffer{width, rows};
+        };
+        for (int index = 0; index < max_bands; index++) {
+            start_band(index);
+        }
+
+        std::mutex mutex;
+        std::condition_variable band_written;
+        int bands_written = 0;
+        std::atomic<int> next_tile = 0;
+        std::vector<ThreadStats> stats(pool.size());
+
+        auto render_start = Clock::now();
+        pool.run([&](CoreId core_id) {
+            const Renderer& thread_renderer = replicas ? replicas->renderer(core_id) : renderer;
+            ThreadStats& thread_stats = stats[core_id];
+            thread_stats.core_id = core_id;
+            std::vector<PixelSample> pixels;
+            for (int tile = next_tile++; tile < num_tiles; tile = next_tile++) {
+                const int index = tile / tiles_x;
+                Band* band = nullptr;
+                {
+                    std::unique_lock<std::mutex> lock(mutex);
+                    band_written.wait(lock, [&] {
+                        return index < bands_written + max_bands;
+                    });
+                    band = &slots[index % max_bands];
+                }
+                RenderTask task;
+                task.start_x = (tile % tiles_x) * tile_size;
+                task.end_x = std::min(task.start_x + tile_size, width) - 1;
+                task.start_y = band->first_row;
+                task.end_y = band->first_row + band->pixels.height() - 1;
+
+                auto task_start = Clock::now();
+                uint64_t rays_traced = render_task_pixels(task, thread_renderer, pixels, nullptr);
+                std::size_t p = 0;
+                for (int row = 0; row < band->pixels.height(); row++) {
+                    Vec3* scanline = band->pixels.scanline(row);
+                    for (int col = task.start_x; col <= task.end_x; col++) {
+                        scanline[col] = pixels[p++].color;
+                    }
+                }
+                auto task_end = Clock::now();
+                thread_stats.rays_traced += rays_traced;
+                thread_stats.busy_seconds += std::chrono::duration<double>(task_end - task_start).count();
+                thread_stats.tiles_rendered++;
+                RT_STATS(counters.spans.push_back({
+                    "tile", trace_clock_us(task_start), trace_clock_us(task_end) - trace_clock_us(task_start),
+                    task.start_x, task.end_x, task.start_y, task.end_y}));
+
+                // The thread that completes the oldest band writes it, and any finished
+                // bands after it, under the lock, so bands go out in order.
+                std::lock_guard<std::mutex> lock(mutex);
+                if (--band->remaining_tiles > 0 || index != bands_written) {
+                    continue;
+                }
+                while (bands_written < num_bands) {
+                    Band& oldest = slots[bands_written % max_bands];
+                    if (oldest.index != bands_written || oldest.remaining_tiles > 0) {
+                        break;
+                    }
+                    out.write_band(oldest.pixels, oldest.first_row);
+                    oldest.pixels = Framebuffer{};
+                    bands_written++;
+                    if (bands_written + max_bands - 1 < num_bands) {
+                        start_band(bands_written + max_bands - 1);
+                    }
+                }
+                band_written.notify_all();
+                if (verbose && (core_id == 0 || bands_written == num_bands)) {
+                    std::cerr << "\rRemaining bands: " << num_bands - bands_written << ' ' << std::flush;
+                }
+            }
+        });
+        double render_seconds = std::chrono::duration<double>(Clock::now() - render_start).count();
+        if (verbose) {
+            std::cerr << std::endl;
+        }
+
+        for (auto& thread_stats : stats) {
+            thread_stats.idle_seconds = render_seconds - thread_stats.busy_seconds;
+            if (verbose) {
+                std::cerr << thread_stats << std::endl;
+            }
+        }
+        if (thread_stats) {
+            *thread_stats = std::move(stats);
+        }
+        bool written = out.finish();
+        if (!written) {
+            std::cerr << "Could not write the image" << std::endl;
+        }
+        return written;
+    }
+};
@@ -1,59 +1,190 @@
 #pragma once
 
+#include <chrono>
 #include <string>
 #include <sstream>
+#include <vector>
 
 #include "camera.h"
+#include "cost_map.h"
 #include "engine.h"
+#include "framebuffer.h"
+#include "renderer.h"
+#include "stats.h"
 #include "task_splitter.h"
 #include "world.h"
 
-struct PixelLocation {
-    int x;
-    int y;
+// Buffers the render tasks write into. Each task only touches its own tile.
+struct RenderedImage {
+    Framebuffer color;
+    // Samples taken per pixel, so adaptive sampling shows where the budget went.
+    ImageBuffer<int> sample_counts;
+    // The PixelAovs of every pixel, empty unless requested.
+    Framebuffer albedo;
+    Framebuffer normal;
+    ImageBuffer<double> depth;
+    ImageBuffer<double> variance;
+    // What every pixel and tile cost to render, empty unless requested.
+    ImageBuffer<PixelCost> costs;
+    std::vector<TileCost> tile_costs;
 
-    bool operator <(const PixelLocation& other) const {
-        if (x < other.x) {
-            return true;
-        } else if (x > other.x) {
-            return false;
-        } else {
-            return y < other.y;
+    RenderedImage(int width, int height, bool with_aovs = false, bool with_costs = false)
+        : color{width, height}, sample_counts{width, height} {
+        if (with_aovs) {
+            albedo = Framebuffer{width, height};
+            normal = Framebuffer{width, height};
+            depth = ImageBuffer<double>{width, height};
+            variance = ImageBuffer<double>{width, height};
+        }
+        if (with_costs) {
+            costs = ImageBuffer<PixelCost>{width, height};
         }
     }
-};
-
-std::string to_debug(const PixelLocation& location) {
-    std::stringstream ss;
-    ss << "(x = " << location.x << ", y = " << location.y << ")";
-    return ss.str();
-}
 
-struct RenderTaskResult {
-    RenderTask task;
-    std::vector<Vec3> pixels;
+    bool has_aovs() const {
+        return !depth.pixels().empty();
+    }
 
-    PixelLocation location_of(int index) {
-        int width = task.end_x - task.start_x + 1;
-        int offset_y = index / width;
-        int offset_x = index % width;
-        return {task.start_x + offset_x, task.start_y + offset_y};
+    bool has_costs() const {
+        return !costs.pixels().empty();
     }
 };
 
-RenderTaskResult render_task(CoreId core_id, RenderTask task, const Renderer& renderer, bool log_progress = false) {
-    std::cerr << "Render task: " << to_debug(task) << std::endl;
-    RenderTaskResult result{.task = task};
-    for (int y = task.start_y; y <= task.end_y; y++) {
-        if (log_progress) {
-            int remaining_lines = task.end_y - y + 1;
-            std::cerr << "\rRemaining lines for core " << core_id << ": " << remaining_lines << std::endl << std::flush;
+// Wavefront path tracing renders the whole tile as one block. Its samples are traced
+// together, so the costs of the block are split between the pixels by their sample counts.
+uint64_t render_task_wavefront(RenderTask task, const Renderer& renderer, RenderedImage& image) {
+    std::vector<PixelSample> pixels;
+    std::vector<PixelAovs> aovs;
+    auto start = std::chrono::steady_clock::now();
+    uint64_t tests_before = image.has_costs() ? local_intersection_tests() : 0;
+    uint64_t rays_traced = renderer.render_block(
+        task.start_y, task.end_y, task.start_x, task.end_x, pixels, image.has_aovs() ? &aovs : nullptr);
+    if (image.has_costs()) {
+        double seconds = std::chrono::duration<double>(std::chrono::steady_clock::now() - start).count();
+        uint64_t tests = local_intersection_tests() - tests_before;
+        uint64_t samples = 0;
+        for (const PixelSample& pixel : pixels) {
+            samples += pixel.sample_count;
         }
+        std::size_t p = 0;
+        for (int row = task.start_y; row <= task.end_y; row++) {
+            for (int col = task.start_x; col <= task.end_x; col++, p++) {
+                double share = double(pixels[p].sample_count) / std::max<uint64_t>(samples, 1);
+                image.costs.at(row, col) = {
+                    float(seconds * share), uint32_t(rays_traced * share + 0.5), uint32_t(tests * share + 0.5)};
+            }
+        }
+    }
+    std::size_t p = 0;
+    for (int row = task.start_y; row <= task.end_y; row++) {
+        for (int col = task.start_x; col <= task.end_x; col++, p++) {
+            image.color.at(row, col) = pixels[p].color;
+            image.sample_counts.at(row, col) = pixels[p].sample_count;
+            if (image.has_aovs()) {
+                image.albedo.at(row, col) = aovs[p].albedo;
+                image.normal.at(row, col) = aovs[p].normal;
+                image.depth.at(row, col) = aovs[p].depth;
+                image.variance.at(row, col) = aovs[p].variance;
+            }
+        }
+    }
+    return rays_traced;
+}
+
+// Renders the tile into the image and returns the number of rays it took.
+uint64_t render_task(RenderTask task, const Renderer& renderer, RenderedImage& image) {
+    if (renderer.engine_options().path_tracing == PathTracing::wavefront) {
+        return render_task_wavefront(task, renderer, image);
+    }
+    uint64_t rays_traced = 0;
+    for (int y = task.start_y; y <= task.end_y; y++) {
+        Vec3* scanline = image.color.scanline(y);
+        int* sample_counts = image.sample_counts.scanline(y);
         for (int x = task.start_x; x <= task.end_x; x++) {
             int row = y;
             int col = x;
-            result.pixels.emplace_back(renderer.color_at(row, col));
+            PixelAovs aovs;
+            // The clock is only read when costs are recorded.
+            std::chrono::steady_clock::time_point start;
+            uint64_t tests_before = 0;
+            if (image.has_costs()) {
+                start = std::chrono::steady_clock::now();
+                tests_before = local_intersection_tests();
+            }
+            PixelSample pixel = renderer.render_pixel(row, col, image.has_aovs() ? &aovs : nullptr);
+            if (image.has_costs()) {
+                image.costs.at(row, col) = {
+                    std::chrono::duration<float>(std::chrono::steady_clock::now() - start).count(),
+                    uint32_t(pixel.rays_traced), uint32_t(local_intersection_tests() - tests_before)};
+            }
+            scanline[col] = pixel.color;
+            if (image.has_aovs()) {
+                image.albedo.at(row, col) = aovs.albedo;
+                image.normal.at(row, col) = aovs.normal;
+                image.depth.at(row, col) = aovs.depth;
+                image.variance.at(row, col) = aovs.variance;
+            }
+            sample_counts[col] = pixel.sample_count;
+            rays_traced += pixel.rays_traced;
+        }
+    }
+    return rays_traced;
+}
+
+// Renders the pixels of the tile row by row into `pixels`, and `aovs` if given, instead of
+// into an image, and returns the number of rays they took.
+uint64_t render_task_pixels(
+        RenderTask task, const Renderer& renderer, std::vector<PixelSample>& pixels, std::vector<PixelAovs>* aovs) {
+    if (renderer.engine_options().path_tracing == PathTracing::wavefront) {
+        return renderer.render_block(task.start_y, task.end_y, task.start_x, task.end_x, pixels, aovs);
+    }
+    pixels.clear();
+    if (aovs) {
+        aovs->clear();
+    }
+    uint64_t rays_traced = 0;
+    for (int row = task.start_y; row <= task.end_y; row++) {
+        for (int col = task.start_x; col <= task.end_x; col++) {
+            PixelAovs pixel_aovs;
+            pixels.push_back(renderer.render_pixel(row, col, aovs ? &pixel_aovs : nullptr));
+            if (aovs) {
+                aovs->push_back(pixel_aovs);
+            }
+            rays_traced += pixels.back().rays_traced;
         }
     }
-    return result;
-}
\ No newline at end of file
+    return rays_traced;
+}
+
+// Adds samples [first_sample, first_sample + sample_count) of every pixel of the tile to
+// `sums` and returns the number of rays they took.
+uint64_t accumulate_task(
+        RenderTask task, const Renderer& renderer, int first_sample, int sample_count, Framebuffer& sums) {
+    if (renderer.engine_options().path_tracing == PathTracing::wavefront) {
+        std::vector<SampleIndex> samples;
+        for (int y = task.start_y; y <= task.end_y; y++) {
+            for (int x = task.start_x; x <= task.end_x; x++) {
+                for (int s = first_sample; s < first_sample + sample_count; s++) {
+                    samples.push_back({y, x, s});
+                }
+            }
+        }
+        std::vector<Vec3> colors(samples.size());
+        WavefrontEngine engine{renderer.engine_options()};
+        renderer.trace_samples(engine, samples, colors.data());
+        for (std::size_t i = 0; i < samples.size(); i++) {
+            sums.at(samples[i].row, samples[i].col) += colors[i];
+        }
+        return engine.rays_traced();
+    }
+    Engine engine{renderer.engine_options()};
+    for (int y = task.start_y; y <= task.end_y; y++) {
+        Vec3* scanline = sums.scanline(y);
+        for (int x = task.start_x; x <= task.end_x; x++) {
+            for (int s = first_sample; s < first_sample + sample_count; s++) {
+                scanline[x] += renderer.sample(engine, y, x, s);
+            }
+        }
+    }
+    return engine.rays_traced();
+}
@@ -1,5 +1,10 @@
 #pragma once
 
+#include <algorithm>
+#include <cstdint>
+#include <sstream>
+#include <string>
+#include <tuple>
 #include <vector>
 #include <math.h>
 
@@ -27,46 +32,87 @@ std::string to_debug(const RenderTask& task) {
     return ss.str();
 }
 
-struct RenderTasksPerCore {
-    CoreId core_id;
-    std::vector<RenderTask> tasks;
+// Order in which tiles are handed out. Space-filling curves keep consecutive tiles
+// close together, so threads working through their share touch nearby geometry.
+enum class TileOrder {
+    scanline,
+    morton,
+    hilbert,
 };
 
-int next_core_id(int core_id, int num_cores) {
-    assert(core_id < num_cores);
-    if (core_id == num_cores - 1) {
-        return 0;
+namespace detail {
+    uint64_t morton_index(uint32_t x, uint32_t y) {
+        uint64_t index = 0;
+        for (int bit = 0; bit < 32; bit++) {
+            index |= static_cast<uint64_t>((x >> bit) & 1) << (2 * bit);
+            index |= static_cast<uint64_t>((y >> bit) & 1) << (2 * bit + 1);
+        }
+        return index;
     }
-    return core_id + 1;
-}
 
-std::vector<RenderTasksPerCore> split_tasks(int image_height, int image_width, int num_cores) {
-    int k = num_cores;
-    int grid_height = image_height / k + 1;
-    int grid_width = image_width / k + 1;
-
-    std::vector<RenderTasksPerCore> tasks;
-    tasks.resize(num_cores);
+    // Position of (x, y) along the Hilbert curve filling an n x n grid, n a power of two.
+    uint64_t hilbert_index(uint32_t n, uint32_t x, uint32_t y) {
+        uint64_t index = 0;
+        for (uint32_t s = n / 2; s > 0; s /= 2) {
+            uint32_t rx = (x & s) > 0;
+            uint32_t ry = (y & s) > 0;
+            index += static_cast<uint64_t>(s) * s * ((3 * rx) ^ ry);
+            if (ry == 0) {
+                if (rx == 1) {
+                    x = n - 1 - x;
+                    y = n - 1 - y;
+                }
+                std::swap(x, y);
+            }
+        }
+        return index;
+    }
+}
 
-    for (CoreId core_id = 0; core_id < num_cores; core_id++) {
-        RenderTasksPerCore& per_core = tasks[core_id];
-        per_core.core_id = core_id;
+// Cuts the image into tiles of at most tile_size x tile_size pixels, listed in the given order.
+std::vector<RenderTask> split_tiles(int image_height, int image_width, int tile_size, TileOrder order) {
+    int tiles_x = (image_width + tile_size - 1) / tile_size;
+    int tiles_y = (image_height + tile_size - 1) / tile_size;
+    uint32_t grid_size = 1;
+    while (grid_size < static_cast<uint32_t>(std::max(tiles_x, tiles_y))) {
+        grid_size *= 2;
     }
 
-    CoreId core_id = 0;
-    for (int offset_x = 0; offset_x < image_width; offset_x += grid_width) {
-        for (int offset_y = 0; offset_y < image_height; offset_y += grid_height) {
-            int end_x = std::min(offset_x + grid_width, image_width) - 1;
-            int end_y = std::min(offset_y + grid_height, image_height) - 1;
+    std::vector<std::tuple<uint64_t, RenderTask>> keyed_tasks;
+    keyed_tasks.reserve(tiles_x * tiles_y);
+    for (int tile_y = 0; tile_y < tiles_y; tile_y++) {
+        for (int tile_x = 0; tile_x < tiles_x; tile_x++) {
             RenderTask task = {
-                .start_x = offset_x,
-                .end_x = end_x,
-                .start_y = offset_y,
-                .end_y = end_y,
+                .start_x = tile_x * tile_size,
+                .end_x = std::min((tile_x + 1) * tile_size, image_width) - 1,
+                .start_y = tile_y * tile_size,
+                .end_y = std::min((tile_y + 1) * tile_size, image_height) - 1,
             };
-            tasks[core_id].tasks.emplace_back(std::move(task));
-            core_id = next_core_id(core_id, num_cores);
+            // Scanline order starts at the top of the picture, like the output files do.
+            uint32_t top_down_y = tiles_y - 1 - tile_y;
+            uint64_t key = 0;
+            switch (order) {
+                case TileOrder::scanline:
+                    key = static_cast<uint64_t>(top_down_y) * tiles_x + tile_x;
+                    break;
+                case TileOrder::morton:
+                    key = detail::morton_index(tile_x, top_down_y);
+                    break;
+                case TileOrder::hilbert:
+                    key = detail::hilbert_index(grid_size, tile_x, top_down_y);
+                    break;
+            }
+            keyed_tasks.emplace_back(key, task);
         }
     }
+    std::sort(keyed_tasks.begin(), keyed_tasks.end(), [](const auto& lhs, const auto& rhs) {
+        return std::get<0>(lhs) < std::get<0>(rhs);
+    });
+
+    std::vector<RenderTask> tasks;
+    tasks.reserve(keyed_tasks.size());
+    for (const auto& [key, task] : keyed_tasks) {
+        tasks.push_back(task);
+    }
     return tasks;
-}
\ No newline at end of file
+}
@@ -0,0 +1,240 @@
+#pragma once
+
+#include <pthread.h>
+#include <sched.h>
+
+#include <algorithm>
+#include <condition_variable>
+#include <fstream>
+#include <functional>
+#include <map>
+#include <mutex>
+#include <set>
+#include <sstream>
+#include <string>
+#include <thread>
+#include <tuple>
+#include <vector>
+
+// A logical CPU this process may run on, with where it sits in the machine.
+struct CpuInfo {
+    int cpu = 0;
+    // Physical core within the package; hyperthreads of one core share it.
+    int core = 0;
+    int package = 0;
+    int numa_node = 0;
+};
+
+namespace detail {
+    int read_int_file(const std::string& path, int fallback) {
+        std::ifstream in(path);
+        int value = fallback;
+        in >> value;
+        return in ? value : fallback;
+    }
+
+    // Parses a kernel CPU list such as "0-3,8,10-11".
+    std::vector<int> parse_cpu_list(const std::string& list) {
+        std::vector<int> cpus;
+        std::stringstream in(list);
+        std::string range;
+        while (std::getline(in, range, ',')) {
+            int first = 0;
+            int last = 0;
+            char dash = 0;
+            std::stringstream range_in(range);
+            if (!(range_in >> first)) {
+                continue;
+            }
+            last = range_in >> dash >> last ? last : first;
+            for (int cpu = first; cpu <= last; cpu++) {
+                cpus.push_back(cpu);
+            }
+        }
+        return cpus;
+    }
+}
+
+// The CPUs in the affinity mask of the process, which respects taskset and cpusets, with
+// their core, package and NUMA node from sysfs. Missing topology reads as one node and
+// one package, with every CPU its own core.
+std::vector<CpuInfo> detect_cpus() {
+    std::vector<CpuInfo> cpus;
+    cpu_set_t allowed;
+    CPU_ZERO(&allowed);
+    if (sched_getaffinity(0, sizeof(allowed), &allowed) != 0) {
+        for (unsigned cpu = 0; cpu < std::max(1u, std::thread::hardware_concurrency()); cpu++) {
+            CPU_SET(cpu, &allowed);
+        }
+    }
+
+    std::map<int, int> numa_node_of_cpu;
+    for (int node = 0; node < 1024; node++) {
+        std::ifstream in("/sys/devices/system/node/node" + std::to_string(node) + "/cpulist");
+        if (!in) {
+            if (node > 0) {
+                break;
+            }
+            continue;
+        }
+        std::string list;
+        std::getline(in, list);
+        for (int cpu : detail::parse_cpu_list(list)) {
+            numa_node_of_cpu[cpu] = node;
+        }
+    }
+
+    for (int cpu = 0; cpu < CPU_SETSIZE; cpu++) {
+        if (!CPU_ISSET(cpu, &allowed)) {
+            continue;
+        }
+        std::string topology = "/sys/devices/system/cpu/cpu" + std::to_string(cpu) + "/topology/";
+        CpuInfo info;
+        info.cpu = cpu;
+        info.core = detail::read_int_file(topology + "core_id", cpu);
+        info.package = detail::read_int_file(topology + "physical_package_id", 0);
+        auto node = numa_node_of_cpu.find(cpu);
+        info.numa_node = node != numa_node_of_cpu.end() ? node->second : 0;
+        cpus.push_back(info);
+    }
+    return cpus;
+}
+
+// One thread per CPU the process may use.
+int default_thread_count() {
+    return std::max<int>(1, detect_cpus().size());
+}
+
+// CPUs in the order threads are placed on them: one hyperthread of every physical core
+// before any second one, and within that alternating between NUMA nodes, so a pool of any
+// size spreads over the cores and the memory controllers.
+std::vector<CpuInfo> thread_placement(std::vector<CpuInfo> cpus) {
+    std::map<std::tuple<int, int>, int> threads_of_core;
+    std::map<std::tuple<int, int>, int> cores_of_node;
+    std::vector<std::tuple<int, int, int, int>> keys;
+    for (std::size_t i = 0; i < cpus.size(); i++) {
+        int sibling = threads_of_core[{cpus[i].package, cpus[i].core}]++;
+        int rank_in_node = cores_of_node[{sibling, cpus[i].numa_node}]++;
+        keys.emplace_back(sibling, rank_in_node, cpus[i].numa_node, i);
+    }
+    std::sort(keys.begin(), keys.end());
+    std::vector<CpuInfo> placement;
+    for (const auto& key : keys) {
+        placement.push_back(cpus[std::get<3>(key)]);
+    }
+    return placement;
+}
+
+// Threads started once and reused by every render, so that repeated renders and the
+// passes of a progressive render do not pay for thread creation, and a pinned thread
+// keeps its CPU caches and NUMA node. run() hands the same job to all threads and waits.
+class ThreadPool {
+public:
+    // Threads default to one per CPU the process may use. Pinned threads are bound to
+    // CPUs in thread_placement() order; memory a pinned thread touches first is then
+    // allocated on its NUMA node, which is how per-thread buffers stay local.
+    explicit ThreadPool(int num_threads = 0, bool pin_threads = false) {
+        std::vector<CpuInfo> placement = thread_placement(detect_cpus());
+        if (num_threads <= 0) {
+            num_threads = std::max<int>(1, placement.size());
+        }
+        for (int thread = 0; thread < num_threads; thread++) {
+            if (pin_threads && !placement.empty()) {
+                cpus_.push_back(placement[thread % placement.size()]);
+            }
+            threads_.emplace_back([this, thread] {
+                work(thread);
+            });
+        }
+        for (int thread = 0; thread < int(cpus_.size()); thread++) {
+            cpu_set_t cpu_set;
+            CPU_ZERO(&cpu_set);
+            CPU_SET(cpus_[thread].cpu, &cpu_set);
+            pthread_setaffinity_np(threads_[thread].native_handle(), sizeof(cpu_set), &cpu_set);
+        }
+    }
+
+    ThreadPool(const ThreadPool&) = delete;
+    ThreadPool& operator=(const ThreadPool&) = delete;
+
+    ~ThreadPool() {
+        {
+            std::lock_guard<std::mutex> lock(mutex_);
+            stopping_ = true;
+        }
+        wake_.notify_all();
+        for (auto& thread : threads_) {
+            thread.join();
+        }
+    }
+
+    int size() const {
+        return threads_.size();
+    }
+
+    bool is_pinned() const {
+        return !cpus_.empty();
+    }
+
+    // NUMA node of the CPU a pinned thread runs on; 0 for unpinned threads.
+    int numa_node(int thread) const {
+        return is_pinned() ? cpus_[thread].numa_node : 0;
+    }
+
+    // The NUMA nodes of the threads, in ascending order.
+    std::vector<int> numa_nodes() const {
+        std::set<int> nodes;
+        for (int thread = 0; thread < size(); thread++) {
+            nodes.insert(numa_node(thread));
+        }
+        return {nodes.begin(), nodes.end()};
+    }
+
+    // Runs `job(thread)` on every thread of the pool and returns once all have returned.
+    // Not reentrant: a job must not call run() on the same pool.
+    void run(const std::function<void(int)>& job) {
+        std::unique_lock<std::mutex> lock(mutex_);
+        job_ = &job;
+        running_ = size();
+        generation_++;
+        wake_.notify_all();
+        done_.wait(lock, [this] {
+            return running_ == 0;
+        });
+        job_ = nullptr;
+    }
+
+private:
+    void work(int thread) {
+        uint64_t seen_generation = 0;
+        while (true) {
+            const std::function<void(int)>* job;
+            {
+                std::unique_lock<std::mutex> lock(mutex_);
+                wake_.wait(lock, [&] {
+                    return stopping_ || generation_ != seen_generation;
+                });
+                if (stopping_) {
+                    return;
+                }
+                seen_generation = generation_;
+                job = job_;
+            }
+            (*job)(thread);
+            std::lock_guard<std::mutex> lock(mutex_);
+            if (--running_ == 0) {
+                done_.notify_one();
+            }
+        }
+    }
+
+    std::vector<std::thread> threads_;
+    std::vector<CpuInfo> cpus_;
+    std::mutex mutex_;
+    std::condition_variable wake_;
+    std::condition_variable done_;
+    const std::function<void(int)>* job_ = nullptr;
+    uint64_t generation_ = 0;
+    int running_ = 0;
+    bool stopping_ = false;
+};
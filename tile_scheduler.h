@@ -0,0 +1,92 @@
+#pragma once
+
+#include <algorithm>
+#include <chrono>
+#include <deque>
+#include <memory>
+#include <mutex>
+#include <optional>
+#include <vector>
+
+#include "task_splitter.h"
+
+struct SchedulerOptions {
+    int tile_size = 16;
+    TileOrder order = TileOrder::hilbert;
+};
+
+struct ThreadStats {
+    CoreId core_id;
+    int tiles_rendered = 0;
+    int tiles_stolen = 0;
+    uint64_t rays_traced = 0;
+    // Time spent rendering tiles, and the rest of the wall time of the whole render,
+    // which includes waiting for the slowest thread to finish.
+    double busy_seconds = 0.0;
+    double idle_seconds = 0.0;
+};
+
+// Hands out tiles from per-thread deques. Each thread starts with a contiguous run of
+// the tile order and pops from the front of its own deque; once that is empty it steals
+// from the back of the others, i.e. the work their owners would have reached last.
+class WorkStealingScheduler {
+public:
+    WorkStealingScheduler(const std::vector<RenderTask>& tasks, int num_threads) {
+        queues_.reserve(num_threads);
+        for (int i = 0; i < num_threads; i++) {
+            queues_.push_back(std::make_unique<TaskQueue>());
+        }
+        std::size_t per_thread = std::max<std::size_t>(1, (tasks.size() + num_threads - 1) / num_threads);
+        for (std::size_t i = 0; i < tasks.size(); i++) {
+            queues_[i / per_thread]->tasks.push_back(tasks[i]);
+        }
+    }
+
+    // Returns the next tile for the given thread, or nothing once all tiles are taken.
+    std::optional<RenderTask> next(CoreId core_id, bool& stolen) {
+        stolen = false;
+        {
+            TaskQueue& own = *queues_[core_id];
+            std::lock_guard<std::mutex> lock(own.mutex);
+            if (!own.tasks.empty()) {
+                RenderTask task = own.tasks.front();
+                own.tasks.pop_front();
+                return task;
+            }
+        }
+        // Tiles are never added after construction, so one empty sweep means we are done.
+        int num_threads = queues_.size();
+        for (int i = 1; i < num_threads; i++) {
+            TaskQueue& victim = *queues_[(core_id + i) % num_threads];
+            std::lock_guard<std::mutex> lock(victim.mutex);
+            if (!victim.tasks.empty()) {
+                RenderTask task = victim.tasks.back();
+                victim.tasks.pop_back();
+                stolen = true;
+                return task;
+            }
+        }
+        return {};
+    }
+
+private:
+    // Padded so that the locks of different threads do not share a cache line.
+    struct alignas(64) TaskQueue {
+        std::mutex mutex;
+        std::deque<RenderTask> tasks;
+    };
+
+    std::vector<std::unique_ptr<TaskQueue>> queues_;
+};
+
+std::ostream& operator << (std::ostream& out, const ThreadStats& stats) {
+    double total = stats.busy_seconds + stats.idle_seconds;
+    double busy_percent = total > 0.0 ? 100.0 * stats.busy_seconds / total : 0.0;
+    return out
+        << "  Thread[" << stats.core_id << "]: "
+        << stats.tiles_rendered << " tiles ("
+        << stats.tiles_stolen << " stolen), busy "
+        << stats.busy_seconds << "s, idle "
+        << stats.idle_seconds << "s ("
+        << busy_percent << "% busy)";
+}
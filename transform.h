@@ -0,0 +1,105 @@
+#pragma once
+
+#include <array>
+#include <cmath>
+
+#include "aabb.h"
+#include "common.h"
+#include "ray.h"
+#include "vec3.h"
+
+// Affine transform: a 3x3 linear part followed by a translation. A default constructed
+// transform is the identity.
+class Transform {
+public:
+    Transform() : rows_{Vec3{1, 0, 0}, Vec3{0, 1, 0}, Vec3{0, 0, 1}}, translation_{0, 0, 0} {}
+    Transform(const std::array<Vec3, 3>& rows, const Vec3& translation) : rows_{rows}, translation_{translation} {}
+
+    static Transform translation(const Vec3& offset) {
+        return {Transform{}.rows_, offset};
+    }
+
+    static Transform scaling(double factor) {
+        return {{Vec3{factor, 0, 0}, Vec3{0, factor, 0}, Vec3{0, 0, factor}}, Vec3{0, 0, 0}};
+    }
+
+    // Counter-clockwise rotation around `axis` when looking against it.
+    static Transform rotation(const Vec3& axis, double degrees) {
+        Vec3 a = unit_vector(axis);
+        double c = std::cos(degrees_to_radians(degrees));
+        double s = std::sin(degrees_to_radians(degrees));
+        double t = 1.0 - c;
+        return {{
+            Vec3{t * a[0] * a[0] + c, t * a[0] * a[1] - s * a[2], t * a[0] * a[2] + s * a[1]},
+            Vec3{t * a[0] * a[1] + s * a[2], t * a[1] * a[1] + c, t * a[1] * a[2] - s * a[0]},
+            Vec3{t * a[0] * a[2] - s * a[1], t * a[1] * a[2] + s * a[0], t * a[2] * a[2] + c},
+        }, Vec3{0, 0, 0}};
+    }
+
+    // The transform that applies `rhs` first and then this one.
+    Transform operator * (const Transform& rhs) const {
+        std::array<Vec3, 3> rows;
+        for (int row = 0; row < 3; row++) {
+            for (int column = 0; column < 3; column++) {
+                rows[row][column] = rows_[row][0] * rhs.rows_[0][column]
+                    + rows_[row][1] * rhs.rows_[1][column]
+                    + rows_[row][2] * rhs.rows_[2][column];
+            }
+        }
+        return {rows, apply_point(rhs.translation_)};
+    }
+
+    Vec3 apply_point(const Vec3& point) const {
+        return apply_vector(point) + translation_;
+    }
+
+    Vec3 apply_vector(const Vec3& vector) const {
+        return {dot(rows_[0], vector), dot(rows_[1], vector), dot(rows_[2], vector)};
+    }
+
+    // Multiplies by the transposed linear part. Normals map to world space this way
+    // through the inverse of the object-to-world transform.
+    Vec3 apply_transposed(const Vec3& vector) const {
+        return vector[0] * rows_[0] + vector[1] * rows_[1] + vector[2] * rows_[2];
+    }
+
+    // The direction is not normalized, so distances along the ray are the same before and
+    // after the transform.
+    Ray apply(const Ray& ray) const {
+        return {apply_point(ray.origin()), apply_vector(ray.direction())};
+    }
+
+    // Bounds of the transformed box.
+    Aabb apply(const Aabb& box) const {
+        Aabb bounds;
+        for (int corner = 0; corner < 8; corner++) {
+            Vec3 point{
+                corner & 1 ? box.max()[0] : box.min()[0],
+                corner & 2 ? box.max()[1] : box.min()[1],
+                corner & 4 ? box.max()[2] : box.min()[2]};
+            bounds.expand(apply_point(point));
+        }
+        return bounds;
+    }
+
+    // Only valid for invertible transforms.
+    Transform inverse() const {
+        // The inverse of the linear part is its adjugate over its determinant.
+        Vec3 c0 = cross(rows_[1], rows_[2]);
+        Vec3 c1 = cross(rows_[2], rows_[0]);
+        Vec3 c2 = cross(rows_[0], rows_[1]);
+        double inverse_determinant = 1.0 / dot(rows_[0], c0);
+        std::array<Vec3, 3> rows = {
+            Vec3{c0[0], c1[0], c2[0]} * inverse_determinant,
+            Vec3{c0[1], c1[1], c2[1]} * inverse_determinant,
+            Vec3{c0[2], c1[2], c2[2]} * inverse_determinant,
+        };
+        Transform inverse{rows, Vec3{0, 0, 0}};
+        inverse.translation_ = -inverse.apply_vector(translation_);
+        return inverse;
+    }
+
+private:
+    std::array<Vec3, 3> rows_;
+    Vec3 translation_;
+};
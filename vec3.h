@@ -4,6 +4,7 @@
 #include <string>
 #include <sstream>
 #include <iostream>
+#include <type_traits>
 
 namespace {
     static constexpr double sqr(double x) {
@@ -11,109 +12,148 @@ namespace {
     }
 }
 
-class Vec3 {
-public:
-    constexpr Vec3() : e{0, 0, 0} {}
-    constexpr Vec3(const Vec3& v) : e{v[0], v[1], v[2]} {}
-    constexpr Vec3(double e0, double e1, double e2) : e{e0, e1, e2} {}
-
-    constexpr double x() const { return e[0]; }
-    constexpr double y() const { return e[1]; }
-    constexpr double z() const { return e[2]; }
+// Scalar type of the geometry and color math, chosen at build time (see the `precision`
+// option in meson_options.txt). Single precision halves the memory traffic of rays, hits
+// and framebuffers; double precision is the default and what reference images use.
+#ifdef RT_USE_FLOAT
+using Real = float;
+#else
+using Real = double;
+#endif
+
+// Three component vector of `T`. With `Width` 4 the components are padded with a
+// fourth, zero lane and the vector is aligned to its size, so it loads into one SSE
+// (float) or AVX (double) register.
+template <typename T, int Width = 3>
+class BasicVec3 {
+    static_assert(Width == 3 || Width == 4);
 
-    constexpr Vec3 operator-() const { 
-        return Vec3(-e[0], -e[1], -e[2]); 
+public:
+    using Scalar = T;
+
+    constexpr BasicVec3() : e{} {}
+    constexpr BasicVec3(const BasicVec3& v) : e{v[0], v[1], v[2]} {}
+    // Components of any arithmetic type are converted, so literals and double
+    // expressions build a vector of either precision.
+    template <typename A, typename B, typename C, typename = std::enable_if_t<
+        std::is_arithmetic_v<A> && std::is_arithmetic_v<B> && std::is_arithmetic_v<C>>>
+    constexpr BasicVec3(A e0, B e1, C e2) : e{static_cast<T>(e0), static_cast<T>(e1), static_cast<T>(e2)} {}
+    // Conversion between precisions or widths has to be spelled out.
+    template <typename U, int OtherWidth>
+    constexpr explicit BasicVec3(const BasicVec3<U, OtherWidth>& v) : BasicVec3(v[0], v[1], v[2]) {}
+
+    constexpr BasicVec3& operator=(const BasicVec3& v) = default;
+
+    constexpr T x() const { return e[0]; }
+    constexpr T y() const { return e[1]; }
+    constexpr T z() const { return e[2]; }
+
+    constexpr BasicVec3 operator-() const {
+        return BasicVec3(-e[0], -e[1], -e[2]);
     }
 
-    constexpr double operator[](int i) const { 
-        return e[i]; 
+    constexpr T operator[](int i) const {
+        return e[i];
     }
 
-    constexpr double& operator[](int i) { 
-        return e[i]; 
+    constexpr T& operator[](int i) {
+        return e[i];
     }
 
-    constexpr Vec3& operator +=(const Vec3& v) {
+    constexpr BasicVec3& operator +=(const BasicVec3& v) {
         e[0] += v[0];
         e[1] += v[1];
         e[2] += v[2];
         return *this;
     }
 
-    constexpr Vec3& operator *=(const double t) {
+    constexpr BasicVec3& operator *=(const T t) {
         e[0] *= t;
         e[1] *= t;
         e[2] *= t;
         return *this;
     }
 
-    constexpr Vec3& operator /=(const double t) {
-        return (*this) *= 1.0 / t;
+    constexpr BasicVec3& operator /=(const T t) {
+        return (*this) *= T{1} / t;
     }
 
-    double length() const {
+    T length() const {
         return std::sqrt(length_squared());
     }
 
-    constexpr double length_squared() const {
-        return sqr(e[0]) + sqr(e[1]) + sqr(e[2]);
+    constexpr T length_squared() const {
+        return e[0] * e[0] + e[1] * e[1] + e[2] * e[2];
     }
 
-    constexpr bool is_near_zero(double eps = 0.001) const {
+    constexpr bool is_near_zero(T eps = T(0.001)) const {
         return abs(e[0]) < eps && abs(e[1]) < eps && abs(e[2]) < eps;
     }
 
+    // The operators are found through the vector type, so scalars of other types convert
+    // to `T` instead of failing template deduction.
+    friend BasicVec3 operator + (const BasicVec3& lhs, const BasicVec3& rhs) {
+        return BasicVec3(lhs[0] + rhs[0], lhs[1] + rhs[1], lhs[2] + rhs[2]);
+    }
 
-private:
-    double e[3];
-};
+    friend BasicVec3 operator - (const BasicVec3& lhs, const BasicVec3& rhs) {
+        return lhs + (-rhs);
+    }
 
-// TODO: I want to have a proper serializer, not just assume the serialization format.
-// inline std::ostream& operator << (std::ostream&)
+    friend BasicVec3 operator * (const BasicVec3& lhs, const BasicVec3& rhs) {
+        return BasicVec3(lhs[0] * rhs[0], lhs[1] * rhs[1], lhs[2] * rhs[2]);
+    }
 
-inline Vec3 operator + (const Vec3& lhs, const Vec3& rhs) {
-    return Vec3(lhs[0] + rhs[0], lhs[1] + rhs[1], lhs[2] + rhs[2]);
-}
+    friend BasicVec3 operator * (const BasicVec3& v, T t) {
+        return BasicVec3(t * v[0], t * v[1], t * v[2]);
+    }
 
-inline Vec3 operator - (const Vec3& lhs, const Vec3& rhs) {
-    return lhs + (-rhs);
-}
+    friend BasicVec3 operator * (T t, const BasicVec3& v) {
+        return v * t;
+    }
 
-inline Vec3 operator * (const Vec3& lhs, const Vec3& rhs) {
-    return Vec3(lhs[0] * rhs[0], lhs[1] * rhs[1], lhs[2] * rhs[2]);
-}
+    friend BasicVec3 operator / (const BasicVec3& v, T t) {
+        return (T{1} / t) * v;
+    }
 
-inline Vec3 operator * (const Vec3& v, double t) {
-    return Vec3(t * v[0], t * v[1], t * v[2]);
-}
+private:
+    alignas(Width == 4 ? 4 * sizeof(T) : alignof(T)) T e[Width];
+};
 
-inline Vec3 operator * (double t, const Vec3& v) {
-    return v * t;
-}
+using Vec3 = BasicVec3<Real>;
+using Vec3f = BasicVec3<float>;
+using Vec3d = BasicVec3<double>;
+// Padded to four lanes for aligned SIMD loads.
+using AlignedVec3 = BasicVec3<Real, 4>;
 
-inline Vec3 operator / (const Vec3& v, double t) {
-    return (1.0 / t) * v;
-}
+// TODO: I want to have a proper serializer, not just assume the serialization format.
+// inline std::ostream& operator << (std::ostream&)
 
-inline double dot(const Vec3& u, const Vec3& v) {
+template <typename T, int Width>
+inline T dot(const BasicVec3<T, Width>& u, const BasicVec3<T, Width>& v) {
     return u[0] * v[0] + u[1] * v[1] + u[2] * v[2];
 }
 
-inline Vec3 cross(const Vec3& u, const Vec3& v) {
-    return Vec3(u[1] * v[2] - u[2] * v[1],
-                u[2] * v[0] - u[0] * v[2],
-                u[0] * v[1] - u[1] * v[0]);
+template <typename T, int Width>
+inline BasicVec3<T, Width> cross(const BasicVec3<T, Width>& u, const BasicVec3<T, Width>& v) {
+    return BasicVec3<T, Width>(u[1] * v[2] - u[2] * v[1],
+                               u[2] * v[0] - u[0] * v[2],
+                               u[0] * v[1] - u[1] * v[0]);
 }
 
-inline Vec3 unit_vector(const Vec3& v) {
+template <typename T, int Width>
+inline BasicVec3<T, Width> unit_vector(const BasicVec3<T, Width>& v) {
     return v / v.length();
 }
 
-inline Vec3 lerp_vector(double t, const Vec3& start, const Vec3& end) {
-    return (1.0 - t) * start + t * end;
+template <typename T, int Width>
+inline BasicVec3<T, Width> lerp_vector(
+        typename BasicVec3<T, Width>::Scalar t, const BasicVec3<T, Width>& start, const BasicVec3<T, Width>& end) {
+    return (T{1} - t) * start + t * end;
 }
 
-std::string to_debug(const Vec3& v) {
+template <typename T, int Width>
+std::string to_debug(const BasicVec3<T, Width>& v) {
     std::stringstream ss;
     ss << "(" << v[0] << ", " << v[1] << ", " << v[2] << ")";
     return ss.str();
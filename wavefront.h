@@ -0,0 +1,238 @@
+#pragma once
+
+#include <algorithm>
+#include <array>
+#include <cmath>
+#include <cstddef>
+#include <cstdint>
+#include <optional>
+#include <type_traits>
+#include <utility>
+#include <variant>
+#include <vector>
+
+#include "engine.h"
+#include "hit_record.h"
+#include "material.h"
+#include "ray.h"
+#include "ray_packet.h"
+#include "sampler.h"
+#include "stats.h"
+#include "vec3.h"
+#include "world.h"
+
+// A camera ray and the sampler its path continues with.
+struct PathStart {
+    Ray ray;
+    Sampler sampler;
+};
+
+// Path tracer that advances a batch of paths together, one bounce at a time: every path
+// is intersected, the hits are grouped by material type, and each group is scattered by
+// a loop over that one material type, with no dispatch per hit. The paths of a batch end
+// up with the same colors as traced one by one with PathTracing::iterative, since each
+// keeps its own sampler and draws the same numbers in the same order.
+class WavefrontEngine {
+public:
+    explicit WavefrontEngine(const EngineOptions& options = {}) : engine_{options}, options_{options} {}
+
+    // Traces `count` paths, the i-th starting from `start_path(i)`, and writes its color to
+    // `colors[i]` and its first hit, if `first_hits` is given, to `first_hits[i]`.
+    template <typename StartPathFn>
+    void trace(
+            const World& world, int max_depth, std::size_t count, StartPathFn&& start_path,
+            Vec3* colors, FirstHit* first_hits = nullptr) {
+        const std::size_t batch_size = std::max(1, options_.wavefront_batch_size);
+        for (std::size_t first = 0; first < count; first += batch_size) {
+            std::size_t end = std::min(count, first + batch_size);
+            paths_.clear();
+            for (std::size_t i = first; i < end; i++) {
+                PathStart start = start_path(i);
+                paths_.push_back({start.ray, white_color, start.sampler, static_cast<uint32_t>(i)});
+                colors[i] = black_color;
+            }
+            for (int depth = 0; depth < max_depth && !paths_.empty(); depth++) {
+                intersect(world, depth, colors, first_hits);
+                shade(world, depth, colors);
+            }
+            // No more light is gathered if the ray bounce limit is exceeded.
+            RT_STATS(for (std::size_t i = 0; i < paths_.size(); i++) {
+                counters.end_path(max_depth, PathTermination::depth_limit);
+            });
+        }
+    }
+
+    // Number of rays cast since this engine was created.
+    uint64_t rays_traced() const {
+        return engine_.rays_traced();
+    }
+
+private:
+    struct Path {
+        Ray ray;
+        Vec3 throughput;
+        Sampler sampler;
+        // Where the color of the path goes. Light is added to it as the path finds it.
+        uint32_t index;
+        ScatterVertex from = {};
+    };
+
+    static constexpr std::size_t material_types = std::variant_size_v<Material>;
+    // Bounces traced in packets: camera rays and the first bounce. Later bounces have
+    // spread out too far for packets to share much of the traversal.
+    static constexpr int packet_depths = 2;
+
+    // Finds the closest hit of every path. Paths that escape end here, the others move to
+    // `hit_paths_` with their hit in `hits_`.
+    void intersect(const World& world, int depth, Vec3* colors, FirstHit* first_hits) {
+        hit_paths_.clear();
+        hits_.clear();
+        ray_hits_.resize(paths_.size());
+        if (depth < packet_depths && options_.packet_size >= 2) {
+            intersect_packets(world);
+        } else {
+            for (std::size_t i = 0; i < paths_.size(); i++) {
+                ray_hits_[i] = engine_.hit_world(world, paths_[i].ray, 0.001, POSITIVE_INFINITY);
+            }
+        }
+        for (std::size_t i = 0; i < paths_.size(); i++) {
+            Path& path = paths_[i];
+            const std::optional<HitRecord>& hit_record = ray_hits_[i];
+            if (depth == 0 && first_hits) {
+                first_hits[path.index] = engine_.make_first_hit(path.ray, hit_record, world);
+            }
+            if (!hit_record) {
+                RT_STATS(counters.end_path(depth, PathTermination::escaped));
+                colors[path.index] += path.throughput * engine_.sky_color(path.ray);
+                continue;
+            }
+            hit_paths_.push_back(std::move(path));
+            hits_.push_back(*hit_record);
+        }
+    }
+
+    // Traces the rays of `paths_` in packets. Paths come in pixel order, so neighbouring
+    // rays start close together; grouping them by direction octant, in that order, keeps
+    // the packets coherent even after a diffuse bounce.
+    void intersect_packets(const World& world) {
+        std::array<uint32_t, 9> starts = {};
+        types_.resize(paths_.size());
+        for (std::size_t i = 0; i < paths_.size(); i++) {
+            const Vec3& direction = paths_[i].ray.direction();
+            types_[i] = std::signbit(direction[0]) | std::signbit(direction[1]) << 1 | std::signbit(direction[2]) << 2;
+            starts[types_[i] + 1]++;
+        }
+        for (std::size_t octant = 0; octant < 8; octant++) {
+            starts[octant + 1] += starts[octant];
+        }
+        order_.resize(paths_.size());
+        std::array<uint32_t, 8> next = {};
+        std::copy(starts.begin(), starts.end() - 1, next.begin());
+        for (std::size_t i = 0; i < paths_.size(); i++) {
+            order_[next[types_[i]]++] = i;
+        }
+
+        const int packet_size = std::min(options_.packet_size, RayPacket::max_size);
+        std::array<Ray, RayPacket::max_size> rays;
+        std::array<std::optional<HitRecord>, RayPacket::max_size> hits;
+        for (std::size_t octant = 0; octant < 8; octant++) {
+            for (uint32_t first = starts[octant]; first < starts[octant + 1]; first += packet_size) {
+                int count = std::min<uint32_t>(packet_size, starts[octant + 1] - first);
+                for (int k = 0; k < count; k++) {
+                    rays[k] = paths_[order_[first + k]].ray;
+                }
+                engine_.hit_world_packet(world, rays.data(), count, 0.001, POSITIVE_INFINITY, hits.data());
+                for (int k = 0; k < count; k++) {
+                    ray_hits_[order_[first + k]] = std::move(hits[k]);
+                }
+            }
+        }
+    }
+
+    // Scatters the hits one material type at a time. The paths that go on are collected
+    // in `paths_` for the next bounce, grouped the same way.
+    void shade(const World& world, int depth, Vec3* colors) {
+        // Counting sort of the hits by the type of their material.
+        std::array<uint32_t, material_types + 1> starts = {};
+        types_.resize(hits_.size());
+        for (std::size_t i = 0; i < hits_.size(); i++) {
+            types_[i] = world.material(hits_[i].material_id).index();
+            starts[types_[i] + 1]++;
+        }
+        for (std::size_t type = 0; type < material_types; type++) {
+            starts[type + 1] += starts[type];
+        }
+        order_.resize(hits_.size());
+        std::array<uint32_t, material_types> next = {};
+        std::copy(starts.begin(), starts.end() - 1, next.begin());
+        for (std::size_t i = 0; i < hits_.size(); i++) {
+            order_[next[types_[i]]++] = i;
+        }
+
+        paths_.clear();
+        shade_types(world, depth, colors, starts, std::make_index_sequence<material_types>{});
+    }
+
+    template <std::size_t... Types>
+    void shade_types(
+            const World& world, int depth, Vec3* colors, const std::array<uint32_t, material_types + 1>& starts,
+            std::index_sequence<Types...>) {
+        (shade_type<Types>(world, depth, colors, starts[Types], starts[Types + 1]), ...);
+    }
+
+    // Scatters the hits in order_[begin, end), which all have a material of type `Type`.
+    // Lights add their emission and diffuse surfaces sample the lights, as in
+    // Engine::ray_color, with the same numbers drawn in the same order.
+    template <std::size_t Type>
+    void shade_type(const World& world, int depth, Vec3* colors, uint32_t begin, uint32_t end) {
+        using MaterialType = std::variant_alternative_t<Type, Material>;
+        const bool sample_lights = std::is_same_v<MaterialType, LambertianMaterial> && engine_.samples_lights(world);
+        for (uint32_t k = begin; k < end; k++) {
+            uint32_t i = order_[k];
+            Path& path = hit_paths_[i];
+            const HitRecord& hit_record = hits_[i];
+            const auto& material = std::get<Type>(world.material(hit_record.material_id));
+            RT_STATS(counters.material_hits[Type]++);
+            if constexpr (std::is_same_v<MaterialType, EmissiveMaterial>) {
+                colors[path.index] += path.throughput * engine_.emitted(world, hit_record, material, path.from);
+            }
+            if constexpr (std::is_same_v<MaterialType, LambertianMaterial>) {
+                if (sample_lights) {
+                    colors[path.index] += path.throughput
+                        * engine_.sample_direct_light(world, hit_record, material, depth, path.sampler);
+                }
+            }
+
+            path.sampler.start_dimension(Sampler::bounce_dimension(depth));
+            std::optional<ScatteredRay> scattered_ray = material.scatter(
+                path.ray, as_scatter_info(hit_record), path.sampler);
+            if (!scattered_ray) {
+                RT_STATS(counters.end_path(depth, PathTermination::absorbed));
+                continue;
+            }
+            path.from = {hit_record.point, 0.0};
+            if constexpr (std::is_same_v<MaterialType, LambertianMaterial>) {
+                if (sample_lights) {
+                    path.from.pdf = material.scatter_pdf(hit_record.normal, scattered_ray->ray.direction());
+                }
+            }
+            path.throughput = path.throughput * scattered_ray->attenuation_color;
+            if (!engine_.survives_russian_roulette(depth, path.throughput, path.sampler)) {
+                RT_STATS(counters.end_path(depth + 1, PathTermination::russian_roulette));
+                continue;
+            }
+            path.ray = scattered_ray->ray;
+            paths_.push_back(std::move(path));
+        }
+    }
+
+    Engine engine_;
+    EngineOptions options_;
+    // Scratch space, reused from batch to batch.
+    std::vector<Path> paths_;
+    std::vector<Path> hit_paths_;
+    std::vector<HitRecord> hits_;
+    std::vector<std::optional<HitRecord>> ray_hits_;
+    std::vector<uint8_t> types_;
+    std::vector<uint32_t> order_;
+};
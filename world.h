@@ -1,32 +1,250 @@
 #pragma once
 
+#include <algorithm>
+#include <cassert>
+#include <cstdint>
+#include <memory>
 #include <vector>
 #include <optional>
 #include <tuple>
 #include <variant>
 
+#include "bvh.h"
+#include "content_hash.h"
+#include "hit_record.h"
+#include "instance.h"
 #include "material.h"
+#include "mesh.h"
 #include "sphere.h"
+#include "sphere_set.h"
+#include "sphere_soa.h"
 
-using Object = std::variant<Sphere>;
+using Object = std::variant<Sphere, TriangleMesh, Instance>;
 
+Aabb bounding_box(const Object& object) {
+  return std::visit([](const auto& o) { return o.bounding_box(); }, object);
+}
+
+namespace detail {
+  struct HashMaterialFn {
+    ContentHash& hash;
+
+    void operator() (const LambertianMaterial& material) {
+      add_color(material.albedo);
+    }
+
+    void operator() (const MetalMaterial& material) {
+      add_color(material.albedo);
+      hash.add_value(material.fuzz);
+    }
+
+    void operator() (const DielectricMaterial& material) {
+      hash.add_value(material.refraction_index);
+    }
+
+    void operator() (const EmissiveMaterial& material) {
+      add_color(material.emitted);
+    }
+
+    void add_color(const Vec3& color) {
+      hash.add_value(color[0]);
+      hash.add_value(color[1]);
+      hash.add_value(color[2]);
+    }
+  };
+
+  void hash_box(ContentHash& hash, const Aabb& box) {
+    for (int axis = 0; axis < 3; axis++) {
+      hash.add_value(box.min()[axis]);
+      hash.add_value(box.max()[axis]);
+    }
+  }
+
+  void hash_bvh(ContentHash& hash, const std::optional<Bvh>& bvh) {
+    hash.add_value(bvh ? bvh->nodes().size() : 0);
+    for (std::size_t i = 0; bvh && i < bvh->nodes().size(); i++) {
+      const BvhNode& node = bvh->nodes().data()[i];
+      hash_box(hash, node.bounds);
+      hash.add_value(node.offset);
+      hash.add_value(node.count);
+      hash.add_value(node.axis);
+    }
+  }
+}
+
+// Scene geometry and materials. Materials live once in a dense table and geometry refers
+// to them by a 32-bit id. Spheres are kept in a structure-of-arrays store that the SIMD
+// kernels read directly. Every other object is kept as an instance of shared geometry
+// (a mesh added on its own becomes an instance of itself). The hierarchy over the instance
+// bounds is the top level of two: each shared geometry has its own below it.
 class World {
 public:
   World() {}
   
   void clear() {
-    objects_.clear();
+    spheres_.clear();
+    instances_.clear();
+    instance_material_ids_.clear();
+    materials_.clear();
+    lights_.clear();
+    bvh_.reset();
+    instance_bvh_.reset();
   }
 
+  void reserve_materials(std::size_t count) {
+    materials_.reserve(count);
+  }
+
+  MaterialId add_material(Material material) {
+    materials_.push_back(std::move(material));
+    return materials_.size() - 1;
+  }
+
+  // Instances of a SphereSet keep the materials of its spheres, so `material_id` only
+  // matters for spheres, meshes and instances of meshes.
+  void add(Object&& object, MaterialId material_id) {
+    assert(material_id < materials_.size());
+    if (const Sphere* sphere = std::get_if<Sphere>(&object)) {
+      if (std::holds_alternative<EmissiveMaterial>(materials_[material_id])) {
+        lights_.push_back(spheres_.size());
+      }
+      spheres_.add(*sphere, material_id);
+    } else if (TriangleMesh* mesh = std::get_if<TriangleMesh>(&object)) {
+      instances_.emplace_back(std::make_shared<const InstanceGeometry>(std::move(*mesh)));
+      instance_material_ids_.push_back(material_id);
+    } else {
+      instances_.push_back(std::move(std::get<Instance>(object)));
+      instance_material_ids_.push_back(material_id);
+    }
+    // The hierarchies no longer cover every object, they have to be rebuilt.
+    bvh_.reset();
+    instance_bvh_.reset();
+  }
+
+  // Adds the object with a material of its own. Use add_material() to share one.
   void add(Object&& object, Material material) {
-    objects_.push_back({std::move(object), std::move(material)});
+    add(std::move(object), add_material(std::move(material)));
+  }
+
+  // Replaces the spheres with ones already in the leaf order of `bvh`, as stored in a
+  // scene file. Their material ids have to be valid in this world.
+  void set_spheres(SphereSoA spheres, Bvh bvh) {
+    spheres_ = std::move(spheres);
+    bvh_.emplace(std::move(bvh));
+    find_lights();
+  }
+
+  const SphereSoA& spheres() const {
+    return spheres_;
   }
 
-  const std::vector<std::tuple<Object, Material>>& objects() const {
-      return objects_;
+  // Everything other than spheres, and the material each was added with.
+  const std::vector<Instance>& instances() const {
+    return instances_;
+  }
+
+  MaterialId instance_material_id(uint32_t index) const {
+    return instance_material_ids_[index];
+  }
+
+  const Material& material(MaterialId material_id) const {
+    return materials_[material_id];
+  }
+
+  const std::vector<Material>& materials() const {
+    return materials_;
+  }
+
+  // Indices of the spheres with an emissive material, in ascending order. These are the
+  // lights the engine samples directly.
+  const std::vector<uint32_t>& lights() const {
+    return lights_;
+  }
+
+  // Index into lights() of the sphere, or `no_light` if it does not emit.
+  uint32_t light_of_sphere(uint32_t sphere_index) const {
+    auto light = std::lower_bound(lights_.begin(), lights_.end(), sphere_index);
+    return light != lights_.end() && *light == sphere_index ? light - lights_.begin() : no_light;
+  }
+
+  // Builds the acceleration structures over the current spheres and instances. Call
+  // it once the scene is complete; until then (or without it) the engine falls back to a
+  // linear scan. Both are reordered so that every leaf covers a contiguous run of them.
+  void build_bvh(const BvhBuildOptions& options = {}) {
+    bvh_.emplace(build_sphere_bvh(spheres_, options));
+    find_lights();
+
+    std::vector<BvhPrimitive> primitives;
+    primitives.reserve(instances_.size());
+    for (const Instance& instance : instances_) {
+      Aabb bounds = instance.bounding_box();
+      primitives.push_back({bounds, bounds.centroid()});
+    }
+    Bvh instance_bvh{primitives, options};
+    std::vector<uint32_t> order = instance_bvh.release_primitive_indices();
+    std::vector<Instance> instances;
+    std::vector<MaterialId> instance_material_ids;
+    instances.reserve(order.size());
+    instance_material_ids.reserve(order.size());
+    for (uint32_t index : order) {
+      instances.push_back(std::move(instances_[index]));
+      instance_material_ids.push_back(instance_material_ids_[index]);
+    }
+    instances_ = std::move(instances);
+    instance_material_ids_ = std::move(instance_material_ids);
+    instance_bvh_.emplace(std::move(instance_bvh));
+  }
+
+  const std::optional<Bvh>& bvh() const {
+    return bvh_;
+  }
+
+  const std::optional<Bvh>& instance_bvh() const {
+    return instance_bvh_;
+  }
+
+  // Hash of the spheres, materials, instances and hierarchies, to check that another
+  // process or a checkpoint has the same scene. Instances count by their bounds and
+  // materials; the shared geometry under them is not hashed triangle by triangle.
+  uint64_t content_hash() const {
+    ContentHash hash;
+    hash.add_array(spheres_.xs(), spheres_.size());
+    hash.add_array(spheres_.ys(), spheres_.size());
+    hash.add_array(spheres_.zs(), spheres_.size());
+    hash.add_array(spheres_.radii(), spheres_.size());
+    hash.add_array(spheres_.material_ids(), spheres_.size());
+    hash.add_value(materials_.size());
+    for (const Material& material : materials_) {
+      hash.add_value(material.index());
+      std::visit(detail::HashMaterialFn{hash}, material);
+    }
+    hash.add_value(instances_.size());
+    for (std::size_t i = 0; i < instances_.size(); i++) {
+      detail::hash_box(hash, instances_[i].bounding_box());
+      hash.add_value(instance_material_ids_[i]);
+      hash.add_value(instances_[i].material().has_value());
+      hash.add_value(instances_[i].material().value_or(0));
+    }
+    detail::hash_bvh(hash, bvh_);
+    detail::hash_bvh(hash, instance_bvh_);
+    return hash.value();
   }
 
 private:
-  std::vector<std::tuple<Object, Material>> objects_;
+  void find_lights() {
+    lights_.clear();
+    for (uint32_t i = 0; i < spheres_.size(); i++) {
+      if (std::holds_alternative<EmissiveMaterial>(materials_[spheres_.material_id(i)])) {
+        lights_.push_back(i);
+      }
+    }
+  }
 
+  SphereSoA spheres_;
+  std::vector<Instance> instances_;
+  std::vector<MaterialId> instance_material_ids_;
+  std::vector<Material> materials_;
+  std::vector<uint32_t> lights_;
+  std::optional<Bvh> bvh_;
+  std::optional<Bvh> instance_bvh_;
 };